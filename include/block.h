@@ -0,0 +1,60 @@
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "needle.h"
+
+#if !defined(BLOCK_H)
+#define BLOCK_H
+
+// 压缩归档：combineFile --compress 把按顺序排列的文件数据切成 block_size 大小的块，
+// 每块单独用 zstd 压缩后依次写入大文件，块的位置记录在 BLOCKFILE 中
+// 读取时按逻辑偏移找到所在的块，解压后放入 BlockCache
+
+// 载入 BLOCKFILE，文件不存在时 blocks->block_size 为 0
+// 成功返回块数，失败返回 -1
+int64_t load_block_index(struct block_index *blocks);
+// 先写临时文件再 rename
+// 成功返回 0，失败返回 -1
+int write_block_index(const struct block_index &blocks);
+
+// 编译时是否带有 zstd
+bool compression_available();
+// 压缩 src 中的 size 个字节，结果放在 dst 中，压缩后不比原来小时 dst 中是原始数据
+// 成功返回 0，失败返回 -1
+int compress_block(const char *src, size_t size, int level, std::vector<char> &dst);
+// 把 src 解压到 dst 中，raw_size 是块的原始大小
+// 成功返回 0，失败返回 -1
+int decompress_block(const char *src, size_t size, char *dst, size_t raw_size);
+
+// 解压后的块的缓存，按块号分成多个分片，每个分片各自按 LRU 淘汰
+class BlockCache {
+public:
+    typedef std::shared_ptr<const std::vector<char>> block_ptr;
+
+    explicit BlockCache(size_t capacity);
+    // 不在缓存中时返回 nullptr
+    block_ptr get(uint64_t block_i);
+    void put(uint64_t block_i, block_ptr block);
+
+private:
+    static const size_t shard_n = 16;
+    struct Shard {
+        std::mutex mutex;
+        size_t size = 0;
+        // 最近用过的在前
+        std::list<std::pair<uint64_t, block_ptr>> lru;
+        std::unordered_map<uint64_t, std::list<std::pair<uint64_t, block_ptr>>::iterator> blocks;
+    };
+    size_t shard_capacity;
+    Shard shards[shard_n];
+};
+
+// 从压缩归档中读取逻辑偏移 offset 处的 size 个字节
+// 成功返回读到的字节数，失败返回 -errno
+ssize_t read_blocks(const struct needle_index_list *index_list, BlockCache *cache,
+                    char *buf, size_t size, uint64_t offset);
+
+#endif
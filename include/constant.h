@@ -12,11 +12,20 @@
 #define FILESUFFIX ".txt"
 #define INDEXFILE "indexfile"
 #define BIGFILE "bigfile"
+#define DELTAFILE "indexfile.delta"  // 追加合并的文件的索引，格式和 INDEXFILE 相同
+#define BIGFILE_COMPACT "bigfile.compact"  // sfcas-compact 写出的新大文件
+#define INDEXFILE_COMPACT "indexfile.compact"  // 新大文件的索引，存在时说明 sfcas-compact 还没替换完
+#define BLOCKFILE "indexfile.blocks"  // 压缩归档的块索引，不存在时大文件没有压缩
+#define SINDEX_CONFIG_FILE "./config/sindex.ini"
 
 // 常数宏定义
-#define MAX_FILE_LEN 50
+#define MAX_FILE_LEN 255     // 文件名（相对路径）最大长度，不能超过 255
 #define NEEDLE_BASIC_SIZE 17    // 4(needle_size) + 1(flags) + 8(offset) + 4(size)
 #define FILE_EXIT 0x1
+#define FILE_CRC 0x2    // needle 在 size 之后多记录 4 字节的文件内容 CRC32C
+#define NEEDLE_CRC_SIZE 4
+#define COMPACT_MIN_DELTA 4096  // 插入引擎的文件至少有这么多时才在后台合并成新的归档
+#define COMPRESS_BLOCK_SIZE 65536  // 压缩归档默认的块大小（未压缩）
 #define BUFFER_SIZE 1024
 #define PATH_SIZE 1024
 #define FILE_ID_LEN 10
@@ -0,0 +1,166 @@
+#include <atomic>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "needle.h"
+#if defined(USE_SINDEX)
+#include "sindex.h"
+#endif
+
+#if !defined(ENGINE_H)
+#define ENGINE_H
+
+// 可选的查找引擎
+enum class engine_type_t { sindex, binary, hash };
+
+// 没有分组的引擎（二分查找、哈希表）按 indexs 的下标每这么多个 needle 分一段
+#define ENGINE_RUN_SIZE 4096
+
+// 建好之后插入的 needle，按文件名排序，同名时只保留最后插入的一个
+// 插入时复制一份新的数组整体替换，读者拿到的数组不会再改变
+typedef std::vector<const struct needle_index *> delta_entries_t;
+typedef std::shared_ptr<const delta_entries_t> delta_ptr;
+
+// 查找引擎接口
+// 所有引擎都建立在按 filename 排好序的 indexs 之上，查找得到的是 needle 在 indexs 中的下标
+// 引擎本身不拥有 indexs，build 之后 indexs 不能再改变
+// indexs 按 key 分成若干段（SIndex 的每个组是一段，其他引擎每 ENGINE_RUN_SIZE 个下标一段）
+// build 之后新增、覆盖和删除的 needle 插入所在段的 delta 数组
+// get、lower_bound、range、scan 只查 indexs，find 和 NeedleCursor 能看到插入的 needle
+class IndexEngine {
+public:
+    virtual ~IndexEngine() {}
+
+    virtual void build(std::vector<struct needle_index> &indexs) = 0;
+    virtual bool get(const index_key_t &key, uint64_t &pos) const = 0;
+    // 批量查找，返回找到的个数，found[i] 标记第 i 个 key 是否存在
+    virtual size_t get_batch(const index_key_t *keys, size_t n, uint64_t *poss, bool *found) const;
+    // 第一个不小于 key 的下标，不存在时返回 indexs 的大小
+    virtual uint64_t lower_bound(const index_key_t &key) const;
+    // [begin_key, end_key) 内的 key 所对应的下标范围 [first, last)
+    void range(const index_key_t &begin_key, const index_key_t &end_key,
+               uint64_t &first, uint64_t &last) const;
+    // 以 prefix 开头的至多 limit 个 key 所对应的下标范围 [first, last)
+    void scan(const index_key_t &prefix, size_t limit, uint64_t &first, uint64_t &last) const;
+    // 引擎自身占用的内存（不含 indexs）
+    virtual size_t memory_usage() const = 0;
+    virtual const char *name() const = 0;
+
+    // 插入 needle，同名时覆盖 indexs 中和之前插入的，flags 中没有 FILE_EXIT 的表示删除
+    // needle 由调用者保存，引擎销毁前不能释放或修改；插入由调用者串行化，查找不用加锁
+    // 每段只复制一次 delta 数组，代价是所在段已插入的 needle 数
+    void insert(const std::vector<const struct needle_index *> &needles);
+    // 先查所在段的 delta 数组再查 indexs，删除的 needle 也会返回
+    const struct needle_index *find(const index_key_t &key) const;
+    // 插入的 needle 总数（同名覆盖的不重复计算）
+    size_t delta_size() const { return delta_n.load(std::memory_order_acquire); }
+
+    // indexs 为空时也有一段
+    virtual size_t run_num() const;
+    // key 所在的段，小于所有 key 的算作第 0 段
+    // 默认在每段的第一个 key 上二分查找
+    virtual size_t locate_run(const index_key_t &key) const;
+    // 段内 needle 在 indexs 中的下标范围 [begin, end)
+    virtual void run_range(size_t run_i, uint64_t &begin, uint64_t &end) const;
+    // 段内插入的 needle，没有时为空
+    delta_ptr run_delta(size_t run_i) const;
+    const struct needle_index &needle_at(uint64_t pos) const { return (*indexs)[pos]; }
+
+protected:
+    // 在已经定位的段中查找，不用再定位一次
+    virtual bool get_in_run(size_t run_i, const index_key_t &key, uint64_t &pos) const { return get(key, pos); }
+
+    std::vector<struct needle_index> *indexs = nullptr;
+
+private:
+    // 第一次插入时按段数分配，之后每个元素只能通过 std::atomic_load / std::atomic_store 访问
+    // delta_n 为 0 时读者不会访问
+    std::vector<delta_ptr> deltas;
+    std::atomic<size_t> delta_n{0};
+};
+
+// 按文件名顺序遍历 indexs 和插入的 needle，同名时只给出插入的，跳过删除的
+// 每段的 delta 数组在进入该段时取得，遍历期间插入的 needle 不一定能看到
+class NeedleCursor {
+public:
+    explicit NeedleCursor(const IndexEngine *engine) : engine(engine) {}
+    // 定位到第一个不小于 key 的 needle
+    void seek(const index_key_t &key);
+    // 遍历结束时为 nullptr
+    const struct needle_index *get() const { return current; }
+    void next();
+
+private:
+    void enter_run(size_t run_i);
+    // 从当前位置找到下一个没有删除的 needle
+    void settle();
+
+    const IndexEngine *engine;
+    size_t run_i = 0;
+    uint64_t pos = 0, run_end = 0;
+    delta_ptr delta;
+    size_t delta_i = 0;
+    const struct needle_index *current = nullptr;
+    bool from_delta = false;
+};
+
+// 在 indexs 上直接二分查找
+class BinaryEngine : public IndexEngine {
+public:
+    void build(std::vector<struct needle_index> &indexs) override;
+    bool get(const index_key_t &key, uint64_t &pos) const override;
+    size_t memory_usage() const override { return sizeof(*this); }
+    const char *name() const override { return "binary"; }
+
+protected:
+    // 只在段内二分
+    bool get_in_run(size_t run_i, const index_key_t &key, uint64_t &pos) const override;
+};
+
+// 以文件名为 key 的哈希表，只适合点查
+class HashEngine : public IndexEngine {
+public:
+    void build(std::vector<struct needle_index> &indexs) override;
+    bool get(const index_key_t &key, uint64_t &pos) const override;
+    size_t memory_usage() const override;
+    const char *name() const override { return "hash"; }
+
+private:
+    // string_view 指向 indexs 中的文件名，不额外复制
+    std::unordered_map<std::string_view, uint64_t> table;
+};
+
+#if defined(USE_SINDEX)
+typedef sindex::SIndex<index_key_t, uint64_t> sindex_t;
+
+// SIndex 学习索引
+class SIndexEngine : public IndexEngine {
+public:
+    ~SIndexEngine() override;
+    void build(std::vector<struct needle_index> &indexs) override;
+    bool get(const index_key_t &key, uint64_t &pos) const override;
+    uint64_t lower_bound(const index_key_t &key) const override;
+    size_t memory_usage() const override;
+    const char *name() const override { return "sindex"; }
+    // 每个组是一段，插入的 needle 放在所在组的 delta 数组中
+    size_t run_num() const override;
+    size_t locate_run(const index_key_t &key) const override;
+    void run_range(size_t run_i, uint64_t &begin, uint64_t &end) const override;
+
+protected:
+    bool get_in_run(size_t run_i, const index_key_t &key, uint64_t &pos) const override;
+
+private:
+    sindex_t *sindex_model = nullptr;
+};
+#endif
+
+// 根据名字得到引擎类型，失败返回 false
+bool parse_engine_type(const char *name, engine_type_t &type);
+// 没有 MKL 时不编译 SIndex
+bool engine_available(engine_type_t type);
+IndexEngine *create_engine(engine_type_t type);
+
+#endif
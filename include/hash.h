@@ -0,0 +1,95 @@
+#include <cstdint>
+#include <cstring>
+
+#if !defined(HASH_H)
+#define HASH_H
+
+// 128 位的内容哈希，用于按内容去重
+struct hash128_t {
+    uint64_t low, high;
+
+    bool operator==(const struct hash128_t &other) const {
+        return low == other.low && high == other.high;
+    }
+};
+
+// MurmurHash3 x64 128 位版本（Austin Appleby，公有领域），可以分多次输入，结果和一次输入时相同
+class Murmur3Hasher {
+public:
+    explicit Murmur3Hasher(uint64_t seed = 0) : h1(seed), h2(seed) {}
+
+    void update(const void *data, size_t len) {
+        const uint8_t *bytes = (const uint8_t *)data;
+        total_len += len;
+        // 先补齐上次剩下的不足 16 字节的部分
+        if(tail_len > 0) {
+            size_t fill = len < 16 - tail_len ? len : 16 - tail_len;
+            memcpy(tail + tail_len, bytes, fill);
+            tail_len += fill;
+            bytes += fill;
+            len -= fill;
+            if(tail_len < 16) return;
+            mix_block(tail);
+            tail_len = 0;
+        }
+        for(; len >= 16; bytes += 16, len -= 16) mix_block(bytes);
+        memcpy(tail, bytes, len);
+        tail_len = len;
+    }
+
+    hash128_t digest() const {
+        uint64_t d1 = h1, d2 = h2, k1 = 0, k2 = 0;
+        for(size_t i = tail_len; i > 8; --i) k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+        for(size_t i = tail_len < 8 ? tail_len : 8; i > 0; --i) k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+        // 全为 0 的 k 不改变结果，不用区分尾部的长度
+        d2 ^= rotl(k2 * c2, 33) * c1;
+        d1 ^= rotl(k1 * c1, 31) * c2;
+
+        d1 ^= total_len;
+        d2 ^= total_len;
+        d1 += d2;
+        d2 += d1;
+        d1 = fmix(d1);
+        d2 = fmix(d2);
+        d1 += d2;
+        d2 += d1;
+        return {d1, d2};
+    }
+
+private:
+    static constexpr uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1, h2, total_len = 0;
+    uint8_t tail[16];
+    size_t tail_len = 0;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    static uint64_t fmix(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    void mix_block(const uint8_t *block) {
+        uint64_t k1, k2;
+        memcpy(&k1, block, 8);
+        memcpy(&k2, block + 8, 8);
+        h1 ^= rotl(k1 * c1, 31) * c2;
+        h1 = rotl(h1, 27) + h2;
+        h1 = h1 * 5 + 0x52dce729;
+        h2 ^= rotl(k2 * c2, 33) * c1;
+        h2 = rotl(h2, 31) + h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+};
+
+inline hash128_t murmur3_128(const void *data, size_t len, uint64_t seed = 0) {
+    Murmur3Hasher hasher(seed);
+    hasher.update(data, len);
+    return hasher.digest();
+}
+
+#endif
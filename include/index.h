@@ -4,26 +4,38 @@
 #include <vector>
 
 #include "helper.h"
-#include "sindex.h"
+#include "engine.h"
 #include "needle.h"
 
 #if !defined(INDEX_H)
 #define INDEX_H
 
-typedef sindex::SIndex<index_key_t, uint64_t> sindex_t;
-
 // 装载 index 文件内容并得到大文件的文件指针
 // 成功返回 index 数目，失败返回 -1
 int64_t init(struct needle_index_list *index_list);
+// 装载追加合并时写入的 delta 索引，不打开大文件，文件不存在时为空
+// 成功返回 index 数目，失败返回 -1
+int64_t init_delta(struct needle_index_list *delta_list);
+// 把新写入的 needle 追加到 delta 索引末尾，数据和索引都落盘后返回
+// 成功返回 0，失败返回 -1
+int append_delta_index(const std::vector<struct needle_index> &needles);
+// 把 needles 合并进有序的 indexs 中得到新的有序数组，同名时 needles 中的覆盖 indexs 中的
+// needles 会被排序
+void merge_delta_index(const std::vector<struct needle_index> &indexs, std::vector<struct needle_index> &needles,
+                       std::vector<struct needle_index> &merged);
 void release_needle(struct needle_index_list *index_list);
 
-// 从 index_list 中找到对应于 filename 的 needle_index
-struct needle_index *find_index(struct needle_index_list *index_list, const char *filename, sindex_t *sindex_model);
+// 在 engine 中找到对应于 filename 的 needle_index，包括建好引擎之后插入的，已删除的文件返回 nullptr
+// filename 是相对于合并目录的路径
+const struct needle_index *find_index(const char *filename, IndexEngine *engine);
+// dirname 是否是合并文件中的目录，即是否有以 "dirname/" 开头的文件
+bool find_dir(const char *dirname, IndexEngine *engine);
 
-/*  SIndex  */
-sindex_t *get_sindex_model(std::vector<struct needle_index> &indexs);
-inline void release_model(sindex_t *sindex_model) {
-    delete sindex_model;
+/*  Engine  */
+// 在排好序的 indexs 上建立指定类型的查找引擎，indexs 为空时用二分查找代替 SIndex，引擎不可用时返回 nullptr
+IndexEngine *get_index_engine(std::vector<struct needle_index> &indexs, engine_type_t type);
+inline void release_engine(IndexEngine *engine) {
+    delete engine;
 }
 
-#endif
\ No newline at end of file
+#endif
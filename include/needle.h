@@ -20,27 +20,57 @@ struct needle_index {
     // 在 index 文件中该小文件元数据占据的大小
     uint32_t neddle_size;
     uint8_t flags;
+    // flags 中有 FILE_CRC 时为文件内容的 CRC32C
+    uint32_t crc;
 
-    bool operator<(const struct needle_index &other) {
+    bool operator<(const struct needle_index &other) const {
         return this->filename < other.filename;
     }
 };
 
+// 压缩归档中的一个块在大文件中的位置
+// size 等于块的原始大小时没有压缩（压缩后不会更小）
+struct block_entry {
+    uint64_t offset;
+    uint32_t size;
+};
+
+// 压缩归档的块索引
+// needle 的 offset 是在未压缩数据中的逻辑偏移，块号为 offset / block_size，块内偏移为 offset % block_size
+struct block_index {
+    // 为 0 时大文件没有压缩，needle 的 offset 就是在大文件中的偏移
+    uint64_t block_size = 0;
+    // 未压缩数据的总大小，最后一块可能不满
+    uint64_t data_size = 0;
+    std::vector<struct block_entry> blocks;
+
+    uint64_t raw_size(size_t block_i) const {
+        uint64_t begin = block_i * block_size;
+        return data_size - begin < block_size ? data_size - begin : block_size;
+    }
+};
+
 struct needle_index_list {
     std::vector<needle_index> indexs;
     uint64_t index_num;
     FILE *data_file = nullptr;
+    struct block_index blocks;
     struct needle_index *cached_item = nullptr;
     bool is_cached = false;
 };
 
 // 利用小文件信息和大文件中的偏移填充 needle_index
+// filename 是小文件相对于合并目录的路径
+void set_needle_index(struct needle_index *needle, struct stat *file_info, const char *filename, uint64_t offset);
 void set_needle_index(struct needle_index *needle, struct stat *file_info, struct dirent *entry, uint64_t offset);
 
+// 记录文件内容的 CRC32C，needle 在索引文件中多占 NEEDLE_CRC_SIZE 个字节
+void set_needle_crc(struct needle_index *needle, uint32_t crc);
+
 // 从指定的索引文件中读取一个 needle_index
 void read_needle_index(struct needle_index *needle, FILE *index_file);
 
 // 向指定的索引文件中插入一个 needle_index
-void insert_needle_index(struct needle_index *needle, FILE *index_file);
+void insert_needle_index(const struct needle_index *needle, FILE *index_file);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,408 @@
+#include <immintrin.h>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if !defined(SIMD_H)
+#define SIMD_H
+
+// SIMD 内核在编译时为每种指令集各生成一份，启动时按 CPU 支持情况选择
+// 这样不需要 -march=native，同一个程序可以在不同的机器上运行
+enum class simd_level_t { scalar, sse42, avx2, avx512 };
+
+// 以 bytes 的前 F 个字节（有符号）为特征的线性模型预测，weights[F] 为偏置
+// 预测值截断为非负的位置
+typedef size_t (*predict_bytes_fn_t)(const double *weights, uint64_t bytes);
+
+struct SimdKernels {
+    const char *name;
+    // a 和 b 的前 n 个字节中第一个不同的位置，全部相同时返回 n
+    size_t (*mismatch)(const char *a, const char *b, size_t n);
+    // n 个有符号字节转换为 double 特征
+    void (*bytes_to_features)(const char *bytes, size_t n, double *features);
+    double (*dot_product)(const double *a, const double *b, size_t len);
+    // values 的前 n 个数中小于 target 的个数
+    size_t (*count_less)(const int64_t *values, size_t n, int64_t target);
+    // 下标为特征长度，只有 1..8 有效
+    predict_bytes_fn_t predict_bytes[9];
+    // 在 crc 的基础上继续计算 data 的 CRC32C（Castagnoli），第一段的 crc 为 0
+    uint32_t (*crc32c)(uint32_t crc, const char *data, size_t n);
+};
+
+#define SIMD_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx2,fma")))
+
+namespace simd {
+
+inline int8_t byte_at(uint64_t bytes, size_t i) { return (int8_t)(bytes >> (8 * i)); }
+inline size_t clamp_pos(double res) { return res > 0 ? res : 0; }
+
+struct Scalar {
+    static constexpr const char *name = "scalar";
+
+    static size_t mismatch(const char *a, const char *b, size_t n) {
+        size_t i = 0;
+        while(i < n && a[i] == b[i]) ++i;
+        return i;
+    }
+
+    static void bytes_to_features(const char *bytes, size_t n, double *features) {
+        for(size_t i = 0; i < n; ++i) features[i] = (int8_t)bytes[i];
+    }
+
+    static double dot_product(const double *a, const double *b, size_t len) {
+        double res = 0;
+        for(size_t i = 0; i < len; ++i) res += a[i] * b[i];
+        return res;
+    }
+
+    static size_t count_less(const int64_t *values, size_t n, int64_t target) {
+        size_t cnt = 0;
+        for(size_t i = 0; i < n; ++i) cnt += values[i] < target;
+        return cnt;
+    }
+
+    // 特征很少时向量化没有收益，各指令集都直接用这个版本
+    template <size_t F>
+    static size_t predict_bytes(const double *weights, uint64_t bytes) {
+        double res = 0;
+        for(size_t i = 0; i < F; ++i) res += weights[i] * byte_at(bytes, i);
+        return clamp_pos(res + weights[F]);
+    }
+
+    // 按字节查表，多项式为反转后的 0x82F63B78
+    static uint32_t crc32c(uint32_t crc, const char *data, size_t n) {
+        static const std::array<uint32_t, 256> table = []() {
+            std::array<uint32_t, 256> res;
+            for(uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for(int bit = 0; bit < 8; ++bit) c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+                res[i] = c;
+            }
+            return res;
+        }();
+        crc = ~crc;
+        for(size_t i = 0; i < n; ++i) crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+};
+
+struct Sse42 {
+    static constexpr const char *name = "sse4.2";
+
+    SIMD_TARGET_SSE42 static size_t mismatch(const char *a, const char *b, size_t n) {
+        size_t i = 0;
+        for(; i + 16 <= n; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+            unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+            if(diff) return i + __builtin_ctz(diff);
+        }
+        return i + Scalar::mismatch(a + i, b + i, n - i);
+    }
+
+    SIMD_TARGET_SSE42 static void bytes_to_features(const char *bytes, size_t n, double *features) {
+        size_t i = 0;
+        for(; i + 4 <= n; i += 4) {
+            int32_t word;
+            memcpy(&word, bytes + i, 4);
+            __m128i v = _mm_cvtepi8_epi32(_mm_cvtsi32_si128(word));
+            _mm_storeu_pd(features + i, _mm_cvtepi32_pd(v));
+            _mm_storeu_pd(features + i + 2, _mm_cvtepi32_pd(_mm_srli_si128(v, 8)));
+        }
+        Scalar::bytes_to_features(bytes + i, n - i, features + i);
+    }
+
+    SIMD_TARGET_SSE42 static double dot_product(const double *a, const double *b, size_t len) {
+        __m128d sum = _mm_setzero_pd();
+        size_t i = 0;
+        for(; i + 2 <= len; i += 2) {
+            sum = _mm_add_pd(sum, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        }
+        double res = _mm_cvtsd_f64(sum) + _mm_cvtsd_f64(_mm_unpackhi_pd(sum, sum));
+        for(; i < len; ++i) res += a[i] * b[i];
+        return res;
+    }
+
+    SIMD_TARGET_SSE42 static size_t count_less(const int64_t *values, size_t n, int64_t target) {
+        __m128i t = _mm_set1_epi64x(target);
+        size_t cnt = 0, i = 0;
+        for(; i + 2 <= n; i += 2) {
+            __m128i less = _mm_cmpgt_epi64(t, _mm_loadu_si128((const __m128i *)(values + i)));
+            cnt += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(less)));
+        }
+        return cnt + Scalar::count_less(values + i, n - i, target);
+    }
+
+    // SSE4.2 的 crc32 指令每次处理 8 个字节
+    SIMD_TARGET_SSE42 static uint32_t crc32c(uint32_t crc, const char *data, size_t n) {
+        uint64_t c = ~crc;
+        size_t i = 0;
+        for(; i + 8 <= n; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            c = _mm_crc32_u64(c, word);
+        }
+        uint32_t c32 = c;
+        for(; i < n; ++i) c32 = _mm_crc32_u8(c32, data[i]);
+        return ~c32;
+    }
+
+    // 只取 n 个 weight，避免读到偏置之后的内存
+    template <size_t n>
+    SIMD_TARGET_SSE42 static __m128d load_weights(const double *weights) {
+        if constexpr (n >= 2) return _mm_loadu_pd(weights);
+        else return _mm_load_sd(weights);
+    }
+
+    template <size_t F>
+    SIMD_TARGET_SSE42 static size_t predict_bytes(const double *weights, uint64_t bytes) {
+        if constexpr (F <= 3) {
+            return Scalar::predict_bytes<F>(weights, bytes);
+        } else {
+            __m128i v = _mm_cvtepi8_epi32(_mm_cvtsi64_si128(bytes));
+            __m128d sum = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(weights), _mm_cvtepi32_pd(v)),
+                _mm_mul_pd(_mm_loadu_pd(weights + 2), _mm_cvtepi32_pd(_mm_srli_si128(v, 8))));
+            if constexpr (F > 4) {
+                v = _mm_cvtepi8_epi32(_mm_cvtsi64_si128(bytes >> 32));
+                sum = _mm_add_pd(sum, _mm_mul_pd(load_weights<F - 4>(weights + 4), _mm_cvtepi32_pd(v)));
+                if constexpr (F > 6) {
+                    sum = _mm_add_pd(sum, _mm_mul_pd(load_weights<F - 6>(weights + 6),
+                        _mm_cvtepi32_pd(_mm_srli_si128(v, 8))));
+                }
+            }
+            double res = _mm_cvtsd_f64(sum) + _mm_cvtsd_f64(_mm_unpackhi_pd(sum, sum));
+            return clamp_pos(res + weights[F]);
+        }
+    }
+};
+
+struct Avx2 {
+    static constexpr const char *name = "avx2";
+
+    SIMD_TARGET_AVX2 static size_t mismatch(const char *a, const char *b, size_t n) {
+        size_t i = 0;
+        for(; i + 32 <= n; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+            __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+            unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+            if(diff) return i + __builtin_ctz(diff);
+        }
+        return i + Sse42::mismatch(a + i, b + i, n - i);
+    }
+
+    SIMD_TARGET_AVX2 static void bytes_to_features(const char *bytes, size_t n, double *features) {
+        size_t i = 0;
+        for(; i + 8 <= n; i += 8) {
+            __m128i v = _mm_loadl_epi64((const __m128i *)(bytes + i));
+            _mm256_storeu_pd(features + i, _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(v)));
+            _mm256_storeu_pd(features + i + 4, _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_srli_si128(v, 4))));
+        }
+        Scalar::bytes_to_features(bytes + i, n - i, features + i);
+    }
+
+    SIMD_TARGET_AVX2 static double dot_product(const double *a, const double *b, size_t len) {
+        __m256d sum = _mm256_setzero_pd();
+        size_t i = 0;
+        for(; i + 4 <= len; i += 4) {
+            sum = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), sum);
+        }
+        __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+        double res = _mm_cvtsd_f64(half) + _mm_cvtsd_f64(_mm_unpackhi_pd(half, half));
+        for(; i < len; ++i) res += a[i] * b[i];
+        return res;
+    }
+
+    SIMD_TARGET_AVX2 static size_t count_less(const int64_t *values, size_t n, int64_t target) {
+        __m256i t = _mm256_set1_epi64x(target);
+        size_t cnt = 0, i = 0;
+        for(; i + 4 <= n; i += 4) {
+            __m256i less = _mm256_cmpgt_epi64(t, _mm256_loadu_si256((const __m256i *)(values + i)));
+            cnt += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+        }
+        return cnt + Scalar::count_less(values + i, n - i, target);
+    }
+
+    // 更宽的寄存器对 crc32 指令没有帮助
+    static uint32_t crc32c(uint32_t crc, const char *data, size_t n) {
+        return Sse42::crc32c(crc, data, n);
+    }
+
+    template <size_t n>
+    SIMD_TARGET_AVX2 static __m256d load_weights(const double *weights) {
+        if constexpr (n >= 4) {
+            return _mm256_loadu_pd(weights);
+        } else {
+            const __m256i mask = _mm256_set_epi64x(0, n > 2 ? -1 : 0, n > 1 ? -1 : 0, -1);
+            return _mm256_maskload_pd(weights, mask);
+        }
+    }
+
+    template <size_t F>
+    SIMD_TARGET_AVX2 static size_t predict_bytes(const double *weights, uint64_t bytes) {
+        if constexpr (F <= 3) {
+            return Scalar::predict_bytes<F>(weights, bytes);
+        } else {
+            __m128i b = _mm_cvtsi64_si128(bytes);
+            __m256d sum = _mm256_mul_pd(load_weights<F>(weights),
+                _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(b)));
+            if constexpr (F > 4) {
+                sum = _mm256_fmadd_pd(load_weights<F - 4>(weights + 4),
+                    _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_srli_si128(b, 4))), sum);
+            }
+            __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+            double res = _mm_cvtsd_f64(half) + _mm_cvtsd_f64(_mm_unpackhi_pd(half, half));
+            return clamp_pos(res + weights[F]);
+        }
+    }
+};
+
+struct Avx512 {
+    static constexpr const char *name = "avx512";
+
+    // GCC 中 _mm512_reduce_add_pd、_mm512_cvtepi32_pd 等不带掩码的版本以未初始化的寄存器为源，-Wall 下会报警告
+    // 这里都用以 0 为源的掩码版本，求和顺序和 _mm512_reduce_add_pd 相同
+    SIMD_TARGET_AVX512 static double reduce_add(__m512d v) {
+        __m256d sum = _mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xF, v, 0), _mm512_maskz_extractf64x4_pd(0xF, v, 1));
+        __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+        return _mm_cvtsd_f64(half) + _mm_cvtsd_f64(_mm_unpackhi_pd(half, half));
+    }
+
+    // 低 8 个字节转换成 8 个 double
+    SIMD_TARGET_AVX512 static __m512d bytes_to_pd(__m128i v) {
+        return _mm512_maskz_cvtepi32_pd(0xFF, _mm256_cvtepi8_epi32(v));
+    }
+
+    // 尾部用掩码读取，被屏蔽的字节不会访问内存
+    SIMD_TARGET_AVX512 static size_t mismatch(const char *a, const char *b, size_t n) {
+        size_t i = 0;
+        for(; i + 64 <= n; i += 64) {
+            __mmask64 diff = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            if(diff) return i + __builtin_ctzll(diff);
+        }
+        if(i == n) return n;
+        __mmask64 mask = (1ULL << (n - i)) - 1;
+        __mmask64 diff = _mm512_mask_cmpneq_epi8_mask(mask,
+            _mm512_maskz_loadu_epi8(mask, a + i), _mm512_maskz_loadu_epi8(mask, b + i));
+        return diff ? i + __builtin_ctzll(diff) : n;
+    }
+
+    SIMD_TARGET_AVX512 static void bytes_to_features(const char *bytes, size_t n, double *features) {
+        size_t i = 0;
+        for(; i + 8 <= n; i += 8) {
+            __m128i v = _mm_loadl_epi64((const __m128i *)(bytes + i));
+            _mm512_storeu_pd(features + i, bytes_to_pd(v));
+        }
+        Scalar::bytes_to_features(bytes + i, n - i, features + i);
+    }
+
+    SIMD_TARGET_AVX512 static double dot_product(const double *a, const double *b, size_t len) {
+        __m512d sum = _mm512_setzero_pd();
+        size_t i = 0;
+        for(; i + 8 <= len; i += 8) {
+            sum = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), sum);
+        }
+        if(i < len) {
+            __mmask8 mask = (1u << (len - i)) - 1;
+            sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i), sum);
+        }
+        return reduce_add(sum);
+    }
+
+    SIMD_TARGET_AVX512 static size_t count_less(const int64_t *values, size_t n, int64_t target) {
+        __m512i t = _mm512_set1_epi64(target);
+        size_t cnt = 0, i = 0;
+        for(; i + 8 <= n; i += 8) {
+            cnt += __builtin_popcount(_mm512_cmplt_epi64_mask(_mm512_loadu_si512(values + i), t));
+        }
+        if(i < n) {
+            __mmask8 mask = (1u << (n - i)) - 1;
+            cnt += __builtin_popcount(_mm512_mask_cmplt_epi64_mask(mask, _mm512_maskz_loadu_epi64(mask, values + i), t));
+        }
+        return cnt;
+    }
+
+    static uint32_t crc32c(uint32_t crc, const char *data, size_t n) {
+        return Sse42::crc32c(crc, data, n);
+    }
+
+    template <size_t F>
+    SIMD_TARGET_AVX512 static size_t predict_bytes(const double *weights, uint64_t bytes) {
+        if constexpr (F <= 3) {
+            return Scalar::predict_bytes<F>(weights, bytes);
+        } else {
+            __m512d x = bytes_to_pd(_mm_cvtsi64_si128(bytes));
+            __m512d w = _mm512_maskz_loadu_pd((__mmask8)((1u << F) - 1), weights);
+            return clamp_pos(reduce_add(_mm512_mul_pd(w, x)) + weights[F]);
+        }
+    }
+};
+
+template <class isa_t>
+inline const SimdKernels &kernels_of() {
+    static const SimdKernels kernels = {
+        isa_t::name, isa_t::mismatch, isa_t::bytes_to_features, isa_t::dot_product, isa_t::count_less,
+        {nullptr, isa_t::template predict_bytes<1>, isa_t::template predict_bytes<2>,
+         isa_t::template predict_bytes<3>, isa_t::template predict_bytes<4>,
+         isa_t::template predict_bytes<5>, isa_t::template predict_bytes<6>,
+         isa_t::template predict_bytes<7>, isa_t::template predict_bytes<8>},
+        isa_t::crc32c};
+    return kernels;
+}
+
+}  // namespace simd
+
+inline bool simd_supported(simd_level_t level) {
+    __builtin_cpu_init();
+    switch(level) {
+    case simd_level_t::scalar:
+        return true;
+    case simd_level_t::sse42:
+        return __builtin_cpu_supports("sse4.2");
+    case simd_level_t::avx2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case simd_level_t::avx512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+            && simd_supported(simd_level_t::avx2);
+    }
+    return false;
+}
+
+// 调用方需要保证 CPU 支持 level
+inline const SimdKernels &simd_kernels(simd_level_t level) {
+    switch(level) {
+    case simd_level_t::sse42:
+        return simd::kernels_of<simd::Sse42>();
+    case simd_level_t::avx2:
+        return simd::kernels_of<simd::Avx2>();
+    case simd_level_t::avx512:
+        return simd::kernels_of<simd::Avx512>();
+    default:
+        return simd::kernels_of<simd::Scalar>();
+    }
+}
+
+// CPU 支持的最高级别，可以用环境变量 SFCAS_SIMD（scalar | sse4.2 | avx2 | avx512）指定更低的级别
+inline simd_level_t simd_select_level() {
+    static const simd_level_t levels[] = {simd_level_t::scalar, simd_level_t::sse42,
+                                          simd_level_t::avx2, simd_level_t::avx512};
+    const char *env = getenv("SFCAS_SIMD");
+    for(simd_level_t level : levels) {
+        if(env != nullptr && strcmp(env, simd_kernels(level).name) == 0 && simd_supported(level)) return level;
+    }
+    simd_level_t best = simd_level_t::scalar;
+    for(simd_level_t level : levels) {
+        if(simd_supported(level)) best = level;
+    }
+    return best;
+}
+
+// 进程内第一次调用时选定，之后不再改变
+inline const SimdKernels &simd_kernels() {
+    static const SimdKernels &kernels = simd_kernels(simd_select_level());
+    return kernels;
+}
+
+#endif  // SIMD_H
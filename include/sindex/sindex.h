@@ -3,6 +3,7 @@
 
 #include "helper.h"
 #include "needle.h"
+#include "sindex_config.h"
 #include "sindex_group.h"
 #include "sindex_model.h"
 #include "sindex_root.h"
@@ -24,6 +25,25 @@ class SIndex {
   ~SIndex();
 
   bool get(const key_t &key, val_t &val);
+  // 第一个不小于 key 的位置，不存在时返回 key 的总数
+  size_t lower_bound(const key_t &key);
+  // 以 prefix 开头的至多 limit 个 key 的 val，返回个数
+  size_t scan(const key_t &prefix, size_t limit, std::vector<val_t> &vals);
+  // [begin, end) 内所有 key 的 val，返回个数
+  size_t range(const key_t &begin, const key_t &end, std::vector<val_t> &vals);
+  size_t memory_usage() const;
+  // root 层模型个数和预测误差
+  root_stats_t root_stats() const;
+  memory_stats_t memory_stats() const;
+  // 建索引时实际使用的参数，打开 auto_tune 时是调出的参数
+  const index_config_t &get_config() const;
+  size_t group_num() const;
+  const key_t &group_pivot(size_t group_i) const;
+  // 按组查找，调用者可以在同一个组上做别的事情（如查找组内新插入的 key）而不用再定位一次
+  size_t locate_group(const key_t &key) const;
+  bool get_in_group(size_t group_i, const key_t &key, val_t &val) const;
+  void group_range(size_t group_i, uint64_t &begin, uint64_t &end) const;
+  void group_stats(size_t group_i, group_stats_t &stats) const;
   
 private:
   root_t *root = nullptr;
@@ -0,0 +1,24 @@
+#include <string>
+
+#include "sindex_util.h"
+
+#if !defined(SINDEX_CONFIG_H)
+#define SINDEX_CONFIG_H
+
+namespace sindex {
+
+// 检查参数组合，不合法的组合会让贪心分组死循环或越界，出错时打印原因
+bool validate_config(const index_config_t &config);
+// 按字段名设置参数，字段名和 IndexConfig 的成员名相同
+bool set_config_value(index_config_t &config, const std::string &name,
+                      const std::string &value);
+// 读取 ini 文件中 [SIndex] 节的参数，没有出现的字段保持不变
+bool read_config_ini(const char *path, index_config_t &config);
+void print_config(const index_config_t &config);
+
+// 检查后替换全局的 config，之后构造的索引使用新的参数，已经建好的索引不受影响
+bool set_index_config(const index_config_t &new_config);
+
+}  // namespace sindex
+
+#endif  // SINDEX_CONFIG_H
@@ -7,59 +7,73 @@
 
 namespace sindex {
 
+// 查找时用到的字段正好放在一个 cache line 内
+// 组的 pivot 和模型参数都由 Root 统一保存在连续的数组中
 template <class key_t, class val_t>
-class Group {
-  typedef std::pair<key_t, val_t> record_t;
-
+class alignas(64) Group {
   template <class key_tt, class val_tt>
   friend class Root;
 
  public:
   Group();
+  Group(Group &&other) noexcept;
+  Group &operator=(Group &&other) noexcept;
+  Group(const Group &) = delete;
+  Group &operator=(const Group &) = delete;
   ~Group();
-  void init(const typename std::vector<key_t>::const_iterator &keys_begin,
-            const typename std::vector<val_t>::const_iterator &vals_begin,
-            uint32_t array_size, struct needle_index *needle_begin,
-            uint64_t start);
-
-  result_t get(const key_t &key, val_t &val) const;
+  // 训练得到的模型参数追加到 weight_arena 末尾
+  // arena 之后还会扩容，由 Root 在所有组训练完后调用 bind_weights
+  void init(uint32_t array_size, struct needle_index *needle_begin,
+            uint64_t start, std::vector<double> &weight_arena);
+  void bind_weights(const double *weights) { model_weights = weights; }
+  size_t weight_num() const { return feature_len + 1; }
+
+  // 误差窗口小于 linear_search_bound 时线性扫描指纹，参数由所属的 Root 给出
+  result_t get(const key_t &key, val_t &val, size_t linear_search_bound) const;
+  // 组内第一个不小于 key 的位置，范围是 [0, array_size]
+  size_t lower_bound(const key_t &key) const;
+  // 不含模型参数，参数由 Root 统计
+  size_t memory_usage() const;
+  // 逐个 key 计算实际的预测误差
+  void collect_stats(group_stats_t &stats) const;
 
   void save_group_model(FILE *model_file) const;
-  void read_group_model(FILE *model_file, struct needle_index *needle_begin, uint64_t start);
+  void read_group_model(FILE *model_file, struct needle_index *needle_begin,
+                        uint64_t start, std::vector<double> &weight_arena);
 
  private:
   // train model
-  void init_models();
   void init_feature_length();
-  void train_model(size_t begin, size_t end);
-  void free_data();
+  void init_fingerprints();
+  void train_model(double *weights);
 
   // get operation
   size_t binary_search_key(const key_t &key, size_t pos_hint,
                                   size_t search_begin, size_t search_end) const;
+  size_t linear_search_key(const key_t &key, size_t search_begin,
+                           size_t search_end) const;
 
   void get_model_error(int64_t &error_pos,
                               int64_t &error_neg) const;
   void set_model_error(int64_t error_pos, int64_t error_neg);
 
-  void prepare_last(const std::vector<double *> &model_keys,
-                    const std::vector<size_t> &positions);
   size_t predict(const key_t &key) const;
-  size_t predict(const double *model_key) const;
-
-  key_t pivot;
-  record_t *data = nullptr;         // 8B
 
-  double *model_weights;  
-  struct needle_index *needle_begin;
-  uint64_t start;
+  const double *model_weights = nullptr;        // 8B
+  // 按 feature_len 特化的预测函数
+  predict_bytes_fn_t predict_fn = nullptr;      // 8B
+  // 每个 key 的指纹，误差窗口较小时线性扫描
+  int64_t *fingerprints = nullptr;              // 8B
+  struct needle_index *needle_begin = nullptr;  // 8B
+  uint64_t start = 0;                           // 8B
 
   // 保存的是最大范围的误差
-  int64_t max_neg_error;
-  int64_t max_pos_error;
-  uint32_t array_size;              // 4B
-  uint32_t prefix_len = 0;           // 4B
-  uint32_t feature_len = 0;          // 4B
+  int32_t max_neg_error = 0;                    // 4B
+  int32_t max_pos_error = 0;                    // 4B
+  uint32_t array_size = 0;                      // 4B
+  // 都不超过 key_t::model_key_size()
+  uint16_t prefix_len = 0;                      // 2B
+  uint16_t feature_len = 0;                     // 2B
 };
 
 }  // namespace sindex
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <vector>
 #include <assert.h>
 
@@ -12,16 +15,122 @@
 namespace sindex {
 
 static const size_t DESIRED_TRAINING_KEY_N = 10000000;
+// Cholesky 分解中剩余主元相对原对角元小于该值时，认为这一列和已经选出的列线性相关
+static const double CHOLESKY_PIVOT_EPS = 1e-10;
+// 方程组数值上无法求解、退回 SVD 的次数
+inline std::atomic<size_t> model_svd_fallback_n(0);
 
-inline void model_prepare(const std::vector<double *> &model_key_ptrs,
-                          const std::vector<size_t> &positions, double *weights,
+// 用选主元的 Cholesky 分解求解对称半正定方程组 a x = b（a 为 n×n 行主序），结果写回 b
+// 每一步选剩余主元相对原对角元最大的列，剩下的列都小于 CHOLESKY_PIVOT_EPS 时停止
+// 没有选中的列（如顺序文件名中总是一起变化的字节）和已选的列线性相关，解为 0
+// a 被分解覆盖，出现 NaN、inf 等数值错误时返回 false
+inline bool cholesky_solve(std::vector<double> &a, std::vector<double> &b,
+                           size_t n) {
+  std::vector<size_t> perm(n);
+  std::vector<double> diag(n);
+  for (size_t i = 0; i < n; ++i) {
+    perm[i] = i;
+    diag[i] = a[i * n + i];
+    if (!std::isfinite(diag[i]) || !std::isfinite(b[i])) return false;
+  }
+  size_t rank = 0;
+  for (; rank < n; ++rank) {
+    size_t j = rank, pivot = j;
+    double pivot_ratio = 0;
+    for (size_t k = j; k < n; ++k) {
+      double ratio = diag[k] > 0 ? a[k * n + k] / diag[k] : 0;
+      if (ratio > pivot_ratio) {
+        pivot_ratio = ratio;
+        pivot = k;
+      }
+    }
+    if (!(pivot_ratio > CHOLESKY_PIVOT_EPS)) break;
+    // 对称地交换第 j 列和主元列，已经分解出的 L 的行也随之交换
+    if (pivot != j) {
+      for (size_t k = 0; k < n; ++k) std::swap(a[j * n + k], a[pivot * n + k]);
+      for (size_t k = 0; k < n; ++k) std::swap(a[k * n + j], a[k * n + pivot]);
+      std::swap(perm[j], perm[pivot]);
+      std::swap(diag[j], diag[pivot]);
+    }
+    double d = std::sqrt(a[j * n + j]);
+    if (!std::isfinite(d)) return false;
+    a[j * n + j] = d;
+    for (size_t i = j + 1; i < n; ++i) a[i * n + j] /= d;
+    // 剩余的子矩阵减去这一列的贡献，上下三角都更新，之后交换时仍然对称
+    for (size_t i = j + 1; i < n; ++i) {
+      for (size_t k = j + 1; k < n; ++k) a[i * n + k] -= a[i * n + j] * a[k * n + j];
+    }
+  }
+  // L z = P b
+  std::vector<double> z(rank);
+  for (size_t i = 0; i < rank; ++i) {
+    double sum = b[perm[i]];
+    for (size_t k = 0; k < i; ++k) sum -= a[i * n + k] * z[k];
+    z[i] = sum / a[i * n + i];
+  }
+  // L^T y = z，x = P^T y
+  for (size_t i = rank; i-- > 0;) {
+    double sum = z[i];
+    for (size_t k = i + 1; k < rank; ++k) sum -= a[k * n + i] * z[k];
+    z[i] = sum / a[i * n + i];
+    if (!std::isfinite(z[i])) return false;
+  }
+  std::fill(b.begin(), b.end(), 0);
+  for (size_t i = 0; i < rank; ++i) b[perm[i]] = z[i];
+  return true;
+}
+
+// 数值错误时的后备方案：构造稠密矩阵用 SVD 求最小二乘解
+template <class key_fn_t>
+inline void model_prepare_svd(size_t key_n, key_fn_t &get_key, size_t step,
+                              const std::vector<size_t> &useful_feat_index,
+                              double *weights, size_t feature_len) {
+  size_t useful_feat_n = useful_feat_index.size();
+  int m = key_n / step;           // number of samples
+  int n = useful_feat_n + 1;      // number of features
+  std::vector<double> a(m * n, 0);
+  std::vector<double> b(std::max(m, n), 0);
+  std::vector<double> s(std::max(1, std::min(m, n)), 0);
+  std::vector<double> model_key(feature_len);
+
+  for (int sample_i = 0; sample_i < m; ++sample_i) {
+    assert(sample_i * step < key_n);
+    b[sample_i] = get_key(sample_i * step, model_key.data());
+    for (size_t useful_f_i = 0; useful_f_i < useful_feat_n; useful_f_i++) {
+      a[sample_i * n + useful_f_i] = model_key[useful_feat_index[useful_f_i]];
+    }
+    a[sample_i * n + useful_feat_n] = 1;                // bias 位置对应的 x = 1
+  }
+
+  // 还是利用最小二乘的方法来求解参数
+  lapack_int rank = 0;
+  int fitting_res =
+      LAPACKE_dgelss(LAPACK_ROW_MAJOR, m, n, 1 /* nrhs */, a.data(),
+                     n /* lda */, b.data(), 1 /* ldb */, s.data(), -1, &rank);
+
+  if (fitting_res != 0) {
+    COUT_N_EXIT("fitting_res: " << fitting_res);
+  }
+
+  // set weights of useful features
+  for (size_t useful_f_i = 0; useful_f_i < useful_feat_n; useful_f_i++) {
+    weights[useful_feat_index[useful_f_i]] = b[useful_f_i];
+  }
+  weights[feature_len] = b[n - 1];  // set bias
+}
+
+// 训练线性模型，weights 长度为 feature_len + 1（最后一个是偏置）
+// get_key(i, model_key) 把第 i 个 key 的特征写入 model_key 并返回其位置
+// 只遍历一遍 key，累加 X^T X 和 X^T y 后在 feature_len 维上求解，不保存全部特征
+template <class key_fn_t>
+inline void model_prepare(size_t key_n, key_fn_t &&get_key, double *weights,
                           size_t feature_len) {
-  assert(model_key_ptrs.size() == positions.size());
   // set weights to all zero
   for (size_t w_i = 0; w_i < feature_len + 1; w_i++) weights[w_i] = 0;
-  if (positions.size() == 0) return;
-  if (positions.size() == 1) {
-    weights[feature_len] = positions[0];
+  if (key_n == 0) return;
+  std::vector<double> model_key(feature_len);
+  if (key_n == 1) {
+    weights[feature_len] = get_key(0, model_key.data());
     return;
   }
 
@@ -30,83 +139,112 @@ inline void model_prepare(const std::vector<double *> &model_key_ptrs,
   if (feature_len == 1) {
     double x_expected = 0, y_expected = 0, xy_expected = 0,
            x_square_expected = 0;
-    for (size_t key_i = 0; key_i < positions.size(); key_i++) {
-      double key = model_key_ptrs[key_i][0];
+    for (size_t key_i = 0; key_i < key_n; key_i++) {
+      double pos = get_key(key_i, model_key.data());
+      double key = model_key[0];
       x_expected += key;
-      y_expected += positions[key_i];
+      y_expected += pos;
       x_square_expected += key * key;
-      xy_expected += key * positions[key_i];
+      xy_expected += key * pos;
     }
-    x_expected /= positions.size();
-    y_expected /= positions.size();
-    x_square_expected /= positions.size();
-    xy_expected /= positions.size();
+    x_expected /= key_n;
+    y_expected /= key_n;
+    x_square_expected /= key_n;
+    xy_expected /= key_n;
 
     weights[0] = (xy_expected - x_expected * y_expected) /
                  (x_square_expected - x_expected * x_expected);
     weights[1] = (x_square_expected * y_expected - x_expected * xy_expected) /
                  (x_square_expected - x_expected * x_expected);
-  } else {
-    // trim down samples to avoid large memory usage
-    size_t step = 1;
-    if (model_key_ptrs.size() > DESIRED_TRAINING_KEY_N) {
-      step = model_key_ptrs.size() / DESIRED_TRAINING_KEY_N;
-    }
-
-    // we only fit with useful features
-    // 保证每一个 feature 位置都是有区别的，对于某一个 feature 位置，如果所有 key 在该位都一样，就不采用
-    std::vector<size_t> useful_feat_index;
-    for (size_t feat_i = 0; feat_i < feature_len; feat_i++) {
-      double first_val = model_key_ptrs[0][feat_i];
-      for (size_t key_i = 0; key_i < model_key_ptrs.size(); key_i += step) {
-        if (model_key_ptrs[key_i][feat_i] != first_val) {
-          useful_feat_index.push_back(feat_i);
-          break;
-        }
-      }
-    }
+    return;
+  }
 
-    if (model_key_ptrs.size() != 1 && useful_feat_index.size() == 0) {
-      COUT_N_EXIT("all feats are the same");
-    }
+  // trim down samples to avoid large memory usage
+  size_t step = 1;
+  if (key_n > DESIRED_TRAINING_KEY_N) {
+    step = key_n / DESIRED_TRAINING_KEY_N;
+  }
+  size_t m = key_n / step;
 
-    size_t useful_feat_n = useful_feat_index.size();
-    int m = model_key_ptrs.size() / step;  // number of samples
-    int n = useful_feat_n + 1;             // number of features
-    std::vector<double> a(m * n, 0);
-    std::vector<double> b(std::max(m, n), 0);
-    std::vector<double> s(std::max(1, std::min(m, n)), 0);
-
-    for (int sample_i = 0; sample_i < m; ++sample_i) {
-      for (size_t useful_f_i = 0; useful_f_i < useful_feat_n; useful_f_i++) {
-        a[sample_i * n + useful_f_i] =
-            model_key_ptrs[sample_i * step][useful_feat_index[useful_f_i]];
+  // 以第一个样本为原点累加，减少大数相消带来的误差
+  // 同时记录每个 feature 位置是否有变化
+  std::vector<double> origin(feature_len);
+  double y_origin = get_key(0, origin.data());
+  std::vector<double> x_sum(feature_len, 0), xy_sum(feature_len, 0);
+  std::vector<double> xx_sum(feature_len * feature_len, 0);
+  std::vector<bool> is_useful(feature_len, false);
+  double y_sum = 0;
+  for (size_t sample_i = 0; sample_i < m; ++sample_i) {
+    double y = get_key(sample_i * step, model_key.data()) - y_origin;
+    y_sum += y;
+    for (size_t f_i = 0; f_i < feature_len; ++f_i) {
+      double x = model_key[f_i] - origin[f_i];
+      if (x != 0) is_useful[f_i] = true;
+      x_sum[f_i] += x;
+      xy_sum[f_i] += x * y;
+      for (size_t f_j = 0; f_j <= f_i; ++f_j) {
+        xx_sum[f_i * feature_len + f_j] += x * (model_key[f_j] - origin[f_j]);
       }
-      a[sample_i * n + useful_feat_n] = 1;                // bias 位置对应的 x = 1
-      b[sample_i] = positions[sample_i * step];
-      assert(sample_i * step < model_key_ptrs.size());
     }
+  }
 
-    // 还是利用最小二乘的方法来求解参数
-    lapack_int rank = 0;
-    int fitting_res =
-        LAPACKE_dgelss(LAPACK_ROW_MAJOR, m, n, 1 /* nrhs */, a.data(),
-                       n /* lda */, b.data(), 1 /* ldb */, s.data(), -1, &rank);
+  // we only fit with useful features
+  // 保证每一个 feature 位置都是有区别的，对于某一个 feature 位置，如果所有 key 在该位都一样，就不采用
+  std::vector<size_t> useful_feat_index;
+  for (size_t feat_i = 0; feat_i < feature_len; feat_i++) {
+    if (is_useful[feat_i]) useful_feat_index.push_back(feat_i);
+  }
+  if (useful_feat_index.size() == 0) {
+    COUT_N_EXIT("all feats are the same");
+  }
 
-    if (fitting_res != 0) {
-      COUT_N_EXIT("fitting_res: " << fitting_res);
+  // 中心化后的协方差方程组 cov(x, x) w = cov(x, y)
+  size_t n = useful_feat_index.size();
+  std::vector<double> a(n * n), b(n);
+  for (size_t i = 0; i < n; ++i) {
+    size_t f_i = useful_feat_index[i];
+    b[i] = xy_sum[f_i] - x_sum[f_i] * y_sum / m;
+    for (size_t j = 0; j <= i; ++j) {
+      size_t f_j = useful_feat_index[j];
+      a[i * n + j] = a[j * n + i] =
+          xx_sum[f_i * feature_len + f_j] - x_sum[f_i] * x_sum[f_j] / m;
     }
+  }
 
-    // set weights of useful features
-    for (size_t useful_f_i = 0; useful_f_i < useful_feat_n; useful_f_i++) {
-      weights[useful_feat_index[useful_f_i]] = b[useful_f_i];
-    }
-    weights[feature_len] = b[n - 1];  // set bias
+  if (!cholesky_solve(a, b, n)) {
+    model_svd_fallback_n.fetch_add(1, std::memory_order_relaxed);
+    DEBUG_THIS("numerical failure in normal equations, fall back to SVD");
+    model_prepare_svd(key_n, get_key, step, useful_feat_index, weights,
+                      feature_len);
+    return;
+  }
+
+  // 偏置使模型经过均值点
+  double bias = y_origin + y_sum / m;
+  for (size_t i = 0; i < n; ++i) {
+    size_t f_i = useful_feat_index[i];
+    weights[f_i] = b[i];
+    bias -= b[i] * (origin[f_i] + x_sum[f_i] / m);
   }
+  weights[feature_len] = bias;
+}
+
+inline void model_prepare(const std::vector<double *> &model_key_ptrs,
+                          const std::vector<size_t> &positions, double *weights,
+                          size_t feature_len) {
+  assert(model_key_ptrs.size() == positions.size());
+  model_prepare(
+      positions.size(),
+      [&](size_t key_i, double *model_key) {
+        std::copy(model_key_ptrs[key_i], model_key_ptrs[key_i] + feature_len,
+                  model_key);
+        return (double)positions[key_i];
+      },
+      weights, feature_len);
 }
 
 // 位置只能取非负的预测值，最小是 0
-inline size_t model_predict(double *weights, const double *model_key,
+inline size_t model_predict(const double *weights, const double *model_key,
                             size_t feature_len) {
   if (feature_len == 1) {
     double res = weights[0] * model_key[0] + weights[1];
@@ -119,6 +257,35 @@ inline size_t model_predict(double *weights, const double *model_key,
   }
 }
 
+// feature_len 不超过 key_t::model_key_size()，用定长数组，查找路径上没有变长的栈数组
+template <class key_t>
+inline size_t model_predict_key_generic(const double *weights, const key_t &key,
+                                        size_t prefix_len, size_t feature_len) {
+  assert(feature_len <= key_t::model_key_size());
+  double model_key[key_t::model_key_size()];
+  key.get_model_key(prefix_len, feature_len, model_key);
+  return model_predict(weights, model_key, feature_len);
+}
+
+// feature_len 不超过 8 时使用按长度特化的内核，直接把 key 的字节转换到向量里
+// 其余情况返回 nullptr，使用通用的版本
+inline predict_bytes_fn_t get_predict_fn(size_t feature_len) {
+  if (feature_len >= 1 && feature_len <= 8) {
+    return simd_kernels().predict_bytes[feature_len];
+  }
+  return nullptr;
+}
+
+template <class key_t>
+inline size_t model_predict_key(predict_bytes_fn_t predict_fn,
+                                const double *weights, const key_t &key,
+                                size_t prefix_len, size_t feature_len) {
+  if (predict_fn != nullptr) {
+    return predict_fn(weights, key.get_model_bytes(prefix_len));
+  }
+  return model_predict_key_generic(weights, key, prefix_len, feature_len);
+}
+
 }  // namespace sindex
 
 #endif  // SINDEX_MODEL_H
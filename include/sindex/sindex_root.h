@@ -1,4 +1,3 @@
-#include <unordered_map>
 #include <vector>
 #include <unistd.h>
 #include <numeric>
@@ -23,14 +22,43 @@ class Root {
     uint64_t pivot_num;
     // 加 1 是指偏置
     std::vector<double> weights;
+    predict_bytes_fn_t predict_fn = nullptr;
+    // 训练时 pivot 的预测误差（以组为单位）
+    int64_t max_pos_error = 0;
+    int64_t max_neg_error = 0;
   };
 
 public:
-  ~Root();
   void init(const std::vector<key_t> &keys, const std::vector<val_t> &vals, 
     std::vector<struct needle_index> &indexs);
 
   result_t get(const key_t &key, val_t &val);
+  // 含有 key 的组，key 小于所有 pivot 时是第 0 组，没有组时返回 group_num()
+  size_t locate_group_i(const key_t &key) const;
+  result_t get_in_group(size_t group_i, const key_t &key, val_t &val) const;
+  // 组内的 key 在 needle 数组中的下标范围 [begin, end)，group_i 越界时为空
+  void group_range(size_t group_i, uint64_t &begin, uint64_t &end) const;
+  size_t lower_bound(const key_t &key);
+  size_t size() const { return record_n; }
+  const key_t &key_at(size_t pos) const { return needle_begin[pos].filename; }
+  // 不含 needles
+  size_t memory_usage() const;
+  memory_stats_t memory_stats() const;
+  root_stats_t root_stats() const;
+  size_t group_num() const { return group_n; }
+  const key_t &get_group_pivot(size_t group_i) const;
+  void group_stats(size_t group_i, group_stats_t &stats) const;
+  // 按当前配置贪心分组，得到每个组第一个 key 的下标
+  void group_keys(const std::vector<key_t> &keys,
+                  std::vector<size_t> &pivot_indexes) const;
+  // 抽样 key 尝试几组分组参数，选出预期查找代价最小且满足内存预算的一组
+  void tune_config(const std::vector<key_t> &keys,
+                   std::vector<struct needle_index> &indexs,
+                   index_config_t &tuned) const;
+
+  // 本索引使用的参数，构造时复制全局的 config，必须在 init 之前设置
+  const index_config_t &get_config() const { return index_config; }
+  void set_config(const index_config_t &new_config) { index_config = new_config; }
 
   void save_model() const;
   void read_model(needle_index *needle_begin);
@@ -42,33 +70,53 @@ private:
                                       size_t min_size,
                                       std::vector<size_t> &pivot_indexes) const;
   void train_piecewise_model();
+  void train_root_model(size_t begin_i, size_t end_i);
+  void eval_root_model(size_t model_i);
   void partial_key_len_of_pivots(const size_t start_i,
                                           const size_t end_i, uint32_t &p_len,
                                           uint32_t &f_len);
   void partial_key_len_by_step(
       const std::vector<key_t> &keys, const size_t start,
       const size_t step_start, const size_t step_end, size_t &common_p_len,
-      size_t &max_p_len, std::unordered_map<size_t, size_t> &common_p_history,
-      std::unordered_map<size_t, size_t> &max_p_history) const;
+      size_t &max_p_len, std::vector<uint32_t> &common_p_history,
+      std::vector<uint32_t> &max_p_history) const;
   double train_and_get_err(std::vector<double> &model_key, size_t start,
                                   size_t end, size_t p_len, size_t f_len) const;
+  void estimate_config(const std::vector<key_t> &keys,
+                       std::vector<struct needle_index> &indexs,
+                       const std::vector<size_t> &sample_begins,
+                       size_t sample_size, const index_config_t &candidate,
+                       double &lookup_cost, double &memory) const;
   
   // get operation
-  size_t predict(const key_t &key);
-  size_t predict(const double *model_key, uint32_t model_i);
-  group_t *locate_group(const key_t &key);
+  size_t locate_model(const key_t &key, int64_t key_prefix) const;
+  size_t predict(const key_t &key, uint32_t model_i) const;
+  const group_t *locate_group(const key_t &key) const;
+  bool pivot_not_greater(size_t group_i, const key_t &key,
+                         int64_t key_prefix) const;
+  // 和 pivot_prefixes 比较用的 key 指纹
+  int64_t route_fingerprint(const key_t &key) const;
 
-  void set_group_ptr(size_t group_i, group_t *g_ptr);
-  group_t *get_group_ptr(size_t group_i) const;
-  void set_group_pivot(size_t group_i, const key_t &key);
-  key_t &get_group_pivot(size_t group_i) const;
+  void bind_group_weights();
+  void init_pivot_prefixes();
+  const group_t *get_group_ptr(size_t group_i) const;
 
-  std::unique_ptr<std::pair<key_t, group_t *>[]> groups;  // 8B
+  // auto_tune 得到的参数只保存在这里，不修改全局的 config
+  index_config_t index_config = config;
+  struct needle_index *needle_begin = nullptr;
+  size_t record_n = 0;
+  // 组目录按列连续保存：先比较 pivot 的指纹，相同时再比较完整的 pivot
+  std::vector<int64_t> pivot_prefixes;
+  std::vector<key_t> pivots;
+  std::vector<group_t> groups;
+  // 所有组的模型参数
+  std::vector<double> group_weights;
+  uint32_t pivot_prefix_len = 0;                          // 4B
   uint32_t group_n = 0;                                   // 4B
   uint32_t root_model_n = 0;                              // 4B
-  std::array<key_t, max_root_model_n> model_pivots;
-  std::array<model_meta_t, max_root_model_n> models;
-  // std::array<std::pair<int64_t, int64_t>, max_root_model_n> model_errors;
+  // 每个 root 模型负责的第一个组，模型的 pivot 就是该组的 pivot
+  std::vector<uint32_t> model_group_begins;
+  std::vector<model_meta_t> models;
 };
 
 }  // namespace sindex
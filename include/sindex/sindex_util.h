@@ -1,20 +1,27 @@
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <memory>
 
 #include "helper.h"
+#include "simd.h"
 
 #if !defined(SINDEX_UTIL_H)
 #define SINDEX_UTIL_H
 
 namespace sindex {
 
-const size_t max_root_model_n = 4;
 enum class Result;
 struct IndexConfig;
+struct RootStats;
+struct GroupStats;
+struct MemoryStats;
 
 typedef Result result_t;
 typedef IndexConfig index_config_t;
+typedef RootStats root_stats_t;
+typedef GroupStats group_stats_t;
+typedef MemoryStats memory_stats_t;
 
 enum class Result { ok, failed };
 
@@ -25,17 +32,70 @@ struct IndexConfig {
   // partial_len_bound 和 max_to_group_num 必须相适应
   // 不然分批次 group 在 pt 过大时会有死循环（因为全部都能 group 进去）
   // greedy grouping related
+  // 运行时修改前由 validate_config 检查，见 sindex_config.h
   size_t partial_len_bound = 4;
   size_t forward_step = 550;
   size_t backward_step = 50;
   size_t group_min_size = 400;
+  // 组内误差窗口小于该值时线性扫描指纹，否则二分查找
+  size_t linear_search_bound = 64;
+  // root 模型对 pivot 的预测误差超过该值（以组为单位）时继续拆分
+  // 模型内的 pivot 少于 2 * root_min_size 时不再拆分
+  double root_error_bound = 8;
+  size_t root_min_size = 16;
+  // 建索引前抽样 key 选择分组参数
+  // memory_budget 是索引内存的上限（字节），0 表示不限制
+  bool auto_tune = false;
+  size_t memory_budget = 0;
   // for limited memory
   // 小内存机器上参数越大时间越久
   // size_t max_to_group_num = 100000;
   // bool is_mem_limit = true;
 };
 
-const index_config_t config;
+// 用户给出的参数，在建索引之前通过 set_index_config 修改
+// 每个索引构造时复制一份，auto_tune 只修改索引自己的那份
+extern index_config_t config;
+
+// root 层模型的误差统计，误差是预测的组下标减去实际的组下标
+struct RootStats {
+  size_t model_n = 0;
+  size_t group_n = 0;
+  size_t max_model_size = 0;
+  int64_t max_pos_error = 0;
+  int64_t max_neg_error = 0;
+  double avg_abs_error = 0;
+};
+
+// 组内误差直方图的桶数，按 |误差| 分桶：0、1、[2, 4)、[4, 8) ...
+// 最后一个桶包含所有更大的误差
+const size_t error_bucket_n = 16;
+
+inline size_t error_bucket(int64_t error) {
+  uint64_t abs_error = error < 0 ? -error : error;
+  size_t bucket = abs_error == 0 ? 0 : 64 - __builtin_clzll(abs_error);
+  return std::min(bucket, error_bucket_n - 1);
+}
+
+// 单个组的统计信息，误差是实际位置减去预测位置
+struct GroupStats {
+  uint64_t start = 0;
+  size_t size = 0;
+  size_t prefix_len = 0;
+  size_t feature_len = 0;
+  int64_t max_pos_error = 0;
+  int64_t max_neg_error = 0;
+  uint64_t error_histogram[error_bucket_n] = {};
+};
+
+// 各部分占用的内存（字节）
+struct MemoryStats {
+  size_t needles = 0;  // needle_index 数组及文件名在堆上的部分，不属于索引
+  size_t keys = 0;     // 组的 pivot key
+  size_t groups = 0;   // Group 对象和每个 key 的指纹
+  size_t weights = 0;  // 组模型和 root 模型的参数
+  size_t root = 0;     // pivot 指纹、root 模型元数据和 Root 本身
+};
 
 }  // namespace sindex
 
@@ -48,38 +108,17 @@ inline size_t common_prefix_length(size_t start_i, const uint8_t *key1,
   return std::min(k1_len, k2_len) - start_i;
 }
 
-inline double dot_product(const double *a, const double *b, size_t len) {
-  if (len < 4) {
-    double res = 0;
-    for (size_t feat_i = 0; feat_i < len; feat_i++) {
-      res += a[feat_i] * b[feat_i];
-    }
-    return res;
-  }
-
-  // 得到一个 256bit 的 64bit 浮点数向量
-  // 值为 [0.0, 0.0, 0.0, 0.0]
-  __m256d sum_vec = _mm256_set_pd(0.0, 0.0, 0.0, 0.0);
-
-  // 每次计算四个长度单位
-  for (size_t ii = 0; ii < (len >> 2); ++ii) {
-    __m256d x = _mm256_loadu_pd(a + 4 * ii);
-    __m256d y = _mm256_loadu_pd(b + 4 * ii);
-    // 不支持 fma 时使用下面这两条指令
-    __m256d z = _mm256_mul_pd(x, y);
-    sum_vec = _mm256_add_pd(sum_vec, z);
-    // sum_vec = _mm256_fmadd_pd(x, y, sum_vec);
-  }
-
-  // the partial dot-product for the remaining elements
-  double trailing = 0.0;
-  for (size_t ii = (len & (~3)); ii < len; ++ii) trailing += a[ii] * b[ii];
+// key 在 prefix_len 之后 8 个字节的大端表示，翻转符号位后按有符号数比较
+// 与 key 本身（按无符号字节）的字典序一致
+template <class key_t>
+inline int64_t key_fingerprint(const key_t &key, size_t prefix_len) {
+  return (int64_t)(__builtin_bswap64(key.get_model_bytes(prefix_len)) ^
+                   (1ULL << 63));
+}
 
-  // _mm256_hadd_pd(a, b)
-  // 将 a 和 b 之中相邻的两位加起来，按照 a b a b 的顺序放入新向量中
-  // res = [a0 + a1, b0 + b1, a2 + a3, b2 + b3]
-  __m256d temp = _mm256_hadd_pd(sum_vec, sum_vec);
-  return ((double *)&temp)[0] + ((double *)&temp)[2] + trailing;
+// 按运行时选定的指令集计算
+inline double dot_product(const double *a, const double *b, size_t len) {
+  return simd_kernels().dot_product(a, b, len);
 }
 
 #endif  // SINDEX_UTIL_H
@@ -1,8 +1,11 @@
 #include <unistd.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
 #include <iostream>
 
 #include "constant.h"
+#include "simd.h"
 
 #if !defined(STRKEY_H)
 #define STRKEY_H
@@ -51,6 +54,11 @@ public:
 	char *get_name() {
 		return buf;
 	}
+	const char *c_str() const {
+		return buf;
+	}
+	// 堆上额外占用的字节数
+	size_t heap_size() const { return 0; }
 
 	std::string to_string() const {
 		std::string str;
@@ -63,10 +71,14 @@ public:
 	}
 
 	void get_model_key(size_t begin_f, size_t l, double *target) const {
-		for (size_t i = 0; i < l; i++)
-		{
-			target[i] = buf[i + begin_f];
-		}
+		simd_kernels().bytes_to_features(buf + begin_f, l, target);
+	}
+
+	// 从 begin_f 开始的 8 个字节，第 i 个字节放在第 i 个低位字节上，超出 len 的部分为 0
+	uint64_t get_model_bytes(size_t begin_f) const {
+		uint64_t bytes = 0;
+		if (begin_f < len) memcpy(&bytes, buf + begin_f, std::min(len - begin_f, (size_t)8));
+		return bytes;
 	}
 
 	// compare
@@ -75,6 +87,16 @@ public:
 		return strncmp(buf + begin_i, other.buf + begin_i, l) < 0;
 	}
 
+	bool starts_with(const StrKey &prefix) const {
+		return strncmp(buf, prefix.buf, strnlen(prefix.buf, len)) == 0;
+	}
+
+	// [begin_i, end_i) 内相同的字节数
+	size_t common_prefix_length(const StrKey &other, size_t begin_i, size_t end_i) const {
+		if (end_i <= begin_i) return 0;
+		return simd_kernels().mismatch(buf + begin_i, other.buf + begin_i, end_i - begin_i);
+	}
+
 	friend bool operator<(const StrKey &l, const StrKey &r) {
 		return strcmp(l.buf, r.buf) < 0;
 	}
@@ -102,6 +124,154 @@ public:
 	char buf[len];
 };
 
-typedef StrKey<MAX_FILE_LEN + 1> index_key_t;
+// 变长字符串 key，逻辑上等价于末尾补 '\0' 到 model_key_size() 的 StrKey
+// 前 inline_len 字节总是内联保存，更长的名字再在堆上保存一份完整的字符串
+// 短名字只占 32 字节，长名字最多可到 MAX_FILE_LEN
+class VarStrKey {
+public:
+	static constexpr size_t inline_len = 22;
+	static constexpr size_t model_key_size() { return MAX_FILE_LEN + 1; }
+
+	// construct
+	VarStrKey() { memset(prefix, '\0', sizeof(prefix)); }
+	VarStrKey(const char *s) { set_key(s, strlen(s)); }
+	VarStrKey(const std::string &s) { set_key(s.data(), s.size()); }
+	VarStrKey(const VarStrKey &other) { copy_from(other); }
+	VarStrKey(VarStrKey &&other) noexcept {
+		memcpy(prefix, other.prefix, sizeof(prefix));
+		length = other.length;
+		tail = other.tail;
+		other.tail = nullptr;
+	}
+	~VarStrKey() { delete[] tail; }
+	VarStrKey &operator=(const VarStrKey &other) {
+		if (this != &other) {
+			delete[] tail;
+			copy_from(other);
+		}
+		return *this;
+	}
+	VarStrKey &operator=(VarStrKey &&other) noexcept {
+		if (this != &other) {
+			delete[] tail;
+			memcpy(prefix, other.prefix, sizeof(prefix));
+			length = other.length;
+			tail = other.tail;
+			other.tail = nullptr;
+		}
+		return *this;
+	}
+
+	// operation on key
+	void set_key(const char *s) { set_key(s, strlen(s)); }
+	// 超过 MAX_FILE_LEN 的部分会被截断，调用方需要提前检查
+	void set_key(const char *s, size_t s_len) {
+		s_len = std::min(s_len, (size_t)MAX_FILE_LEN);
+		memset(prefix, '\0', sizeof(prefix));
+		memcpy(prefix, s, std::min(s_len, inline_len));
+		char *new_tail = nullptr;
+		if (s_len > inline_len) {
+			new_tail = new char[s_len + 1];
+			memcpy(new_tail, s, s_len);
+			new_tail[s_len] = '\0';
+		}
+		// s 可能指向自身，最后再释放
+		delete[] tail;
+		tail = new_tail;
+		length = s_len;
+	}
+
+	const char *get_name() const { return c_str(); }
+	const char *c_str() const { return tail ? tail : prefix; }
+	size_t size() const { return length; }
+	// 堆上额外占用的字节数
+	size_t heap_size() const { return tail ? length + 1 : 0; }
+
+	std::string to_string() const { return std::string(c_str(), length); }
+
+	void get_model_key(size_t begin_f, size_t l, double *target) const {
+		size_t valid = begin_f < length ? std::min(l, length - begin_f) : 0;
+		simd_kernels().bytes_to_features(c_str() + begin_f, valid, target);
+		for (size_t i = valid; i < l; i++)
+		{
+			target[i] = 0;
+		}
+	}
+
+	// 从 begin_f 开始的 8 个字节，第 i 个字节放在第 i 个低位字节上，超出长度的部分为 0
+	uint64_t get_model_bytes(size_t begin_f) const {
+		uint64_t bytes = 0;
+		// 内联前缀在长度之后都是 '\0'，可以直接读 8 个字节
+		if (tail == nullptr && begin_f + 8 <= sizeof(prefix)) memcpy(&bytes, prefix + begin_f, 8);
+		else if (begin_f + 8 <= length) memcpy(&bytes, tail + begin_f, 8);
+		else if (begin_f < length) memcpy(&bytes, c_str() + begin_f, length - begin_f);
+		return bytes;
+	}
+
+	// compare
+	// 带起始位置和长度的比较
+	bool less_than(const VarStrKey &other, size_t begin_i, size_t l) const {
+		return strncmp(from(begin_i), other.from(begin_i), l) < 0;
+	}
+
+	bool starts_with(const VarStrKey &p) const {
+		return p.length <= length && strncmp(c_str(), p.c_str(), p.length) == 0;
+	}
+
+	// [begin_i, end_i) 内相同的字节数，超出长度的部分视为 '\0'
+	size_t common_prefix_length(const VarStrKey &other, size_t begin_i, size_t end_i) const {
+		if (end_i <= begin_i) return 0;
+		size_t both_end = std::min(length, other.length);
+		if (begin_i < both_end)
+		{
+			size_t n = std::min(end_i, both_end) - begin_i;
+			size_t same = simd_kernels().mismatch(c_str() + begin_i, other.c_str() + begin_i, n);
+			if (same < n) return same;
+		}
+		// 较短的 key 结束以后，较长的 key 在这个位置上不是 '\0'
+		size_t diff_i = std::max(begin_i, both_end);
+		if (diff_i >= std::min(end_i, (size_t)std::max(length, other.length))) return end_i - begin_i;
+		return diff_i - begin_i;
+	}
+
+	// 先比较内联的前缀，大部分情况下不需要访问堆上的部分
+	int compare(const VarStrKey &other) const {
+		int res = memcmp(prefix, other.prefix, inline_len);
+		if (res != 0 || (tail == nullptr && other.tail == nullptr)) return res;
+		return strcmp(c_str() + inline_len, other.c_str() + inline_len);
+	}
+
+	friend bool operator<(const VarStrKey &l, const VarStrKey &r) { return l.compare(r) < 0; }
+	friend bool operator>(const VarStrKey &l, const VarStrKey &r) { return l.compare(r) > 0; }
+	friend bool operator>=(const VarStrKey &l, const VarStrKey &r) { return l.compare(r) >= 0; }
+	friend bool operator<=(const VarStrKey &l, const VarStrKey &r) { return l.compare(r) <= 0; }
+	friend bool operator==(const VarStrKey &l, const VarStrKey &r) {
+		return l.length == r.length && l.compare(r) == 0;
+	}
+	friend bool operator!=(const VarStrKey &l, const VarStrKey &r) { return !(l == r); }
+
+	friend std::ostream &operator<<(std::ostream &os, const VarStrKey &key) {
+		os << key.c_str();
+		return os;
+	}
+
+private:
+	void copy_from(const VarStrKey &other) {
+		memcpy(prefix, other.prefix, sizeof(prefix));
+		length = other.length;
+		tail = nullptr;
+		if (other.tail) {
+			tail = new char[length + 1];
+			memcpy(tail, other.tail, length + 1);
+		}
+	}
+	const char *from(size_t i) const { return i < length ? c_str() + i : ""; }
+
+	char prefix[inline_len + 1];
+	uint8_t length = 0;
+	char *tail = nullptr;
+};
+
+typedef VarStrKey index_key_t;
 
 #endif
\ No newline at end of file
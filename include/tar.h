@@ -0,0 +1,43 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#if !defined(TAR_H)
+#define TAR_H
+
+// 顺序读取 tar 流（可以是管道），只返回其中的普通文件和硬链接
+// 支持 ustar 的 prefix、GNU 的长文件名（'L' 和 'K'）和 pax 扩展头（'x'）中的 path、linkpath 和 size
+// 目录、符号链接和设备文件等会被跳过
+class TarReader {
+public:
+    explicit TarReader(int fd);
+
+    // 读到下一个普通文件，上一个文件没有读完的数据会被跳过
+    // 硬链接的 link 为它指向的之前出现过的文件名，没有数据；普通文件的 link 为空
+    // 返回 1 表示读到文件，0 表示 tar 流结束，-1 表示出错
+    int next(std::string &name, uint64_t &size, std::string &link);
+    // 读出当前文件的下一段数据，data 指向内部缓冲区，下次调用前有效
+    // 返回这段数据的字节数，0 表示当前文件已经读完，-1 表示出错
+    ssize_t read(const char **data);
+    // 跳过的符号链接、设备文件等的个数
+    size_t skipped() const { return skip_n; }
+
+private:
+    int fd;
+    std::vector<char> buf;
+    size_t buf_begin = 0, buf_end = 0;
+    // 当前文件还没读的数据和之后补齐到 512 字节的部分
+    uint64_t remain = 0, padding = 0;
+    size_t skip_n = 0;
+
+    // 保证缓冲区中至少有 n 个字节，n 不超过缓冲区大小
+    // 成功返回 0，数据不够时返回 -1
+    int fill(size_t n);
+    // 跳过当前文件剩下的数据
+    int skip_data();
+    // 读出当前项的全部数据，用于长文件名和 pax 扩展头
+    int read_data(uint64_t size, std::string &data);
+};
+
+#endif
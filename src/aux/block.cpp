@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#if defined(USE_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "block.h"
+#include "helper.h"
+
+// BLOCKFILE 的格式：
+// block_size (8 bytes) | data_size (8 bytes) | block_num (8 bytes) | block_num * (offset (8 bytes) | size (4 bytes))
+int64_t load_block_index(struct block_index *blocks) {
+    char path[PATH_SIZE];
+    sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, BLOCKFILE);
+    blocks->block_size = 0;
+    blocks->data_size = 0;
+    blocks->blocks.clear();
+    FILE *block_file = fopen(path, "rb");
+    if(block_file == nullptr) return errno == ENOENT ? 0 : -1;
+
+    uint64_t block_num = 0;
+    bool ok = fread(&blocks->block_size, sizeof(uint64_t), 1, block_file) == 1
+        && fread(&blocks->data_size, sizeof(uint64_t), 1, block_file) == 1
+        && fread(&block_num, sizeof(uint64_t), 1, block_file) == 1
+        && blocks->block_size > 0 && blocks->block_size <= UINT32_MAX
+        && block_num == (blocks->data_size + blocks->block_size - 1) / blocks->block_size;
+    if(ok) blocks->blocks.resize(block_num);
+    for(size_t block_i = 0; ok && block_i < block_num; ++block_i) {
+        struct block_entry &block = blocks->blocks[block_i];
+        ok = fread(&block.offset, sizeof(block.offset), 1, block_file) == 1
+            && fread(&block.size, sizeof(block.size), 1, block_file) == 1;
+    }
+    fclose(block_file);
+    if(!ok) {
+        print_error("Bad block index file %s\n", path);
+        blocks->block_size = 0;
+        blocks->blocks.clear();
+        return -1;
+    }
+    return block_num;
+}
+
+int write_block_index(const struct block_index &blocks) {
+    char path[PATH_SIZE], tmp_path[PATH_SIZE];
+    sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, BLOCKFILE);
+    sprintf(tmp_path, "%s/%s/%s.tmp", PATH2PDIR, OPDIR, BLOCKFILE);
+    FILE *block_file = fopen(tmp_path, "wb");
+    if(block_file == nullptr) {
+        print_error("Error on open block index file %s\n", tmp_path);
+        return -1;
+    }
+    uint64_t block_num = blocks.blocks.size();
+    fwrite(&blocks.block_size, sizeof(uint64_t), 1, block_file);
+    fwrite(&blocks.data_size, sizeof(uint64_t), 1, block_file);
+    fwrite(&block_num, sizeof(uint64_t), 1, block_file);
+    for(const struct block_entry &block : blocks.blocks) {
+        fwrite(&block.offset, sizeof(block.offset), 1, block_file);
+        fwrite(&block.size, sizeof(block.size), 1, block_file);
+    }
+    bool ok = fflush(block_file) == 0 && fsync(fileno(block_file)) == 0;
+    ok = fclose(block_file) == 0 && ok;
+    if(!ok || rename(tmp_path, path) < 0) {
+        print_error("Error on write block index file %s\n", path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+#if defined(USE_ZSTD)
+// 每个线程复用自己的压缩和解压上下文
+struct zstd_context {
+    ZSTD_CCtx *cctx = nullptr;
+    ZSTD_DCtx *dctx = nullptr;
+
+    ~zstd_context() {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+};
+static thread_local struct zstd_context zstd_ctx;
+
+bool compression_available() {
+    return true;
+}
+
+int compress_block(const char *src, size_t size, int level, std::vector<char> &dst) {
+    if(zstd_ctx.cctx == nullptr && (zstd_ctx.cctx = ZSTD_createCCtx()) == nullptr) return -1;
+    dst.resize(ZSTD_compressBound(size));
+    size_t res = ZSTD_compressCCtx(zstd_ctx.cctx, dst.data(), dst.size(), src, size, level);
+    if(ZSTD_isError(res)) {
+        print_error("Error on compress block: %s\n", ZSTD_getErrorName(res));
+        return -1;
+    }
+    if(res >= size) dst.assign(src, src + size);
+    else dst.resize(res);
+    return 0;
+}
+
+int decompress_block(const char *src, size_t size, char *dst, size_t raw_size) {
+    if(size == raw_size) {
+        memcpy(dst, src, size);
+        return 0;
+    }
+    if(zstd_ctx.dctx == nullptr && (zstd_ctx.dctx = ZSTD_createDCtx()) == nullptr) return -1;
+    size_t res = ZSTD_decompressDCtx(zstd_ctx.dctx, dst, raw_size, src, size);
+    return !ZSTD_isError(res) && res == raw_size ? 0 : -1;
+}
+#else
+bool compression_available() {
+    return false;
+}
+
+int compress_block(const char *, size_t, int, std::vector<char> &) {
+    return -1;
+}
+
+// 没有压缩的块仍然可以读
+int decompress_block(const char *src, size_t size, char *dst, size_t raw_size) {
+    if(size != raw_size) return -1;
+    memcpy(dst, src, size);
+    return 0;
+}
+#endif
+
+BlockCache::BlockCache(size_t capacity) : shard_capacity(capacity / shard_n) {}
+
+BlockCache::block_ptr BlockCache::get(uint64_t block_i) {
+    Shard &shard = shards[block_i % shard_n];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.blocks.find(block_i);
+    if(it == shard.blocks.end()) return nullptr;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+}
+
+void BlockCache::put(uint64_t block_i, block_ptr block) {
+    Shard &shard = shards[block_i % shard_n];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // 其他线程同时解压了同一块
+    if(shard.blocks.count(block_i)) return;
+    shard.lru.emplace_front(block_i, block);
+    shard.blocks[block_i] = shard.lru.begin();
+    shard.size += block->size();
+    // 至少保留刚放入的一块
+    while(shard.size > shard_capacity && shard.lru.size() > 1) {
+        shard.size -= shard.lru.back().second->size();
+        shard.blocks.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+    }
+}
+
+// 先查缓存，不在缓存中时读出压缩的块并解压
+static BlockCache::block_ptr load_block(const struct needle_index_list *index_list, BlockCache *cache, uint64_t block_i) {
+    BlockCache::block_ptr block = cache->get(block_i);
+    if(block) return block;
+    const struct block_entry &entry = index_list->blocks.blocks[block_i];
+    thread_local std::vector<char> compressed;
+    compressed.resize(entry.size);
+    if(pread(fileno(index_list->data_file), compressed.data(), entry.size, entry.offset) != (ssize_t)entry.size) {
+        print_error("Error on read block %lu\n", block_i);
+        return nullptr;
+    }
+    auto raw = std::make_shared<std::vector<char>>(index_list->blocks.raw_size(block_i));
+    if(decompress_block(compressed.data(), entry.size, raw->data(), raw->size()) < 0) {
+        print_error("Error on decompress block %lu\n", block_i);
+        return nullptr;
+    }
+    cache->put(block_i, raw);
+    return raw;
+}
+
+ssize_t read_blocks(const struct needle_index_list *index_list, BlockCache *cache,
+                    char *buf, size_t size, uint64_t offset) {
+    const struct block_index &blocks = index_list->blocks;
+    if(offset >= blocks.data_size) return 0;
+    size = std::min<uint64_t>(size, blocks.data_size - offset);
+    size_t read_size = 0;
+    // 文件可能跨过多个块
+    while(read_size < size) {
+        uint64_t block_i = offset / blocks.block_size, in_block = offset % blocks.block_size;
+        BlockCache::block_ptr block = load_block(index_list, cache, block_i);
+        if(block == nullptr) return -EIO;
+        size_t copy_size = std::min<uint64_t>(size - read_size, block->size() - in_block);
+        memcpy(buf + read_size, block->data() + in_block, copy_size);
+        read_size += copy_size;
+        offset += copy_size;
+    }
+    return read_size;
+}
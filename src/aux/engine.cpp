@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <numeric>
+
+#include "engine.h"
+#include "helper.h"
+
+/*  IndexEngine  */
+size_t IndexEngine::get_batch(const index_key_t *keys, size_t n, uint64_t *poss, bool *found) const {
+    size_t found_num = 0;
+    for(size_t key_i = 0; key_i < n; ++key_i) {
+        found[key_i] = get(keys[key_i], poss[key_i]);
+        if(found[key_i]) ++found_num;
+    }
+    return found_num;
+}
+
+uint64_t IndexEngine::lower_bound(const index_key_t &key) const {
+    auto it = std::lower_bound(indexs->begin(), indexs->end(), key,
+        [](const struct needle_index &needle, const index_key_t &k) { return needle.filename < k; });
+    return it - indexs->begin();
+}
+
+void IndexEngine::range(const index_key_t &begin_key, const index_key_t &end_key,
+                        uint64_t &first, uint64_t &last) const {
+    first = lower_bound(begin_key);
+    last = end_key > begin_key ? lower_bound(end_key) : first;
+}
+
+void IndexEngine::scan(const index_key_t &prefix, size_t limit,
+                       uint64_t &first, uint64_t &last) const {
+    first = last = lower_bound(prefix);
+    while(last < indexs->size() && last - first < limit
+        && (*indexs)[last].filename.starts_with(prefix)) ++last;
+}
+
+// 按文件名比较指向 needle 的指针
+static bool needle_ptr_less(const struct needle_index *a, const struct needle_index *b) {
+    return a->filename < b->filename;
+}
+
+static delta_entries_t::const_iterator delta_lower_bound(const delta_entries_t &delta, const index_key_t &key) {
+    return std::lower_bound(delta.begin(), delta.end(), key,
+        [](const struct needle_index *needle, const index_key_t &k) { return needle->filename < k; });
+}
+
+void IndexEngine::insert(const std::vector<const struct needle_index *> &needles) {
+    if(needles.empty()) return;
+    if(deltas.empty()) deltas.resize(run_num());
+    std::vector<const struct needle_index *> sorted(needles);
+    std::stable_sort(sorted.begin(), sorted.end(), needle_ptr_less);
+    size_t added_n = 0;
+    for(size_t begin_i = 0, end_i = 0; begin_i < sorted.size(); begin_i = end_i) {
+        size_t run_i = locate_run(sorted[begin_i]->filename);
+        end_i = begin_i + 1;
+        while(end_i < sorted.size() && locate_run(sorted[end_i]->filename) == run_i) ++end_i;
+
+        // 和原来的数组归并，同名时新插入的覆盖原来的，同一批中同名的只保留最后一个
+        delta_ptr old_delta = std::atomic_load(&deltas[run_i]);
+        std::shared_ptr<delta_entries_t> delta = std::make_shared<delta_entries_t>();
+        size_t old_n = old_delta ? old_delta->size() : 0, old_i = 0;
+        delta->reserve(old_n + end_i - begin_i);
+        for(size_t needle_i = begin_i; needle_i < end_i; ++needle_i) {
+            const struct needle_index *needle = sorted[needle_i];
+            if(needle_i + 1 < end_i && sorted[needle_i + 1]->filename == needle->filename) continue;
+            while(old_i < old_n && (*old_delta)[old_i]->filename < needle->filename) delta->push_back((*old_delta)[old_i++]);
+            if(old_i < old_n && (*old_delta)[old_i]->filename == needle->filename) ++old_i;
+            delta->push_back(needle);
+        }
+        if(old_delta) delta->insert(delta->end(), old_delta->begin() + old_i, old_delta->end());
+        added_n += delta->size() - old_n;
+        std::atomic_store(&deltas[run_i], delta_ptr(delta));
+    }
+    delta_n.fetch_add(added_n, std::memory_order_release);
+}
+
+const struct needle_index *IndexEngine::find(const index_key_t &key) const {
+    uint64_t pos = 0;
+    if(delta_size() == 0) return get(key, pos) ? &(*indexs)[pos] : nullptr;
+    size_t run_i = locate_run(key);
+    delta_ptr delta = run_delta(run_i);
+    if(delta) {
+        auto it = delta_lower_bound(*delta, key);
+        if(it != delta->end() && (*it)->filename == key) return *it;
+    }
+    return get_in_run(run_i, key, pos) ? &(*indexs)[pos] : nullptr;
+}
+
+size_t IndexEngine::run_num() const {
+    return std::max<size_t>(1, (indexs->size() + ENGINE_RUN_SIZE - 1) / ENGINE_RUN_SIZE);
+}
+
+size_t IndexEngine::locate_run(const index_key_t &key) const {
+    // 第一个大于 key 的段首的前一段
+    size_t low = 1, high = run_num();
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        if(key < (*indexs)[mid * ENGINE_RUN_SIZE].filename) high = mid;
+        else low = mid + 1;
+    }
+    return low - 1;
+}
+
+void IndexEngine::run_range(size_t run_i, uint64_t &begin, uint64_t &end) const {
+    begin = std::min<uint64_t>(run_i * ENGINE_RUN_SIZE, indexs->size());
+    end = std::min<uint64_t>(begin + ENGINE_RUN_SIZE, indexs->size());
+}
+
+delta_ptr IndexEngine::run_delta(size_t run_i) const {
+    if(delta_size() == 0) return nullptr;
+    return std::atomic_load(&deltas[run_i]);
+}
+
+/*  NeedleCursor  */
+void NeedleCursor::seek(const index_key_t &key) {
+    enter_run(engine->locate_run(key));
+    uint64_t run_begin = pos;
+    pos = std::min(std::max(engine->lower_bound(key), run_begin), run_end);
+    if(delta) delta_i = delta_lower_bound(*delta, key) - delta->begin();
+    settle();
+}
+
+void NeedleCursor::next() {
+    if(current == nullptr) return;
+    ++(from_delta ? delta_i : pos);
+    settle();
+}
+
+void NeedleCursor::enter_run(size_t run_i) {
+    this->run_i = run_i;
+    engine->run_range(run_i, pos, run_end);
+    delta = engine->run_delta(run_i);
+    delta_i = 0;
+}
+
+void NeedleCursor::settle() {
+    while(true) {
+        bool base_left = pos < run_end, delta_left = delta && delta_i < delta->size();
+        if(!base_left && !delta_left) {
+            if(run_i + 1 >= engine->run_num()) {
+                current = nullptr;
+                return;
+            }
+            enter_run(run_i + 1);
+            continue;
+        }
+        const struct needle_index *base_needle = base_left ? &engine->needle_at(pos) : nullptr;
+        from_delta = delta_left && (!base_left || !(base_needle->filename < (*delta)[delta_i]->filename));
+        current = from_delta ? (*delta)[delta_i] : base_needle;
+        // 插入的 needle 覆盖 indexs 中同名的
+        if(from_delta && base_left && base_needle->filename == current->filename) ++pos;
+        if(current->flags & FILE_EXIT) return;
+        ++(from_delta ? delta_i : pos);
+    }
+}
+
+/*  BinaryEngine  */
+void BinaryEngine::build(std::vector<struct needle_index> &indexs) {
+    this->indexs = &indexs;
+}
+
+bool BinaryEngine::get(const index_key_t &key, uint64_t &pos) const {
+    pos = lower_bound(key);
+    return pos < indexs->size() && (*indexs)[pos].filename == key;
+}
+
+bool BinaryEngine::get_in_run(size_t run_i, const index_key_t &key, uint64_t &pos) const {
+    uint64_t begin, end;
+    run_range(run_i, begin, end);
+    auto it = std::lower_bound(indexs->begin() + begin, indexs->begin() + end, key,
+        [](const struct needle_index &needle, const index_key_t &k) { return needle.filename < k; });
+    pos = it - indexs->begin();
+    return pos < end && (*indexs)[pos].filename == key;
+}
+
+/*  HashEngine  */
+void HashEngine::build(std::vector<struct needle_index> &indexs) {
+    this->indexs = &indexs;
+    table.clear();
+    table.reserve(indexs.size());
+    for(size_t i = 0; i < indexs.size(); ++i) {
+        table.emplace(std::string_view(indexs[i].filename.c_str()), i);
+    }
+}
+
+bool HashEngine::get(const index_key_t &key, uint64_t &pos) const {
+    auto it = table.find(std::string_view(key.c_str()));
+    if(it == table.end()) return false;
+    pos = it->second;
+    return true;
+}
+
+size_t HashEngine::memory_usage() const {
+    // 每个节点额外有一个 next 指针和缓存的 hash 值
+    return sizeof(*this) + table.bucket_count() * sizeof(void *)
+        + table.size() * (sizeof(decltype(table)::value_type) + sizeof(void *) + sizeof(size_t));
+}
+
+/*  SIndexEngine  */
+#if defined(USE_SINDEX)
+SIndexEngine::~SIndexEngine() {
+    delete sindex_model;
+}
+
+void SIndexEngine::build(std::vector<struct needle_index> &indexs) {
+    this->indexs = &indexs;
+    // 构造 keys 和 vals
+    std::vector<index_key_t> keys(indexs.size());
+    for(size_t i = 0; i < indexs.size(); ++i) {
+        keys[i] = indexs[i].filename;
+    }
+    std::vector<uint64_t> vals(indexs.size());
+    std::iota(vals.begin(), vals.end(), 0);
+    DEBUG_THIS("Index size: " << indexs.size());
+    delete sindex_model;
+    sindex_model = new sindex_t(keys, vals, indexs);
+}
+
+bool SIndexEngine::get(const index_key_t &key, uint64_t &pos) const {
+    return sindex_model->get(key, pos);
+}
+
+uint64_t SIndexEngine::lower_bound(const index_key_t &key) const {
+    return sindex_model->lower_bound(key);
+}
+
+size_t SIndexEngine::memory_usage() const {
+    return sizeof(*this) + sindex_model->memory_usage();
+}
+
+size_t SIndexEngine::run_num() const {
+    return sindex_model->group_num();
+}
+
+size_t SIndexEngine::locate_run(const index_key_t &key) const {
+    return sindex_model->locate_group(key);
+}
+
+void SIndexEngine::run_range(size_t run_i, uint64_t &begin, uint64_t &end) const {
+    sindex_model->group_range(run_i, begin, end);
+}
+
+bool SIndexEngine::get_in_run(size_t run_i, const index_key_t &key, uint64_t &pos) const {
+    return sindex_model->get_in_group(run_i, key, pos);
+}
+#endif
+
+bool parse_engine_type(const char *name, engine_type_t &type) {
+    if(strcmp(name, "sindex") == 0) type = engine_type_t::sindex;
+    else if(strcmp(name, "binary") == 0) type = engine_type_t::binary;
+    else if(strcmp(name, "hash") == 0) type = engine_type_t::hash;
+    else return false;
+    return true;
+}
+
+bool engine_available(engine_type_t type) {
+#if defined(USE_SINDEX)
+    return true;
+#else
+    return type != engine_type_t::sindex;
+#endif
+}
+
+IndexEngine *create_engine(engine_type_t type) {
+    switch(type) {
+#if defined(USE_SINDEX)
+    case engine_type_t::sindex:
+        return new SIndexEngine();
+#endif
+    case engine_type_t::binary:
+        return new BinaryEngine();
+    case engine_type_t::hash:
+        return new HashEngine();
+    default:
+        return nullptr;
+    }
+}
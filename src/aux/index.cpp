@@ -1,10 +1,10 @@
+#include "block.h"
 #include "index.h"
 
-int64_t init(struct needle_index_list *index_list) {
-    COUT_THIS("Init start!");
-    char path[1024];
-	sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, INDEXFILE);
-
+// 读入 path 中的所有 needle_index 并排序
+// keep_last 时同名的 needle 只保留最后写入的一个
+// 成功返回 index 数目，失败返回 -1
+static int64_t load_index_file(const char *path, struct needle_index_list *index_list, bool keep_last) {
 	FILE *index_file = fopen(path, "rb");
 	if(index_file == NULL) {
 		print_error("Error on open index file %s\n", path);
@@ -21,17 +21,50 @@ int64_t init(struct needle_index_list *index_list) {
 	}
 	fclose(index_file);
 
-	// 排序
-    std::sort(index_list->indexs.begin(), index_list->indexs.end());
+	// 排序，按文件名顺序合并的索引文件已经有序
+    if(!std::is_sorted(index_list->indexs.begin(), index_list->indexs.end())) {
+        if(keep_last) std::stable_sort(index_list->indexs.begin(), index_list->indexs.end());
+        else std::sort(index_list->indexs.begin(), index_list->indexs.end());
+    }
+    if(keep_last) {
+        std::vector<struct needle_index> &indexs = index_list->indexs;
+        size_t unique_n = 0;
+        for(size_t index_i = 0; index_i < indexs.size(); ++index_i) {
+            if(index_i + 1 < indexs.size() && indexs[index_i + 1].filename == indexs[index_i].filename) continue;
+            if(unique_n != index_i) indexs[unique_n] = indexs[index_i];
+            ++unique_n;
+        }
+        indexs.resize(unique_n);
+        index_list->index_num = unique_n;
+    }
+    return index_list->index_num;
+}
+
+int64_t init(struct needle_index_list *index_list) {
+    COUT_THIS("Init start!");
+    char path[1024];
+    // 大文件和索引文件可能不对应
+    sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, INDEXFILE_COMPACT);
+    if(access(path, F_OK) == 0) {
+        print_error("Archive is being compacted, run sfcas-compact to finish it first\n");
+        return -1;
+    }
+	sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, INDEXFILE);
+    if(load_index_file(path, index_list, false) < 0) return -1;
+
     // 打开大文件
     sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, BIGFILE);
 	index_list->data_file = fopen(path, "rb");
 	if(index_list->data_file == NULL) {
-        fclose(index_file);
         release_needle(index_list);
 		print_error("Error on open data file.\n");
 		return -1;
 	}
+    // 压缩归档的块索引
+    if(load_block_index(&(index_list->blocks)) < 0) {
+        release_needle(index_list);
+        return -1;
+    }
 
     // 初始化 cache
     index_list->is_cached = 0;
@@ -40,26 +73,93 @@ int64_t init(struct needle_index_list *index_list) {
 	return index_list->index_num;
 }
 
-sindex_t *get_sindex_model(std::vector<struct needle_index> &indexs){
-    // 构造 keys 和 vals
-    std::vector<index_key_t> keys(indexs.size());
-    for(size_t i = 0; i < indexs.size(); ++i) {
-        keys[i] = indexs[i].filename;
+int64_t init_delta(struct needle_index_list *delta_list) {
+    char path[1024];
+    sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, DELTAFILE);
+    if(access(path, F_OK) != 0) {
+        delta_list->indexs.clear();
+        delta_list->index_num = 0;
+        return 0;
+    }
+    // 挂载后写入的文件追加在 delta 索引末尾，同名时以后写入的为准
+    return load_index_file(path, delta_list, true);
+}
+
+int append_delta_index(const std::vector<struct needle_index> &needles) {
+    char path[1024];
+    sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, DELTAFILE);
+    FILE *delta_file = fopen(path, "r+b");
+    if(delta_file == NULL) delta_file = fopen(path, "w+b");
+    if(delta_file == NULL) {
+        print_error("Error on open delta index file %s\n", path);
+        return -1;
+    }
+    uint64_t index_num = 0;
+    if(fread(&index_num, sizeof(uint64_t), 1, delta_file) != 1) index_num = 0;
+    // 先写 needle 再更新数目，数目之后的内容读取时会被忽略
+    fseek(delta_file, 0, SEEK_END);
+    if(ftell(delta_file) < (long)sizeof(uint64_t)) fwrite(&index_num, sizeof(uint64_t), 1, delta_file);
+    for(const struct needle_index &needle : needles) {
+        insert_needle_index(&needle, delta_file);
     }
-    std::vector<uint64_t> vals(indexs.size());
-    std::iota(vals.begin(), vals.end(), 0);
-    DEBUG_THIS("Index size: " << indexs.size());
-    return new sindex_t(keys, vals, indexs);
+    bool ok = fflush(delta_file) == 0 && fdatasync(fileno(delta_file)) == 0;
+    index_num += needles.size();
+    fseek(delta_file, 0, SEEK_SET);
+    ok = ok && fwrite(&index_num, sizeof(uint64_t), 1, delta_file) == 1
+        && fflush(delta_file) == 0 && fdatasync(fileno(delta_file)) == 0;
+    ok = fclose(delta_file) == 0 && ok;
+    if(!ok) print_error("Error on write delta index file %s\n", path);
+    return ok ? 0 : -1;
 }
 
-struct needle_index *find_index(struct needle_index_list *index_list, const char *filename, sindex_t *index_model){
-    uint64_t pos = 0;
-    if(index_model->get(index_key_t(filename), pos)) {
-        return &(index_list->indexs[pos]);
+void merge_delta_index(const std::vector<struct needle_index> &indexs, std::vector<struct needle_index> &needles,
+                       std::vector<struct needle_index> &merged) {
+    std::stable_sort(needles.begin(), needles.end());
+    merged.clear();
+    merged.reserve(indexs.size() + needles.size());
+    size_t index_i = 0;
+    for(size_t needle_i = 0; needle_i < needles.size(); ++needle_i) {
+        // 同一批中同名的只保留最后一个
+        if(needle_i + 1 < needles.size() && needles[needle_i + 1].filename == needles[needle_i].filename) continue;
+        while(index_i < indexs.size() && indexs[index_i] < needles[needle_i]) merged.push_back(indexs[index_i++]);
+        if(index_i < indexs.size() && indexs[index_i].filename == needles[needle_i].filename) ++index_i;
+        merged.push_back(needles[needle_i]);
     }
+    merged.insert(merged.end(), indexs.begin() + index_i, indexs.end());
+}
+
+IndexEngine *get_index_engine(std::vector<struct needle_index> &indexs, engine_type_t type) {
+    // 空的 needle 数组上 SIndex 没有组，插入的文件没有 run 可放，改用二分查找，之后合并时再训练
+    if(indexs.empty() && type == engine_type_t::sindex) type = engine_type_t::binary;
+    IndexEngine *engine = create_engine(type);
+    if(engine == nullptr) {
+        print_error("Index engine is not available in this build\n");
+        return nullptr;
+    }
+    engine->build(indexs);
+    DEBUG_THIS("Engine " << engine->name() << " memory: " << engine->memory_usage());
+    return engine;
+}
+
+const struct needle_index *find_index(const char *filename, IndexEngine *engine){
+    if(strlen(filename) > MAX_FILE_LEN) return nullptr;
+    const struct needle_index *needle = engine->find(index_key_t(filename));
+    if(needle && (needle->flags & FILE_EXIT)) return needle;
     return nullptr;
 }
 
+bool find_dir(const char *dirname, IndexEngine *engine) {
+    char prefix[PATH_SIZE];
+    // 多出的 '/' 也要能放进 key 中
+    if(strlen(dirname) + 1 > MAX_FILE_LEN) return false;
+    sprintf(prefix, "%s/", dirname);
+    index_key_t prefix_key(prefix);
+    // 目录下的文件可能都已经删除，要跳过删除的 needle
+    NeedleCursor cursor(engine);
+    cursor.seek(prefix_key);
+    return cursor.get() && cursor.get()->filename.starts_with(prefix_key);
+}
+
 void release_needle(struct needle_index_list *index_list) {
     if(index_list->data_file) fclose(index_list->data_file);
     index_list->data_file = nullptr;
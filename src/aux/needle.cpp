@@ -1,11 +1,23 @@
 #include <needle.h>
+#include "helper.h"
 
-void set_needle_index(struct needle_index *needle, struct stat *file_info, struct dirent *entry, uint64_t offset) {
+void set_needle_index(struct needle_index *needle, struct stat *file_info, const char *filename, uint64_t offset) {
     needle->flags = FILE_EXIT;
+    needle->crc = 0;
     needle->offset = offset;
     needle->size = file_info->st_size;
-    needle->filename.set_key(entry->d_name);
-    needle->neddle_size = NEEDLE_BASIC_SIZE + strlen(needle->filename.get_name());
+    needle->filename.set_key(filename);
+    needle->neddle_size = NEEDLE_BASIC_SIZE + needle->filename.size();
+}
+
+void set_needle_index(struct needle_index *needle, struct stat *file_info, struct dirent *entry, uint64_t offset) {
+    set_needle_index(needle, file_info, entry->d_name, offset);
+}
+
+void set_needle_crc(struct needle_index *needle, uint32_t crc) {
+    if(!(needle->flags & FILE_CRC)) needle->neddle_size += NEEDLE_CRC_SIZE;
+    needle->flags |= FILE_CRC;
+    needle->crc = crc;
 }
 
 void read_needle_index(struct needle_index *needle, FILE *index_file) {
@@ -13,16 +25,32 @@ void read_needle_index(struct needle_index *needle, FILE *index_file) {
     fread(&needle->flags, sizeof(needle->flags), 1, index_file);
     fread(&needle->offset, sizeof(needle->offset), 1, index_file);
     fread(&needle->size, sizeof(needle->size), 1, index_file);
-    // 必须有结尾的 '\0'
-    char *filename_ptr = needle->filename.get_name();
-    fread(filename_ptr, 1, needle->neddle_size - NEEDLE_BASIC_SIZE, index_file);
-    filename_ptr[needle->neddle_size - NEEDLE_BASIC_SIZE] = '\0';
+    // 没有 FILE_CRC 的 needle 和之前的格式相同
+    size_t basic_size = NEEDLE_BASIC_SIZE;
+    needle->crc = 0;
+    if(needle->flags & FILE_CRC) {
+        fread(&needle->crc, sizeof(needle->crc), 1, index_file);
+        basic_size += NEEDLE_CRC_SIZE;
+    }
+    // 文件名在索引文件中没有结尾的 '\0'
+    char filename[MAX_FILE_LEN + 1];
+    size_t filename_len = needle->neddle_size - basic_size;
+    if(filename_len > MAX_FILE_LEN) {
+        print_error("Filename in index file longer than %d, truncated\n", MAX_FILE_LEN);
+        fread(filename, 1, MAX_FILE_LEN, index_file);
+        fseek(index_file, filename_len - MAX_FILE_LEN, SEEK_CUR);
+        filename_len = MAX_FILE_LEN;
+        needle->neddle_size = basic_size + filename_len;
+    }
+    else fread(filename, 1, filename_len, index_file);
+    needle->filename.set_key(filename, filename_len);
 }
 
-void insert_needle_index(struct needle_index *needle, FILE *index_file) {
+void insert_needle_index(const struct needle_index *needle, FILE *index_file) {
     fwrite(&(needle->neddle_size), sizeof(needle->neddle_size), 1, index_file);
     fwrite(&(needle->flags), sizeof(needle->flags), 1, index_file);
     fwrite(&(needle->offset), sizeof(needle->offset), 1, index_file);
     fwrite(&(needle->size), sizeof(needle->size), 1, index_file);
-    fwrite(needle->filename.get_name(), 1, strlen(needle->filename.get_name()), index_file);
+    if(needle->flags & FILE_CRC) fwrite(&(needle->crc), sizeof(needle->crc), 1, index_file);
+    fwrite(needle->filename.get_name(), 1, needle->filename.size(), index_file);
 }
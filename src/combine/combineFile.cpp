@@ -1,103 +1,839 @@
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 
+#include "block.h"
 #include "constant.h"
+#include "hash.h"
 #include "needle.h"
 #include "helper.h"
+#include "simd.h"
+#include "tar.h"
 
-int main() {
-    char path2file[PATH_SIZE], path2indexFile[PATH_SIZE], path2bigFile[PATH_SIZE];
-    char buf[BUFFER_SIZE];
-    sprintf(path2file, "%s/%s", PATH2PDIR, OPDIR);
+// 不支持 copy_file_range 时用 pread/pwrite 复制，每个线程一块缓冲区
+#define COPY_BUFFER_SIZE (1 << 20)
+// 每个线程一次领取的文件数
+#define COMBINE_CHUNK_SIZE 64
+// --compress 时每个线程一轮压缩的块数，压缩好的块按顺序写入后再压缩下一轮
+#define COMPRESS_BATCH_BLOCKS 16
+// --tar 时攒够这么多数据再写入大文件
+#define STREAM_WRITE_SIZE (8 << 20)
+
+// 按合并顺序排列的一个小文件
+struct combine_entry {
+    uint64_t name_offset;   // 相对路径在 names 中的位置
+    uint64_t offset;        // 在大文件中的偏移
+    uint64_t size;
+    bool ok;
+    // --dedup 时和之前的某个文件内容相同，共用它在大文件中的数据，不再复制
+    bool dup;
+    hash128_t hash;
+    // --checksum 时文件内容的 CRC32C
+    uint32_t crc;
+};
+
+// 按大小和内容哈希去重
+struct content_key {
+    uint64_t size;
+    hash128_t hash;
+
+    bool operator==(const struct content_key &other) const {
+        return size == other.size && hash == other.hash;
+    }
+};
+
+struct content_key_hash {
+    size_t operator()(const struct content_key &key) const {
+        return key.hash.low ^ key.size;
+    }
+};
+
+struct combine_list {
+    // 以 '\0' 结尾的相对路径依次存放，避免每个文件单独分配
+    std::vector<char> names;
+    std::vector<struct combine_entry> entries;
+    // 子目录按后序排列，先子目录后父目录，合并完后依次删除
+    std::vector<std::string> dirs;
+
+    const char *name(const struct combine_entry &entry) const {
+        return names.data() + entry.name_offset;
+    }
+};
+
+static std::atomic<bool> copy_range_supported(true);
+
+// OPDIR 顶层的索引文件和大文件，不能作为小文件合并
+static bool is_archive_name(const char *name) {
+    return strcmp(name, INDEXFILE) == 0 || strcmp(name, BIGFILE) == 0
+        || strcmp(name, INDEXFILE ".tmp") == 0 || strcmp(name, BIGFILE ".tmp") == 0
+        || strncmp(name, DELTAFILE, strlen(DELTAFILE)) == 0
+        || strcmp(name, BIGFILE_COMPACT) == 0
+        || strncmp(name, INDEXFILE_COMPACT, strlen(INDEXFILE_COMPACT)) == 0
+        || strncmp(name, BLOCKFILE, strlen(BLOCKFILE)) == 0;
+}
+
+// 收集 OPDIR 下 rel_dir 目录中的所有小文件（包括子目录），文件名记为相对 OPDIR 的路径
+// 顺序和逐个 readdir 合并时相同
+// 成功返回 0，失败返回 -1
+static int collect_dir(const char *rel_dir, struct combine_list &list) {
+    char path2dir[PATH_SIZE], path2file[PATH_SIZE], rel_path[MAX_FILE_LEN + 1];
+    sprintf(path2dir, "%s/%s%s%s", PATH2PDIR, OPDIR, rel_dir[0] ? "/" : "", rel_dir);
+
+    DIR *dir = opendir(path2dir);
+    if(dir == nullptr) {
+        print_error("Error on open directory %s\n", path2dir);
+        return -1;
+    }
+    struct dirent *entry;
+    while((entry = readdir(dir)) != 0) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        // 跳过顶层的索引文件和大文件
+        if(rel_dir[0] == '\0' && is_archive_name(entry->d_name)) continue;
+
+        // 超长的路径放不进索引，目录下的文件路径只会更长，整个跳过
+        int rel_len = snprintf(rel_path, sizeof(rel_path), "%s%s%s",
+            rel_dir, rel_dir[0] ? "/" : "", entry->d_name);
+        if(rel_len < 0 || rel_len > MAX_FILE_LEN) {
+            print_error("Skip %s%s%s: path longer than %d\n", rel_dir, rel_dir[0] ? "/" : "", entry->d_name,
+                MAX_FILE_LEN);
+            continue;
+        }
+        // 文件系统不提供类型时才 lstat
+        bool is_dir = entry->d_type == DT_DIR;
+        if(entry->d_type == DT_UNKNOWN) {
+            struct stat file_info;
+            sprintf(path2file, "%s/%s/%s", PATH2PDIR, OPDIR, rel_path);
+            if(lstat(path2file, &file_info) < 0) {
+                closedir(dir);
+                print_error("Error for stat %s\n", rel_path);
+                return -1;
+            }
+            is_dir = S_ISDIR(file_info.st_mode);
+        }
+
+        if(is_dir) {
+            if(collect_dir(rel_path, list) < 0) {
+                closedir(dir);
+                return -1;
+            }
+            list.dirs.push_back(rel_path);
+            continue;
+        }
+
+        list.entries.push_back({list.names.size(), 0, 0, false, false, {0, 0}, 0});
+        list.names.insert(list.names.end(), rel_path, rel_path + rel_len + 1);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+// 用 thread_n 个线程对 [0, n) 中的每个下标调用 fn，每次领取 chunk_size 个
+template <class F>
+static void parallel_for(size_t n, size_t thread_n, F fn, size_t chunk_size = COMBINE_CHUNK_SIZE) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t begin;
+        while((begin = next.fetch_add(chunk_size)) < n) {
+            size_t end = std::min(n, begin + chunk_size);
+            for(size_t i = begin; i < end; ++i) fn(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for(size_t thread_i = 1; thread_i < thread_n; ++thread_i) threads.emplace_back(worker);
+    worker();
+    for(auto &thread : threads) thread.join();
+}
+
+// 把 path2file 的 size 个字节复制到大文件的 offset 处
+// crc 不为空时经过用户态缓冲区复制，顺便计算 CRC32C
+// 成功返回 0，失败返回 -1
+static int copy_file(const char *path2file, int big_fd, uint64_t offset, uint64_t size, char *buf, uint32_t *crc) {
+    int small_fd = open(path2file, O_RDONLY);
+    if(small_fd < 0) {
+        print_error("Error on open %s\n", path2file);
+        return -1;
+    }
+    loff_t in_off = 0, out_off = offset;
+    // 在内核中直接复制，不经过用户态缓冲区
+    while(crc == nullptr && copy_range_supported.load(std::memory_order_relaxed) && (uint64_t)in_off < size) {
+        ssize_t copied = copy_file_range(small_fd, &in_off, big_fd, &out_off, size - in_off, 0);
+        if(copied > 0) continue;
+        if(copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+            copy_range_supported.store(false);
+            break;
+        }
+        close(small_fd);
+        print_error("Error on copy %s\n", path2file);
+        return -1;
+    }
+    while((uint64_t)in_off < size) {
+        ssize_t read_bytes = pread(small_fd, buf, std::min(size - in_off, (uint64_t)COPY_BUFFER_SIZE), in_off);
+        if(read_bytes <= 0 || pwrite(big_fd, buf, read_bytes, offset + in_off) != read_bytes) {
+            close(small_fd);
+            print_error("Error on copy %s\n", path2file);
+            return -1;
+        }
+        if(crc) *crc = simd_kernels().crc32c(*crc, buf, read_bytes);
+        in_off += read_bytes;
+    }
+    close(small_fd);
+    return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t size, uint64_t offset) {
+    while(size > 0) {
+        ssize_t written = pwrite(fd, buf, size, offset);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        buf += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+// 读一遍 path2file 的前 size 个字节，hash 不为空时计算内容哈希，crc 不为空时计算 CRC32C
+// 成功返回 0，失败返回 -1
+static int digest_file(const char *path2file, uint64_t size, char *buf, hash128_t *hash, uint32_t *crc) {
+    int small_fd = open(path2file, O_RDONLY);
+    if(small_fd < 0) {
+        print_error("Error on open %s\n", path2file);
+        return -1;
+    }
+    Murmur3Hasher hasher;
+    uint64_t read_size = 0;
+    while(read_size < size) {
+        ssize_t read_bytes = pread(small_fd, buf, std::min(size - read_size, (uint64_t)COPY_BUFFER_SIZE), read_size);
+        if(read_bytes <= 0) {
+            close(small_fd);
+            print_error("Error on read %s\n", path2file);
+            return -1;
+        }
+        if(hash) hasher.update(buf, read_bytes);
+        if(crc) *crc = simd_kernels().crc32c(*crc, buf, read_bytes);
+        read_size += read_bytes;
+    }
+    close(small_fd);
+    if(hash) *hash = hasher.digest();
+    return 0;
+}
+
+// 读出逻辑偏移在 [begin, end) 内的数据并压缩，stored 中是按偏移递增的不重复的文件
+// 成功返回 0，失败返回 -1
+static int compress_range(const struct combine_list &list, const std::vector<size_t> &stored,
+                          uint64_t begin, uint64_t end, int level, std::vector<char> &out) {
+    thread_local std::vector<char> raw;
+    raw.resize(end - begin);
+    // 第一个结尾在 begin 之后的文件
+    auto it = std::upper_bound(stored.begin(), stored.end(), begin, [&list](uint64_t offset, size_t i) {
+        return offset < list.entries[i].offset + list.entries[i].size;
+    });
+    char path2file[PATH_SIZE];
+    for(; it != stored.end() && list.entries[*it].offset < end; ++it) {
+        const struct combine_entry &entry = list.entries[*it];
+        uint64_t copy_begin = std::max(begin, entry.offset), copy_end = std::min(end, entry.offset + entry.size);
+        sprintf(path2file, "%s/%s/%s", PATH2PDIR, OPDIR, list.name(entry));
+        int small_fd = open(path2file, O_RDONLY);
+        if(small_fd < 0) {
+            print_error("Error on open %s\n", path2file);
+            return -1;
+        }
+        uint64_t done = copy_begin;
+        while(done < copy_end) {
+            ssize_t read_bytes = pread(small_fd, raw.data() + (done - begin), copy_end - done, done - entry.offset);
+            if(read_bytes <= 0) break;
+            done += read_bytes;
+        }
+        close(small_fd);
+        if(done < copy_end) {
+            print_error("Error on read %s\n", path2file);
+            return -1;
+        }
+    }
+    return compress_block(raw.data(), raw.size(), level, out);
+}
+
+// 把前 n 个文件的数据按 blocks.block_size 切块，多个线程并行读取和压缩，按块的顺序写入大文件
+// 遇到失败的块时停止，blocks 中只记录写好的块
+// 返回大文件的大小
+static uint64_t compress_files(struct combine_list &list, size_t n, int big_fd, size_t thread_n, int level,
+                               struct block_index &blocks) {
+    std::vector<size_t> stored;
+    for(size_t i = 0; i < n; ++i) {
+        if(!list.entries[i].dup) stored.push_back(i);
+    }
+    uint64_t block_size = blocks.block_size, data_size = blocks.data_size;
+    size_t block_n = (data_size + block_size - 1) / block_size, batch_n = thread_n * COMPRESS_BATCH_BLOCKS;
+    std::vector<std::vector<char>> out(batch_n);
+    std::vector<char> block_ok(batch_n);
+    uint64_t big_size = 0;
+    blocks.blocks.clear();
+    for(size_t batch_begin = 0; batch_begin < block_n && blocks.blocks.size() == batch_begin; batch_begin += batch_n) {
+        size_t batch_end = std::min(block_n, batch_begin + batch_n);
+        parallel_for(batch_end - batch_begin, thread_n, [&](size_t j) {
+            uint64_t begin = (batch_begin + j) * block_size;
+            block_ok[j] = compress_range(list, stored, begin, std::min(data_size, begin + block_size), level, out[j]) == 0;
+        }, 1);
+        for(size_t j = 0; j < batch_end - batch_begin; ++j) {
+            if(!block_ok[j] || write_all(big_fd, out[j].data(), out[j].size(), big_size) < 0) break;
+            blocks.blocks.push_back({big_size, (uint32_t)out[j].size()});
+            big_size += out[j].size();
+        }
+    }
+    // 跨过没写好的块的文件不合并
+    blocks.data_size = std::min(data_size, blocks.blocks.size() * block_size);
+    for(size_t i : stored) {
+        if(list.entries[i].offset + list.entries[i].size > blocks.data_size) list.entries[i].ok = false;
+    }
+    return big_size;
+}
+
+// --tar 时按到达的顺序写入大文件
+// 不压缩时攒够 STREAM_WRITE_SIZE 写一次；压缩时攒够一批块后并行压缩，再按块的顺序写入
+struct stream_writer {
+    int fd;
+    // 不压缩时数据从大文件的 begin 处开始写，压缩归档不能追加，逻辑偏移从 0 开始
+    uint64_t begin;
+    int level;
+    size_t thread_n;
+    struct block_index *blocks;
+    // 已经追加的数据量（未压缩）和已经写入大文件的数据量（压缩时是压缩后的）
+    uint64_t data_size = 0, flushed = 0;
+    bool failed = false;
+    std::vector<char> pending;
+    std::vector<std::vector<char>> out;
+    std::vector<char> block_ok;
+
+    stream_writer(int fd, uint64_t begin, int level, size_t thread_n, struct block_index *blocks)
+        : fd(fd), begin(level > 0 ? 0 : begin), level(level), thread_n(thread_n), blocks(blocks) {}
+
+    // 下一个追加的文件的偏移
+    uint64_t offset() const {
+        return begin + data_size;
+    }
+
+    size_t batch_size() const {
+        return level > 0 ? thread_n * COMPRESS_BATCH_BLOCKS * blocks->block_size : STREAM_WRITE_SIZE;
+    }
+
+    // 成功返回 0，失败返回 -1
+    int append(const char *data, size_t size) {
+        pending.insert(pending.end(), data, data + size);
+        data_size += size;
+        return pending.size() >= batch_size() ? flush(false) : 0;
+    }
+
+    // 压缩时不满一块的数据留到下次，final 时全部写入
+    // 成功返回 0，失败返回 -1
+    int flush(bool final) {
+        if(failed) return -1;
+        if(level == 0) {
+            failed = write_all(fd, pending.data(), pending.size(), begin + flushed) < 0;
+            flushed += pending.size();
+            pending.clear();
+        }
+        else {
+            uint64_t block_size = blocks->block_size;
+            size_t block_n = final ? (pending.size() + block_size - 1) / block_size : pending.size() / block_size;
+            out.resize(std::max(out.size(), block_n));
+            block_ok.resize(std::max(block_ok.size(), block_n));
+            parallel_for(block_n, thread_n, [&](size_t j) {
+                size_t raw_size = std::min<uint64_t>(block_size, pending.size() - j * block_size);
+                block_ok[j] = compress_block(pending.data() + j * block_size, raw_size, level, out[j]) == 0;
+            }, 1);
+            for(size_t j = 0; !failed && j < block_n; ++j) {
+                failed = !block_ok[j] || write_all(fd, out[j].data(), out[j].size(), flushed) < 0;
+                if(failed) break;
+                blocks->blocks.push_back({flushed, (uint32_t)out[j].size()});
+                flushed += out[j].size();
+            }
+            pending.erase(pending.begin(), pending.begin() + std::min<uint64_t>(pending.size(), block_n * block_size));
+        }
+        if(failed) print_error("Error on write data file\n");
+        return failed ? -1 : 0;
+    }
+};
+
+// tar 中的路径是否能作为合并后的文件名：相对路径，不含 "." 和 ".."，不和顶层的归档文件同名
+static bool valid_tar_name(const std::string &name) {
+    if(name.empty() || name.size() > MAX_FILE_LEN) return false;
+    size_t begin = 0;
+    while(begin <= name.size()) {
+        size_t end = std::min(name.find('/', begin), name.size());
+        if(end == begin || name.compare(begin, end - begin, ".") == 0 || name.compare(begin, end - begin, "..") == 0)
+            return false;
+        begin = end + 1;
+    }
+    return name.find('/') != std::string::npos || !is_archive_name(name.c_str());
+}
+
+// 从 tar_fd 中读出所有普通文件，按顺序写入大文件并记录在 list 中
+// 同名的文件只保留最后一个，--dedup 时先把整个文件读到内存中计算哈希，重复的不再写入
+// 硬链接和它指向的文件共用大文件中的数据
+// 中途出错时 list 中是之前已经完整写入的文件
+// 成功返回 0，失败返回 -1
+static int combine_tar(int tar_fd, struct combine_list &list, struct stream_writer &writer, bool dedup, bool checksum,
+                       size_t &skip_n) {
+    TarReader reader(tar_fd);
+    std::unordered_map<struct content_key, uint64_t, content_key_hash> first_copy;
+    std::unordered_map<std::string, size_t> name_pos;
+    std::vector<char> superseded, staged;
+    std::string name, link;
+    uint64_t size;
+    int res;
+    while((res = reader.next(name, size, link)) == 1) {
+        auto link_it = link.empty() ? name_pos.end() : name_pos.find(link);
+        // needle 中的大小只有 4 字节
+        if(!valid_tar_name(name) || size > UINT32_MAX || (!link.empty() && link_it == name_pos.end())) {
+            print_error("Skip %s: bad path, larger than 4GB or link to a skipped file\n", name.c_str());
+            ++skip_n;
+            continue;
+        }
+        struct combine_entry entry = {list.names.size(), writer.offset(), size, true, false, {0, 0}, 0};
+        if(!link.empty()) {
+            entry = list.entries[link_it->second];
+            entry.name_offset = list.names.size();
+            entry.dup = true;
+        }
+        const char *piece;
+        ssize_t piece_size = 0;
+        staged.clear();
+        while(link.empty() && (piece_size = reader.read(&piece)) > 0) {
+            if(dedup) staged.insert(staged.end(), piece, piece + piece_size);
+            else if(writer.append(piece, piece_size) < 0) return -1;
+            if(checksum) entry.crc = simd_kernels().crc32c(entry.crc, piece, piece_size);
+        }
+        if(piece_size < 0) {
+            res = -1;
+            break;
+        }
+        if(dedup && link.empty()) {
+            entry.hash = murmur3_128(staged.data(), staged.size());
+            auto it = first_copy.emplace(content_key{entry.size, entry.hash}, entry.offset);
+            entry.dup = !it.second;
+            if(entry.dup) entry.offset = it.first->second;
+            else if(writer.append(staged.data(), staged.size()) < 0) return -1;
+        }
+        // tar 中后出现的同名文件覆盖之前的
+        auto it = name_pos.emplace(name, list.entries.size());
+        if(!it.second) {
+            superseded[it.first->second] = true;
+            it.first->second = list.entries.size();
+        }
+        superseded.push_back(false);
+        list.entries.push_back(entry);
+        list.names.insert(list.names.end(), name.c_str(), name.c_str() + name.size() + 1);
+    }
+    skip_n += reader.skipped();
+    if(writer.flush(true) < 0) return -1;
+    size_t kept_n = 0;
+    for(size_t i = 0; i < list.entries.size(); ++i) {
+        if(!superseded[i]) list.entries[kept_n++] = list.entries[i];
+    }
+    list.entries.resize(kept_n);
+    return res < 0 ? -1 : 0;
+}
+
+// 第一个处理失败的文件之前的都合并，之后的都保留
+static size_t ok_prefix(const struct combine_list &list, size_t n) {
+    size_t ok_n = 0;
+    while(ok_n < n && list.entries[ok_n].ok) ++ok_n;
+    return ok_n;
+}
+
+// 按文件名排序，顺序和 index_key_t 相同
+static void sort_by_name(struct combine_list &list) {
+    std::sort(list.entries.begin(), list.entries.end(),
+        [&list](const struct combine_entry &a, const struct combine_entry &b) {
+            return strcmp(list.name(a), list.name(b)) < 0;
+        });
+}
+
+// 把新合并的文件和已有的 delta 索引一起写入临时文件，再用 rename 原子地替换
+// 同名时新合并的文件覆盖旧的
+// 成功返回 0，失败返回 -1
+static int write_delta(std::vector<struct needle_index> &needles) {
+    char path2deltaFile[PATH_SIZE], path2tmpFile[PATH_SIZE];
+    sprintf(path2deltaFile, "%s/%s/%s", PATH2PDIR, OPDIR, DELTAFILE);
+    sprintf(path2tmpFile, "%s/%s/%s.tmp", PATH2PDIR, OPDIR, DELTAFILE);
+
+    // 旧的在前，稳定排序后同名的文件中最新的排在最后
+    std::vector<struct needle_index> delta;
+    FILE *delta_file = fopen(path2deltaFile, "rb");
+    if(delta_file) {
+        uint64_t delta_num = 0;
+        fread(&delta_num, sizeof(uint64_t), 1, delta_file);
+        delta.resize(delta_num);
+        for(size_t i = 0; i < delta_num; ++i) read_needle_index(&delta[i], delta_file);
+        fclose(delta_file);
+    }
+    delta.insert(delta.end(), needles.begin(), needles.end());
+    std::stable_sort(delta.begin(), delta.end());
+    size_t delta_num = 0;
+    for(size_t i = 0; i < delta.size(); ++i) {
+        if(i + 1 < delta.size() && delta[i + 1].filename == delta[i].filename) continue;
+        if(delta_num != i) delta[delta_num] = delta[i];
+        ++delta_num;
+    }
+    delta.resize(delta_num);
+
+    FILE *tmp_file = fopen(path2tmpFile, "wb");
+    if(tmp_file == nullptr) {
+        print_error("Error for delta index file %s\n", path2tmpFile);
+        return -1;
+    }
+    uint64_t small_file_num = delta.size();
+    fwrite(&small_file_num, sizeof(uint64_t), 1, tmp_file);
+    for(struct needle_index &needle : delta) insert_needle_index(&needle, tmp_file);
+    bool ok = fflush(tmp_file) == 0 && fsync(fileno(tmp_file)) == 0;
+    ok = fclose(tmp_file) == 0 && ok;
+    if(!ok || rename(path2tmpFile, path2deltaFile) < 0) {
+        print_error("Error on write delta index file %s\n", path2deltaFile);
+        unlink(path2tmpFile);
+        return -1;
+    }
+    COUT_THIS("Delta index num: " << small_file_num);
+    return 0;
+}
+
+static int sync_dir(const char *path2dir) {
+    int dir_fd = open(path2dir, O_RDONLY | O_DIRECTORY);
+    if(dir_fd < 0) return -1;
+    int res = fsync(dir_fd);
+    close(dir_fd);
+    return res;
+}
+
+// 全量合并的临时文件都落盘后用 rename 替换旧归档，已经打开旧文件的 sfcas 继续读旧数据
+// 先换大文件，再删掉失效的 delta 索引、写入或删除块索引，最后换索引文件
+// 成功返回 0，失败返回 -1
+static int replace_archive(const char *big_tmp, const char *index_tmp, const struct block_index *blocks) {
+    char path2indexFile[PATH_SIZE], path2bigFile[PATH_SIZE], path2deltaFile[PATH_SIZE];
+    char path2blockFile[PATH_SIZE], path2dir[PATH_SIZE];
+    sprintf(path2indexFile, "%s/%s/%s", PATH2PDIR, OPDIR, INDEXFILE);
+    sprintf(path2bigFile, "%s/%s/%s", PATH2PDIR, OPDIR, BIGFILE);
+    sprintf(path2deltaFile, "%s/%s/%s", PATH2PDIR, OPDIR, DELTAFILE);
+    sprintf(path2blockFile, "%s/%s/%s", PATH2PDIR, OPDIR, BLOCKFILE);
+    sprintf(path2dir, "%s/%s", PATH2PDIR, OPDIR);
+
+    if(rename(big_tmp, path2bigFile) < 0) return -1;
+    if(unlink(path2deltaFile) < 0 && errno != ENOENT) return -1;
+    if(blocks ? write_block_index(*blocks) < 0 : unlink(path2blockFile) < 0 && errno != ENOENT) return -1;
+    if(rename(index_tmp, path2indexFile) < 0) return -1;
+    return sync_dir(path2dir);
+}
+
+// 用法：combineFile [--sorted] [--append] [--dedup] [--checksum] [--compress[=LEVEL]] [--block-size=KB] [--threads=N]
+//                   [--tar=PATH]
+// --sorted 按文件名顺序写入大文件和索引文件，默认按目录顺序（--tar 时只对索引文件排序）
+// --dedup 先计算每个文件的内容哈希，这次合并中内容相同的文件只写入一份，needle 指向同一个偏移
+// --checksum 在每个 needle 中记录文件内容的 CRC32C，sfcas --verify 和 sfcas-fsck 据此检查数据是否损坏
+// --compress 把文件数据切成 --block-size 大小（默认 64KB）的块，用 zstd 按 LEVEL（默认 3）压缩后写入，块索引写入 BLOCKFILE
+//            压缩归档不能再追加
+// --append 追加到已有的大文件末尾，索引写入 delta 索引文件，主索引文件不变
+// --threads=N 默认使用所有 CPU
+// --tar=PATH 合并 tar 文件（PATH 为 - 时从标准输入读）中的普通文件，不读 OPDIR 中的小文件，也不删除任何文件
+int main(int argc, char *argv[]) {
+    size_t thread_n = std::thread::hardware_concurrency();
+    bool sorted = false, append = false, dedup = false, checksum = false;
+    // level 为 0 时不压缩
+    int level = 0;
+    uint64_t block_size = COMPRESS_BLOCK_SIZE;
+    const char *tar_path = nullptr;
+    for(int arg_i = 1; arg_i < argc; ++arg_i) {
+        if(strcmp(argv[arg_i], "--sorted") == 0) sorted = true;
+        else if(strcmp(argv[arg_i], "--append") == 0) append = true;
+        else if(strcmp(argv[arg_i], "--dedup") == 0) dedup = true;
+        else if(strcmp(argv[arg_i], "--checksum") == 0) checksum = true;
+        else if(strcmp(argv[arg_i], "--compress") == 0) level = 3;
+        else if(strncmp(argv[arg_i], "--compress=", 11) == 0) level = atoi(argv[arg_i] + 11);
+        else if(strncmp(argv[arg_i], "--block-size=", 13) == 0) block_size = strtoul(argv[arg_i] + 13, nullptr, 10) << 10;
+        else if(strncmp(argv[arg_i], "--threads=", 10) == 0) thread_n = strtoul(argv[arg_i] + 10, nullptr, 10);
+        else if(strncmp(argv[arg_i], "--tar=", 6) == 0) tar_path = argv[arg_i] + 6;
+        else {
+            print_error("Usage: %s [--sorted] [--append] [--dedup] [--checksum] [--compress[=LEVEL]] [--block-size=KB] "
+                "[--threads=N] [--tar=PATH]\n", argv[0]);
+            return -1;
+        }
+    }
+    if(level > 0 && !compression_available()) {
+        print_error("Compression is not available in this build\n");
+        return -1;
+    }
+    if(level > 0 && (append || block_size == 0 || block_size > UINT32_MAX)) {
+        print_error("Compressed archive needs a full combine and a block size in (0, 4GB)\n");
+        return -1;
+    }
+    if(thread_n == 0) thread_n = 1;
+    // 在改动归档之前打开，打不开时旧归档不变
+    int tar_fd = -1;
+    if(tar_path) {
+        tar_fd = strcmp(tar_path, "-") == 0 ? STDIN_FILENO : open(tar_path, O_RDONLY);
+        if(tar_fd < 0) {
+            print_error("Error for tar file %s\n", tar_path);
+            return -1;
+        }
+        posix_fadvise(tar_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    char path2indexFile[PATH_SIZE], path2bigFile[PATH_SIZE];
     sprintf(path2indexFile, "%s/%s/%s", PATH2PDIR, OPDIR, INDEXFILE);
     sprintf(path2bigFile, "%s/%s/%s", PATH2PDIR, OPDIR, BIGFILE);
 
     uint64_t small_file_num = 0;
-    FILE *index_file = fopen(path2indexFile, "wb+");
-    if(index_file == nullptr) {
-        print_error("Error for index file %s\n", path2indexFile);
+    // 追加前必须已经合并过
+    if(append && access(path2indexFile, R_OK) != 0) {
+        print_error("Error for index file %s, combine without --append first\n", path2indexFile);
         return -1;
     }
-    // 假设文件都是新创建的，追加暂不考虑
-    // size_t read_bytes = fread(&small_file_num, sizeof(uint64_t), 1, index_file);
-    // // 文件新创建则先写入 0 占位
-    // if(read_bytes < sizeof(uint64_t)) {
-    //     fwrite(&small_file_num, sizeof(uint64_t), 1, index_file);
-    // }
-    fwrite(&small_file_num, sizeof(uint64_t), 1, index_file);
-    FILE *big_file = fopen(path2bigFile, "wb+");
-    if(big_file == nullptr) {
-        fclose(index_file);
+    int lock_fd = open(path2bigFile, append ? O_RDWR : O_RDWR | O_CREAT, 0644);
+    if(lock_fd < 0) {
         print_error("Error for data file %s\n", path2bigFile);
         return -1;
     }
-    
-    DIR *dir = opendir(path2file);
-    struct dirent *entry;
-    struct stat file_info;
-    struct needle_index needle;
-
-    // 1.查找小文件
-    // 2.更新索引文件
-    // 3.合并到大文件中
-    while((entry = readdir(dir)) != 0) {
-        
-        sprintf(path2file, "%s/%s/%s", PATH2PDIR, OPDIR, entry->d_name);
-        int flag = lstat(path2file, &file_info);
-        
-        if(flag < 0) {
-            fclose(index_file);
-            fclose(big_file);
-            print_error("Error for stat %s\n", entry->d_name);
+    // 以 --writable 挂载的 sfcas 会一直持有大文件的锁，加锁之后才能改动归档
+    if(flock(lock_fd, LOCK_EX | LOCK_NB) < 0) {
+        close(lock_fd);
+        print_error("Data file %s is locked, unmount the writable sfcas first\n", path2bigFile);
+        return -1;
+    }
+    char path2compactFile[PATH_SIZE];
+    sprintf(path2compactFile, "%s/%s/%s", PATH2PDIR, OPDIR, INDEXFILE_COMPACT);
+    if(access(path2compactFile, F_OK) == 0) {
+        close(lock_fd);
+        print_error("Archive is being compacted, run sfcas-compact to finish it first\n");
+        return -1;
+    }
+    char path2blockFile[PATH_SIZE];
+    sprintf(path2blockFile, "%s/%s/%s", PATH2PDIR, OPDIR, BLOCKFILE);
+    if(append && access(path2blockFile, F_OK) == 0) {
+        close(lock_fd);
+        print_error("Compressed archive can not be appended, combine it again\n");
+        return -1;
+    }
+    // 追加时直接写大文件末尾，全量合并写临时文件，替换之前旧归档不变
+    int big_fd = lock_fd;
+    FILE *index_file = nullptr;
+    char path2bigTmp[PATH_SIZE], path2indexTmp[PATH_SIZE];
+    sprintf(path2bigTmp, "%s/%s/%s.tmp", PATH2PDIR, OPDIR, BIGFILE);
+    sprintf(path2indexTmp, "%s/%s/%s.tmp", PATH2PDIR, OPDIR, INDEXFILE);
+    if(!append) {
+        big_fd = open(path2bigTmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        // 替换完成之前新大文件上也要有锁，这时打开新大文件的 sfcas 也会加锁失败
+        if(big_fd < 0 || flock(big_fd, LOCK_EX | LOCK_NB) < 0) {
+            if(big_fd >= 0) close(big_fd);
+            close(lock_fd);
+            print_error("Error for data file %s\n", path2bigTmp);
             return -1;
         }
-        
-        // 跳过目录、索引文件和大文件
-        if(S_ISDIR(file_info.st_mode) 
-        || strcmp(entry->d_name, INDEXFILE) == 0 
-        || strcmp(entry->d_name, BIGFILE) == 0) continue;
-
-        // 插入索引文件
-        set_needle_index(&needle, &file_info, entry, ftell(big_file));
-        insert_needle_index(&needle, index_file);
-
-        // 插入数据文件
-        int cnt = 0;
-        FILE *small_file = fopen(path2file, "rb");
-        if(small_file == nullptr) {
-            fclose(index_file);
-            fclose(big_file);
-            print_error("Error on open %s\n", path2file);
+        index_file = fopen(path2indexTmp, "wb+");
+        if(index_file == nullptr) {
+            close(big_fd);
+            close(lock_fd);
+            unlink(path2bigTmp);
+            print_error("Error for index file %s\n", path2indexTmp);
             return -1;
         }
-        do {
-            int read_bytes = std::min(file_info.st_size - cnt, (long)BUFFER_SIZE);
-            fread(buf, 1, read_bytes, small_file);
-            fwrite(buf, 1, read_bytes, big_file);
-            cnt += read_bytes;
-        }
-        while(cnt < file_info.st_size);
-        fclose(small_file);
-        ++small_file_num;
-        
-        flag = remove(path2file);
-        if(flag < 0) {
-            fclose(index_file);
-            fclose(big_file);
-            print_error("Error on remove %s\n", path2file);
-            return 1;
+        fwrite(&small_file_num, sizeof(uint64_t), 1, index_file);
+    }
+    // 新文件从大文件末尾开始写入
+    uint64_t big_begin = lseek(big_fd, 0, SEEK_END);
+
+    auto start = std::chrono::steady_clock::now();
+    struct combine_list list;
+    struct block_index blocks;
+    uint64_t big_size = 0, compressed_size = 0;
+    size_t copied_n, skip_n = 0;
+    int res;
+    if(tar_path) {
+        // tar 中的文件直接按顺序写入大文件，不经过 OPDIR
+        if(level > 0) blocks.block_size = block_size;
+        struct stream_writer writer(big_fd, big_begin, level, thread_n, &blocks);
+        res = combine_tar(tar_fd, list, writer, dedup, checksum, skip_n);
+        if(tar_fd != STDIN_FILENO) close(tar_fd);
+        copied_n = list.entries.size();
+        big_size = writer.data_size;
+        compressed_size = writer.flushed;
+        blocks.data_size = big_size;
+        // 写入失败时不能引用大文件中的数据
+        if(res < 0 && writer.failed) copied_n = 0;
+        if(level == 0 && ftruncate(big_fd, big_begin + (copied_n ? big_size : 0)) < 0) copied_n = 0;
+        if(sorted) sort_by_name(list);
+    }
+    else {
+        // 1.按顺序收集小文件
+        res = collect_dir("", list);
+        // 名字相邻的文件在大文件中也相邻，载入时不用再排序
+        if(sorted) sort_by_name(list);
+
+        // 2.并行得到文件大小，再按顺序分配在大文件中的偏移
+        parallel_for(list.entries.size(), thread_n, [&list](size_t i) {
+            char path2file[PATH_SIZE];
+            struct stat file_info;
+            sprintf(path2file, "%s/%s/%s", PATH2PDIR, OPDIR, list.name(list.entries[i]));
+            list.entries[i].ok = lstat(path2file, &file_info) == 0;
+            if(list.entries[i].ok) list.entries[i].size = file_info.st_size;
+            else print_error("Error for stat %s\n", list.name(list.entries[i]));
+        });
+        size_t combine_n = ok_prefix(list, list.entries.size());
+        // 压缩时文件被切到多个块中，去重时重复的文件不再复制，CRC32C 都要先读一遍算好
+        // 否则在复制时顺便计算
+        bool crc_on_copy = checksum && !dedup && level == 0;
+        if(dedup || (checksum && !crc_on_copy)) {
+            parallel_for(combine_n, thread_n, [&list, dedup, checksum](size_t i) {
+                thread_local std::vector<char> buf(COPY_BUFFER_SIZE);
+                char path2file[PATH_SIZE];
+                struct combine_entry &entry = list.entries[i];
+                sprintf(path2file, "%s/%s/%s", PATH2PDIR, OPDIR, list.name(entry));
+                entry.ok = digest_file(path2file, entry.size, buf.data(), dedup ? &entry.hash : nullptr,
+                    checksum ? &entry.crc : nullptr) == 0;
+            });
+            combine_n = ok_prefix(list, combine_n);
+        }
+        // 重复的文件共用最先出现的那一份，最先出现的一定在它之前复制
+        std::unordered_map<struct content_key, size_t, content_key_hash> first_copy;
+        for(size_t i = 0; i < combine_n; ++i) {
+            struct combine_entry &entry = list.entries[i];
+            if(dedup) {
+                auto res = first_copy.emplace(content_key{entry.size, entry.hash}, i);
+                if(!res.second) {
+                    entry.offset = list.entries[res.first->second].offset;
+                    entry.dup = true;
+                    continue;
+                }
+            }
+            entry.offset = big_begin + big_size;
+            big_size += entry.size;
+        }
+        first_copy.clear();
+        // 压缩后的大小要压缩完才知道
+        if(level == 0 && ftruncate(big_fd, big_begin + big_size) < 0) {
+            print_error("Error on resize data file %s\n", path2bigFile);
+            combine_n = 0;
+        }
+
+        // 3.并行复制到各自的偏移处，压缩时按块并行读取和压缩
+        if(level > 0) {
+            blocks.block_size = block_size;
+            blocks.data_size = big_size;
+            compressed_size = compress_files(list, combine_n, big_fd, thread_n, level, blocks);
+            copied_n = ok_prefix(list, combine_n);
+            big_size = blocks.data_size;
+        }
+        else {
+            parallel_for(combine_n, thread_n, [&list, big_fd, crc_on_copy](size_t i) {
+                thread_local std::vector<char> buf(COPY_BUFFER_SIZE);
+                char path2file[PATH_SIZE];
+                struct combine_entry &entry = list.entries[i];
+                if(entry.dup) return;
+                sprintf(path2file, "%s/%s/%s", PATH2PDIR, OPDIR, list.name(entry));
+                entry.ok = copy_file(path2file, big_fd, entry.offset, entry.size, buf.data(),
+                    crc_on_copy ? &entry.crc : nullptr) == 0;
+            });
+            copied_n = ok_prefix(list, combine_n);
+            if(copied_n < combine_n) {
+                big_size = list.entries[copied_n].offset - big_begin;
+                ftruncate(big_fd, big_begin + big_size);
+            }
         }
     }
+    if(copied_n < list.entries.size()) res = -1;
 
-    // 将小文件数量记录在索引文件中
-    fseek(index_file, 0, SEEK_SET);
-    fwrite(&small_file_num, sizeof(uint64_t), 1, index_file);
+    // 4.按顺序写索引文件
+    // 出错时也记录已经合并的小文件
+    struct needle_index needle;
+    struct stat file_info;
+    small_file_num = copied_n;
+    if(append) {
+        // 数据落盘后再写索引，中途失败时大文件末尾多出的数据不会被引用
+        std::vector<struct needle_index> needles(copied_n);
+        for(size_t i = 0; i < copied_n; ++i) {
+            file_info.st_size = list.entries[i].size;
+            set_needle_index(&needles[i], &file_info, list.name(list.entries[i]), list.entries[i].offset);
+            if(checksum) set_needle_crc(&needles[i], list.entries[i].crc);
+        }
+        if(fsync(big_fd) < 0 || write_delta(needles) < 0) {
+            // 索引没有更新，小文件保留，下次重新追加
+            close(big_fd);
+            return -1;
+        }
+    }
+    else {
+        for(size_t i = 0; i < copied_n; ++i) {
+            file_info.st_size = list.entries[i].size;
+            set_needle_index(&needle, &file_info, list.name(list.entries[i]), list.entries[i].offset);
+            if(checksum) set_needle_crc(&needle, list.entries[i].crc);
+            insert_needle_index(&needle, index_file);
+        }
+        fseek(index_file, 0, SEEK_SET);
+        fwrite(&small_file_num, sizeof(uint64_t), 1, index_file);
+        // 新的大文件和索引文件都落盘后再替换
+        bool ok = fsync(big_fd) == 0 && fflush(index_file) == 0 && fsync(fileno(index_file)) == 0;
+        ok = fclose(index_file) == 0 && ok;
+        if(!ok || replace_archive(path2bigTmp, path2indexTmp, level > 0 ? &blocks : nullptr) < 0) {
+            // 小文件保留，下次重新合并
+            print_error("Error on replace archive %s\n", path2bigFile);
+            unlink(path2bigTmp);
+            unlink(path2indexTmp);
+            close(big_fd);
+            close(lock_fd);
+            return -1;
+        }
+    }
     COUT_THIS("Small file num: " << small_file_num);
+    if(tar_path) COUT_THIS("Tar entries skipped: " << skip_n);
+    if(checksum) COUT_THIS("Checksum: CRC32C with " << simd_kernels().name << " kernel");
+    if(level > 0) {
+        COUT_THIS("Compressed " << blocks.blocks.size() << " blocks of " << (block_size >> 10) << "KB: "
+            << big_size << " -> " << compressed_size << " bytes, ratio "
+            << (compressed_size ? (double)big_size / compressed_size : 1.0));
+    }
+    if(dedup) {
+        size_t dup_n = 0;
+        uint64_t dup_size = 0;
+        for(size_t i = 0; i < copied_n; ++i) {
+            if(!list.entries[i].dup) continue;
+            ++dup_n;
+            dup_size += list.entries[i].size;
+        }
+        // 去重比例为所有文件的总大小和实际写入大文件的大小之比
+        COUT_THIS("Dedup: " << dup_n << " duplicate files, " << dup_size << " bytes saved, ratio "
+            << (big_size ? (double)(big_size + dup_size) / big_size : 1.0));
+    }
+    close(big_fd);
+    if(!append) close(lock_fd);
 
-    closedir(dir);
-    
-    fclose(index_file);
-    fclose(big_file);
-    return 0;
-}
\ No newline at end of file
+    // 5.删除已经合并的小文件，再删除空目录，tar 中的文件没有在 OPDIR 中创建
+    std::atomic<int> remove_res(0);
+    if(!tar_path) parallel_for(copied_n, thread_n, [&list, &remove_res](size_t i) {
+        char path2file[PATH_SIZE];
+        sprintf(path2file, "%s/%s/%s", PATH2PDIR, OPDIR, list.name(list.entries[i]));
+        if(remove(path2file) < 0) {
+            print_error("Error on remove %s\n", path2file);
+            remove_res.store(-1);
+        }
+    });
+    if(remove_res.load() < 0) res = -1;
+    for(const std::string &rel_dir : list.dirs) {
+        std::string path2dir = std::string(PATH2PDIR) + "/" + OPDIR + "/" + rel_dir;
+        rmdir(path2dir.c_str());
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    COUT_THIS("Combine time: " << seconds * 1000 << "ms, threads: " << thread_n
+        << ", " << small_file_num / seconds << " files/s, "
+        << big_size / seconds / (1 << 20) << " MB/s");
+    return res;
+}
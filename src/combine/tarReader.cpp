@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helper.h"
+#include "tar.h"
+
+// tar 中的头和数据都按 512 字节对齐
+#define TAR_BLOCK_SIZE 512
+// 每次从输入中读取的数据量
+#define TAR_BUFFER_SIZE (4 << 20)
+// 长文件名和 pax 扩展头的上限，超过时认为 tar 流已经损坏
+#define TAR_EXTENDED_MAX (1 << 20)
+
+// ustar 头中各字段的位置和长度
+#define TAR_NAME 0, 100
+#define TAR_SIZE 124, 12
+#define TAR_CHKSUM 148, 8
+#define TAR_TYPEFLAG 156
+#define TAR_LINKNAME 157, 100
+#define TAR_MAGIC 257
+#define TAR_PREFIX 345, 155
+
+static std::string field_string(const char *header, size_t offset, size_t len) {
+    return std::string(header + offset, strnlen(header + offset, len));
+}
+
+// 八进制数字，以空格或 '\0' 结束；最高位为 1 时是 GNU 的 base-256 编码
+static bool field_number(const char *header, size_t offset, size_t len, uint64_t &value) {
+    const unsigned char *field = (const unsigned char *)header + offset;
+    value = 0;
+    if(field[0] & 0x80) {
+        value = field[0] & 0x7F;
+        for(size_t i = 1; i < len; ++i) value = (value << 8) | field[i];
+        return true;
+    }
+    size_t i = 0;
+    while(i < len && field[i] == ' ') ++i;
+    for(; i < len && field[i] >= '0' && field[i] <= '7'; ++i) value = (value << 3) | (field[i] - '0');
+    return i == len || field[i] == ' ' || field[i] == '\0';
+}
+
+// 校验和按 chksum 字段全为空格计算，老的实现按有符号字节计算
+static bool check_header(const char *header) {
+    uint64_t expected;
+    if(!field_number(header, TAR_CHKSUM, expected)) return false;
+    uint64_t unsigned_sum = 0;
+    int64_t signed_sum = 0;
+    for(size_t i = 0; i < TAR_BLOCK_SIZE; ++i) {
+        bool in_chksum = i >= 148 && i < 156;
+        unsigned_sum += in_chksum ? ' ' : (unsigned char)header[i];
+        signed_sum += in_chksum ? ' ' : (signed char)header[i];
+    }
+    return unsigned_sum == expected || (uint64_t)signed_sum == expected;
+}
+
+// pax 扩展头中这一项用到的字段
+struct pax_header {
+    std::string path, link;
+    uint64_t size = 0;
+    bool has_path = false, has_link = false, has_size = false;
+};
+
+// pax 扩展头由 "长度 key=value\n" 的记录组成，只关心 path、linkpath 和 size
+// 成功返回 0，格式错误返回 -1
+static int parse_pax(const std::string &data, struct pax_header &pax) {
+    size_t pos = 0;
+    while(pos < data.size()) {
+        size_t len = 0, i = pos;
+        while(i < data.size() && data[i] >= '0' && data[i] <= '9') len = len * 10 + (data[i++] - '0');
+        if(i == pos || i >= data.size() || data[i] != ' ' || len <= i - pos || pos + len > data.size()
+        || data[pos + len - 1] != '\n') return -1;
+        size_t eq = data.find('=', i + 1);
+        if(eq == std::string::npos || eq >= pos + len) return -1;
+        std::string key = data.substr(i + 1, eq - i - 1), value = data.substr(eq + 1, pos + len - 1 - (eq + 1));
+        if(key == "path") {
+            pax.path = value;
+            pax.has_path = true;
+        }
+        else if(key == "linkpath") {
+            pax.link = value;
+            pax.has_link = true;
+        }
+        else if(key == "size") {
+            char *end = nullptr;
+            pax.size = strtoull(value.c_str(), &end, 10);
+            if(value.empty() || *end != '\0') return -1;
+            pax.has_size = true;
+        }
+        pos += len;
+    }
+    return 0;
+}
+
+// 去掉开头的 "./" 和 '/'，文件名中的路径都是相对合并目录的
+static std::string clean_name(const std::string &name) {
+    size_t begin = 0;
+    while(true) {
+        if(name.compare(begin, 2, "./") == 0) begin += 2;
+        else if(begin < name.size() && name[begin] == '/') ++begin;
+        else break;
+    }
+    return name.substr(begin);
+}
+
+TarReader::TarReader(int fd) : fd(fd), buf(TAR_BUFFER_SIZE) {}
+
+int TarReader::fill(size_t n) {
+    if(buf_end - buf_begin >= n) return 0;
+    memmove(buf.data(), buf.data() + buf_begin, buf_end - buf_begin);
+    buf_end -= buf_begin;
+    buf_begin = 0;
+    while(buf_end < n) {
+        ssize_t read_bytes = ::read(fd, buf.data() + buf_end, buf.size() - buf_end);
+        if(read_bytes < 0 && errno == EINTR) continue;
+        if(read_bytes < 0) print_error("Error on read tar stream\n");
+        if(read_bytes <= 0) return -1;
+        buf_end += read_bytes;
+    }
+    return 0;
+}
+
+ssize_t TarReader::read(const char **data) {
+    if(remain == 0) return 0;
+    if(fill(1) < 0) {
+        print_error("Unexpected end of tar stream\n");
+        return -1;
+    }
+    size_t n = std::min<uint64_t>(remain, buf_end - buf_begin);
+    *data = buf.data() + buf_begin;
+    buf_begin += n;
+    remain -= n;
+    return n;
+}
+
+int TarReader::skip_data() {
+    uint64_t skip = remain + padding;
+    remain = padding = 0;
+    while(skip > 0) {
+        if(fill(1) < 0) {
+            print_error("Unexpected end of tar stream\n");
+            return -1;
+        }
+        size_t n = std::min<uint64_t>(skip, buf_end - buf_begin);
+        buf_begin += n;
+        skip -= n;
+    }
+    return 0;
+}
+
+int TarReader::read_data(uint64_t size, std::string &data) {
+    if(size > TAR_EXTENDED_MAX) {
+        print_error("Extended tar header of %lu bytes is too large\n", size);
+        return -1;
+    }
+    data.clear();
+    const char *piece;
+    ssize_t n;
+    while((n = read(&piece)) > 0) data.append(piece, n);
+    return n < 0 ? -1 : skip_data();
+}
+
+int TarReader::next(std::string &name, uint64_t &size, std::string &link) {
+    // 前面的 'L'、'K' 和 'x' 项修改的是紧跟着的这一项，GNU 的长文件名记在 pax 的字段中
+    struct pax_header pax;
+    if(skip_data() < 0) return -1;
+    while(true) {
+        if(fill(TAR_BLOCK_SIZE) < 0) {
+            // 有的程序不写结尾的全 0 块
+            if(buf_end == buf_begin && !pax.has_path && !pax.has_link && !pax.has_size) return 0;
+            print_error("Unexpected end of tar stream\n");
+            return -1;
+        }
+        const char *header = buf.data() + buf_begin;
+        if(std::all_of(header, header + TAR_BLOCK_SIZE, [](char c) { return c == '\0'; })) {
+            // 读完剩下的补齐数据，管道另一端的 tar 不会因为写不进去而报错
+            buf_begin = buf_end;
+            while(fill(1) == 0) buf_begin = buf_end;
+            return 0;
+        }
+        if(!check_header(header) || !field_number(header, TAR_SIZE, size)) {
+            print_error("Bad tar header\n");
+            return -1;
+        }
+        char type = header[TAR_TYPEFLAG];
+        if(pax.has_path) name = pax.path;
+        else {
+            name = field_string(header, TAR_NAME);
+            // POSIX ustar 中过长的路径拆成 prefix 和 name，GNU 格式的这个位置是别的字段
+            std::string prefix = memcmp(header + TAR_MAGIC, "ustar\0", 6) == 0 ? field_string(header, TAR_PREFIX) : "";
+            if(!prefix.empty()) name = prefix + "/" + name;
+        }
+        link = pax.has_link ? pax.link : field_string(header, TAR_LINKNAME);
+        buf_begin += TAR_BLOCK_SIZE;
+        remain = size;
+        padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+        if(type == 'L' || type == 'K') {
+            std::string &long_name = type == 'L' ? pax.path : pax.link;
+            if(read_data(size, long_name) < 0) return -1;
+            // GNU tar 写入的长文件名以 '\0' 结尾
+            long_name.resize(strnlen(long_name.c_str(), long_name.size()));
+            (type == 'L' ? pax.has_path : pax.has_link) = true;
+            continue;
+        }
+        if(type == 'x') {
+            std::string extended;
+            if(read_data(size, extended) < 0) return -1;
+            if(parse_pax(extended, pax) < 0) {
+                print_error("Bad pax extended header\n");
+                return -1;
+            }
+            continue;
+        }
+        // 超过 8GB 的文件在 ustar 头中放不下，以 pax 中的 size 为准
+        if(pax.has_size) {
+            size = remain = pax.size;
+            padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        }
+        if(type == '0' || type == '\0' || type == '7' || type == '1') {
+            name = clean_name(name);
+            if(type == '1') {
+                link = clean_name(link);
+                size = 0;
+            }
+            else link.clear();
+            return 1;
+        }
+        // 目录不用单独记录，'g' 只影响之后的项
+        if(type != '5' && type != 'g') ++skip_n;
+        if(skip_data() < 0) return -1;
+        pax = pax_header();
+    }
+}
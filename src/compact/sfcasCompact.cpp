@@ -0,0 +1,263 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "constant.h"
+#include "helper.h"
+#include "index.h"
+
+// 回收大文件中已删除和被覆盖的文件占用的空间
+// 用法：sfcas-compact [--rate=MB/s]
+// --rate 限制每秒复制的数据量，默认不限制
+// 仍然存在的文件按在旧大文件中的顺序复制到 bigfile.compact，偏移和大小都相同的 needle 共用一份数据，
+// 写好 indexfile.compact 之后依次替换 bigfile、删除 delta 索引、替换 indexfile，
+// indexfile.compact 存在时说明替换还没完成，再次运行会接着完成，sfcas 和 combineFile 此时不会载入归档
+// 只读挂载的 sfcas 继续读旧的大文件，完成后发送 SIGUSR1 切换到新归档
+
+// 每次复制的数据量，限速时在两次复制之间等待
+#define COMPACT_CHUNK_SIZE (1 << 20)
+// 每写这么多数据落盘一次并丢掉新大文件的页缓存，不挤占读者的缓存
+#define COMPACT_SYNC_SIZE (64 << 20)
+
+static bool copy_range_supported = true;
+
+struct compact_path {
+    char index[PATH_SIZE], big[PATH_SIZE], delta[PATH_SIZE];
+    char index_compact[PATH_SIZE], index_tmp[PATH_SIZE], big_compact[PATH_SIZE], dir[PATH_SIZE];
+
+    compact_path() {
+        sprintf(index, "%s/%s/%s", PATH2PDIR, OPDIR, INDEXFILE);
+        sprintf(big, "%s/%s/%s", PATH2PDIR, OPDIR, BIGFILE);
+        sprintf(delta, "%s/%s/%s", PATH2PDIR, OPDIR, DELTAFILE);
+        sprintf(index_compact, "%s/%s/%s", PATH2PDIR, OPDIR, INDEXFILE_COMPACT);
+        sprintf(index_tmp, "%s/%s/%s.tmp", PATH2PDIR, OPDIR, INDEXFILE_COMPACT);
+        sprintf(big_compact, "%s/%s/%s", PATH2PDIR, OPDIR, BIGFILE_COMPACT);
+        sprintf(dir, "%s/%s", PATH2PDIR, OPDIR);
+    }
+};
+
+// 按 rate 字节每秒限速复制，rate 为 0 时不限速
+struct copy_throttle {
+    double rate;
+    uint64_t copied = 0, synced = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    void wait(uint64_t size) {
+        copied += size;
+        if(rate <= 0) return;
+        auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(copied / rate));
+        std::this_thread::sleep_until(due);
+    }
+};
+
+static int sync_dir(const char *path2dir) {
+    int dir_fd = open(path2dir, O_RDONLY | O_DIRECTORY);
+    if(dir_fd < 0) return -1;
+    int res = fsync(dir_fd);
+    close(dir_fd);
+    return res;
+}
+
+// 新大文件落盘后丢掉它的页缓存
+static int sync_written(int big_fd, struct copy_throttle &throttle) {
+    if(fdatasync(big_fd) < 0) return -1;
+    posix_fadvise(big_fd, throttle.synced, throttle.copied - throttle.synced, POSIX_FADV_DONTNEED);
+    throttle.synced = throttle.copied;
+    return 0;
+}
+
+// 把旧大文件 [src_offset, src_offset + size) 复制到新大文件的 dst_offset 处
+// 成功返回 0，失败返回 -1
+static int copy_extent(int src_fd, int dst_fd, uint64_t src_offset, uint64_t dst_offset, uint64_t size,
+                       struct copy_throttle &throttle, std::vector<char> &buf) {
+    while(size > 0) {
+        uint64_t chunk = std::min<uint64_t>(size, COMPACT_CHUNK_SIZE);
+        uint64_t done = 0;
+        loff_t in_off = src_offset, out_off = dst_offset;
+        while(copy_range_supported && done < chunk) {
+            ssize_t copied = copy_file_range(src_fd, &in_off, dst_fd, &out_off, chunk - done, 0);
+            if(copied > 0) {
+                done += copied;
+                continue;
+            }
+            if(copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                copy_range_supported = false;
+                break;
+            }
+            return -1;
+        }
+        while(done < chunk) {
+            ssize_t read_bytes = pread(src_fd, buf.data(), chunk - done, src_offset + done);
+            if(read_bytes <= 0 || pwrite(dst_fd, buf.data(), read_bytes, dst_offset + done) != read_bytes) return -1;
+            done += read_bytes;
+        }
+        src_offset += chunk;
+        dst_offset += chunk;
+        size -= chunk;
+        throttle.wait(chunk);
+        if(throttle.copied - throttle.synced >= COMPACT_SYNC_SIZE && sync_written(dst_fd, throttle) < 0) return -1;
+    }
+    return 0;
+}
+
+// 按 indexs 的顺序写出索引文件，落盘后再 rename 到 path
+// 成功返回 0，失败返回 -1
+static int write_index(const std::vector<struct needle_index> &indexs, const char *tmp_path, const char *path) {
+    FILE *index_file = fopen(tmp_path, "wb");
+    if(index_file == nullptr) return -1;
+    uint64_t small_file_num = indexs.size();
+    fwrite(&small_file_num, sizeof(uint64_t), 1, index_file);
+    for(const struct needle_index &needle : indexs) insert_needle_index(&needle, index_file);
+    bool ok = fflush(index_file) == 0 && fsync(fileno(index_file)) == 0;
+    ok = fclose(index_file) == 0 && ok;
+    if(!ok || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// indexfile.compact 写好之后的步骤，每一步都可以重复执行
+// 成功返回 0，失败返回 -1
+static int finish_compact(const struct compact_path &path) {
+    if(access(path.big_compact, F_OK) == 0 && rename(path.big_compact, path.big) < 0) return -1;
+    if(unlink(path.delta) < 0 && errno != ENOENT) return -1;
+    if(rename(path.index_compact, path.index) < 0) return -1;
+    return sync_dir(path.dir);
+}
+
+int main(int argc, char *argv[]) {
+    double rate = 0;
+    char *rate_end = nullptr;
+    for(int arg_i = 1; arg_i < argc; ++arg_i) {
+        if(strncmp(argv[arg_i], "--rate=", 7) == 0 && (rate = strtod(argv[arg_i] + 7, &rate_end)) >= 0
+        && *rate_end == '\0') rate *= 1 << 20;
+        else {
+            print_error("Usage: %s [--rate=MB/s]\n", argv[0]);
+            return 1;
+        }
+    }
+    struct compact_path path;
+
+    // 和 combineFile、以 --writable 挂载的 sfcas 互斥
+    int lock_fd = open(path.big, O_RDONLY);
+    if(lock_fd < 0) {
+        print_error("Error for data file %s\n", path.big);
+        return 1;
+    }
+    if(flock(lock_fd, LOCK_EX | LOCK_NB) < 0) {
+        close(lock_fd);
+        print_error("Data file %s is locked, unmount the writable sfcas first\n", path.big);
+        return 1;
+    }
+    if(access(path.index_compact, F_OK) == 0) {
+        int res = finish_compact(path);
+        if(res < 0) print_error("Error on finish interrupted compaction\n");
+        else COUT_THIS("Finish interrupted compaction");
+        close(lock_fd);
+        return res < 0 ? 1 : 0;
+    }
+    // 上次没写完的临时文件
+    unlink(path.big_compact);
+    unlink(path.index_tmp);
+
+    auto start = std::chrono::steady_clock::now();
+    struct needle_index_list index_list, delta_list;
+    if(init(&index_list) < 0 || init_delta(&delta_list) < 0) {
+        close(lock_fd);
+        print_error("Error on load index\n");
+        return 1;
+    }
+    // 压缩归档不能追加和写入，没有可以回收的空间
+    if(index_list.blocks.block_size) {
+        release_needle(&index_list);
+        close(lock_fd);
+        print_error("Compressed archive has nothing to compact\n");
+        return 1;
+    }
+    uint64_t old_size = lseek(fileno(index_list.data_file), 0, SEEK_END);
+    size_t needle_n = index_list.indexs.size() + delta_list.indexs.size();
+    std::vector<struct needle_index> live;
+    merge_delta_index(index_list.indexs, delta_list.indexs, live);
+    live.erase(std::remove_if(live.begin(), live.end(),
+        [](const struct needle_index &needle) { return !(needle.flags & FILE_EXIT); }), live.end());
+
+    // 按旧偏移复制，连续的文件一次复制，落在已复制范围内的 needle 直接换算偏移
+    std::vector<size_t> order(live.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&live](size_t a, size_t b) {
+        return live[a].offset < live[b].offset
+            || (live[a].offset == live[b].offset && live[a].size > live[b].size);
+    });
+    int big_fd = open(path.big_compact, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    // 替换完成之前新大文件上也要有锁，这时打开新大文件的 sfcas 和 combineFile 也会加锁失败
+    if(big_fd < 0 || flock(big_fd, LOCK_EX | LOCK_NB) < 0) {
+        if(big_fd >= 0) close(big_fd);
+        release_needle(&index_list);
+        close(lock_fd);
+        print_error("Error for data file %s\n", path.big_compact);
+        return 1;
+    }
+    struct copy_throttle throttle;
+    throttle.rate = rate;
+    std::vector<char> buf(COMPACT_CHUNK_SIZE);
+    int src_fd = fileno(index_list.data_file);
+    uint64_t run_src = 0, run_end = 0, run_dst = 0, new_size = 0;
+    bool ok = true;
+    for(size_t order_i = 0; ok && order_i <= order.size(); ++order_i) {
+        struct needle_index *needle = order_i < order.size() ? &live[order[order_i]] : nullptr;
+        if(needle && needle->offset >= run_src && needle->offset + needle->size <= run_end) {
+            needle->offset = run_dst + (needle->offset - run_src);
+            continue;
+        }
+        if(needle && needle->offset == run_end && run_end > run_src) {
+            run_end += needle->size;
+            needle->offset = run_dst + (needle->offset - run_src);
+            continue;
+        }
+        ok = copy_extent(src_fd, big_fd, run_src, run_dst, run_end - run_src, throttle, buf) == 0;
+        new_size = run_dst + (run_end - run_src);
+        if(needle) {
+            run_src = needle->offset;
+            run_end = needle->offset + needle->size;
+            run_dst = new_size;
+            needle->offset = run_dst;
+        }
+    }
+    // 替换之前新大文件和索引都要落盘
+    ok = ok && sync_written(big_fd, throttle) == 0;
+    if(ok && write_index(live, path.index_tmp, path.index_compact) < 0) {
+        print_error("Error on write index file %s\n", path.index_compact);
+        ok = false;
+    }
+    release_needle(&index_list);
+    if(!ok) {
+        unlink(path.big_compact);
+        close(big_fd);
+        close(lock_fd);
+        print_error("Error on copy data file, archive unchanged\n");
+        return 1;
+    }
+    if(finish_compact(path) < 0) {
+        close(big_fd);
+        close(lock_fd);
+        print_error("Error on replace archive, run %s again to finish\n", argv[0]);
+        return 1;
+    }
+    close(big_fd);
+    close(lock_fd);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    COUT_THIS("Live files: " << live.size() << ", dropped needles: " << needle_n - live.size()
+        << ", data file " << old_size << " -> " << new_size << " bytes, reclaimed " << old_size - new_size
+        << " bytes");
+    COUT_THIS("Compact time: " << seconds * 1000 << "ms, " << new_size / seconds / (1 << 20) << " MB/s");
+    return 0;
+}
@@ -89,34 +89,38 @@ public:
 
     void upload_metadata() {
         // client 准备
-        StartUpMsg msg;
-        msg.set_address(IP + ":" + PORT);
-        msg.set_gid(GID);
         ClientContext context;
         Empty empty_reply;
         unique_ptr<ClientWriter<StartUpMsg>> writer(
             stub_->upload_metadata(&context, &empty_reply));
         
-        // 读取 index 文件获得当前所有的文件并发送
+        // 读取 index 文件和追加合并的 delta 索引获得当前所有的文件并发送
+        // 同名文件以 delta 中最后写入的为准，delta 中删除的文件不发送
         char path[1024];
+        vector<needle_index> delta;
+        sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, DELTAFILE);
+        read_index_file(path, delta);
+        unordered_map<string, const needle_index *> delta_map;
+        for(const needle_index &needle : delta) delta_map[needle.filename.get_name()] = &needle;
+
+        vector<needle_index> indexs;
         sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, INDEXFILE);
-        FILE *index_file = fopen(path, "rb");
-        if(index_file == nullptr) {
+        if(!read_index_file(path, indexs)) {
             print_error("Error on open index file %s\n", path);
             exit(1);
         }
         uint64_t index_num = 0;
-        needle_index needle;
-        fread(&index_num, sizeof(uint64_t), 1, index_file);
-        for(size_t needle_i = 0; needle_i < index_num; ++needle_i) {
-            read_needle_index(&needle, index_file);
-            msg.set_filename(needle.filename.get_name());
-            msg.set_file_size(needle.size);
-            if(!writer->Write(msg)) {
-                break;
-            }
+        bool ok = true;
+        for(size_t needle_i = 0; ok && needle_i < indexs.size(); ++needle_i) {
+            if(delta_map.count(indexs[needle_i].filename.get_name())) continue;
+            ok = upload_needle(indexs[needle_i], writer.get());
+            index_num += ok;
+        }
+        for(auto it = delta_map.begin(); ok && it != delta_map.end(); ++it) {
+            if(!(it->second->flags & FILE_EXIT)) continue;
+            ok = upload_needle(*it->second, writer.get());
+            index_num += ok;
         }
-        fclose(index_file);
         writer->WritesDone();
         Status status = writer->Finish();
         if(status.ok()) {
@@ -128,6 +132,29 @@ public:
     }
 
 private:
+    // 读入索引文件中的所有 needle，文件不存在时返回 false
+    bool read_index_file(const char *path, vector<needle_index> &needles) {
+        FILE *index_file = fopen(path, "rb");
+        if(index_file == nullptr) return false;
+        uint64_t index_num = 0;
+        fread(&index_num, sizeof(uint64_t), 1, index_file);
+        needles.resize(index_num);
+        for(size_t needle_i = 0; needle_i < index_num; ++needle_i) {
+            read_needle_index(&needles[needle_i], index_file);
+        }
+        fclose(index_file);
+        return true;
+    }
+
+    bool upload_needle(const needle_index &needle, ClientWriter<StartUpMsg> *writer) {
+        StartUpMsg msg;
+        msg.set_address(IP + ":" + PORT);
+        msg.set_gid(GID);
+        msg.set_filename(needle.filename.get_name());
+        msg.set_file_size(needle.size);
+        return writer->Write(msg);
+    }
+
     unique_ptr<FileAccess::Stub> stub_;
 };
 
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <numeric>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "constant.h"
+#include "helper.h"
+#include "index.h"
+#include "simd.h"
+
+// 检查归档中每个仍然存在的文件能否完整读出，以及内容和 needle 中记录的 CRC32C 是否相同
+// 用法：sfcas-fsck [--threads=N]
+// --threads=N 默认使用所有 CPU
+// 文件按在大文件中的偏移排序后分给各个线程，每个线程读的是一段连续的数据
+// 没有记录 CRC32C 的文件（合并时没有加 --checksum）只检查能否读出
+// 有文件损坏或读不出时返回 1，运行期间不要用 combineFile 或 sfcas-compact 改动归档
+
+// 每个线程一次领取的文件数
+#define FSCK_CHUNK_SIZE 64
+// 压缩归档解压后的块的缓存大小
+#define FSCK_CACHE_SIZE (64 << 20)
+
+struct fsck_stat {
+    std::atomic<size_t> ok{0}, unchecked{0}, corrupt{0}, unreadable{0};
+    std::atomic<uint64_t> bytes{0};
+};
+
+// 用 thread_n 个线程对 [0, n) 中的每个下标调用 fn，每次领取 FSCK_CHUNK_SIZE 个
+template <class F>
+static void parallel_for(size_t n, size_t thread_n, F fn) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t begin;
+        while((begin = next.fetch_add(FSCK_CHUNK_SIZE)) < n) {
+            size_t end = std::min(n, begin + FSCK_CHUNK_SIZE);
+            for(size_t i = begin; i < end; ++i) fn(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for(size_t thread_i = 1; thread_i < thread_n; ++thread_i) threads.emplace_back(worker);
+    worker();
+    for(auto &thread : threads) thread.join();
+}
+
+// 读出 needle 的全部内容
+// 成功返回 0，失败返回 -1
+static int read_needle(const struct needle_index_list &index_list, BlockCache *cache, uint64_t data_size,
+                       const struct needle_index &needle, std::vector<char> &buf) {
+    if(needle.offset > data_size || needle.size > data_size - needle.offset) return -1;
+    buf.resize(needle.size);
+    if(cache) return read_blocks(&index_list, cache, buf.data(), needle.size, needle.offset) == needle.size ? 0 : -1;
+    int data_fd = fileno(index_list.data_file);
+    uint64_t done = 0;
+    while(done < needle.size) {
+        ssize_t read_bytes = pread(data_fd, buf.data() + done, needle.size - done, needle.offset + done);
+        if(read_bytes <= 0) return -1;
+        done += read_bytes;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t thread_n = std::thread::hardware_concurrency();
+    for(int arg_i = 1; arg_i < argc; ++arg_i) {
+        if(strncmp(argv[arg_i], "--threads=", 10) == 0) thread_n = strtoul(argv[arg_i] + 10, nullptr, 10);
+        else {
+            print_error("Usage: %s [--threads=N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(thread_n == 0) thread_n = 1;
+
+    auto start = std::chrono::steady_clock::now();
+    struct needle_index_list index_list, delta_list;
+    if(init(&index_list) < 0 || init_delta(&delta_list) < 0) {
+        print_error("Error on load index\n");
+        return 1;
+    }
+    std::vector<struct needle_index> live;
+    merge_delta_index(index_list.indexs, delta_list.indexs, live);
+    live.erase(std::remove_if(live.begin(), live.end(),
+        [](const struct needle_index &needle) { return !(needle.flags & FILE_EXIT); }), live.end());
+
+    // 按偏移顺序读，相邻的文件在同一个线程中
+    std::vector<size_t> order(live.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&live](size_t a, size_t b) { return live[a].offset < live[b].offset; });
+
+    int data_fd = fileno(index_list.data_file);
+    std::unique_ptr<BlockCache> cache;
+    uint64_t data_size = index_list.blocks.data_size;
+    if(index_list.blocks.block_size) cache.reset(new BlockCache(FSCK_CACHE_SIZE));
+    else data_size = lseek(data_fd, 0, SEEK_END);
+    posix_fadvise(data_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct fsck_stat stat;
+    parallel_for(order.size(), thread_n, [&](size_t i) {
+        thread_local std::vector<char> buf;
+        const struct needle_index &needle = live[order[i]];
+        if(read_needle(index_list, cache.get(), data_size, needle, buf) < 0) {
+            print_error("Unreadable: %s (offset %lu, size %u)\n", needle.filename.get_name(), needle.offset,
+                needle.size);
+            ++stat.unreadable;
+            return;
+        }
+        stat.bytes += needle.size;
+        if(!(needle.flags & FILE_CRC)) {
+            ++stat.unchecked;
+            return;
+        }
+        if(simd_kernels().crc32c(0, buf.data(), buf.size()) != needle.crc) {
+            print_error("Corrupt: %s (offset %lu, size %u)\n", needle.filename.get_name(), needle.offset,
+                needle.size);
+            ++stat.corrupt;
+            return;
+        }
+        ++stat.ok;
+    });
+    release_needle(&index_list);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    COUT_THIS("Checked " << live.size() << " files, " << stat.bytes.load() << " bytes: ok " << stat.ok.load()
+        << ", no checksum " << stat.unchecked.load() << ", corrupt " << stat.corrupt.load()
+        << ", unreadable " << stat.unreadable.load());
+    COUT_THIS("Fsck time: " << seconds * 1000 << "ms, threads: " << thread_n << ", CRC32C kernel: "
+        << simd_kernels().name << ", " << stat.bytes.load() / seconds / (1 << 20) << " MB/s");
+    return stat.corrupt.load() || stat.unreadable.load() ? 1 : 0;
+}
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <numeric>
+#include <unistd.h>
+
+#include "constant.h"
+#include "helper.h"
+#include "index.h"
+#include "sindex.h"
+
+// 载入合并后的索引文件和 delta 索引并建立 SIndex，以 JSON 输出 root 模型、各组的误差和内存分布
+// 用法：sfcas-inspect [--top=N] [--sindex-config=path]
+// --top=N 只输出误差窗口最大的 N 个组，默认输出全部
+using namespace sindex;
+
+static void print_json_string(const char *s) {
+    putchar('"');
+    for(; *s; ++s) {
+        unsigned char c = *s;
+        if(c == '"' || c == '\\') printf("\\%c", c);
+        else if(c < 0x20) printf("\\u%04x", c);
+        else putchar(c);
+    }
+    putchar('"');
+}
+
+static void print_histogram(const uint64_t *histogram) {
+    printf("[");
+    for(size_t bucket_i = 0; bucket_i < error_bucket_n; ++bucket_i) {
+        printf("%s%lu", bucket_i ? ", " : "", histogram[bucket_i]);
+    }
+    printf("]");
+}
+
+static void print_group(const sindex_t &sindex_model, size_t group_i, const group_stats_t &stats) {
+    printf("    {\"id\": %lu, \"pivot\": ", group_i);
+    print_json_string(sindex_model.group_pivot(group_i).c_str());
+    printf(", \"start\": %lu, \"size\": %lu, \"prefix_len\": %lu, \"feature_len\": %lu, "
+        "\"max_pos_error\": %ld, \"max_neg_error\": %ld, \"error_histogram\": ",
+        stats.start, stats.size, stats.prefix_len, stats.feature_len,
+        stats.max_pos_error, stats.max_neg_error);
+    print_histogram(stats.error_histogram);
+    printf("}");
+}
+
+// 和 sfcas 一样先读 ini，命令行指定的文件必须存在
+static int load_config(const char *path) {
+    index_config_t new_config = config;
+    if(path == nullptr) {
+        if(access(SINDEX_CONFIG_FILE, R_OK) != 0) return 0;
+        path = SINDEX_CONFIG_FILE;
+    }
+    if(!read_config_ini(path, new_config) || !set_index_config(new_config)) return -1;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t top_n = 0;
+    const char *config_path = nullptr;
+    for(int arg_i = 1; arg_i < argc; ++arg_i) {
+        if(strncmp(argv[arg_i], "--top=", 6) == 0) top_n = strtoul(argv[arg_i] + 6, nullptr, 10);
+        else if(strncmp(argv[arg_i], "--sindex-config=", 16) == 0) config_path = argv[arg_i] + 16;
+        else {
+            print_error("Usage: %s [--top=N] [--sindex-config=path]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(load_config(config_path) < 0) {
+        print_error("Error on load sindex config\n");
+        return 1;
+    }
+
+    // 载入和训练过程中的输出转到 stderr，stdout 只有 JSON
+    std::streambuf *cout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+    struct needle_index_list index_list, delta_list;
+    if(init(&index_list) < 0 || init_delta(&delta_list) < 0) {
+        std::cout.rdbuf(cout_buf);
+        print_error("Error on load index\n");
+        return 1;
+    }
+    // 和 sfcas 载入时一样合并 delta 索引，删除的文件不参与训练
+    if(delta_list.index_num) {
+        std::vector<struct needle_index> merged;
+        merge_delta_index(index_list.indexs, delta_list.indexs, merged);
+        index_list.indexs.swap(merged);
+    }
+    index_list.indexs.erase(std::remove_if(index_list.indexs.begin(), index_list.indexs.end(),
+        [](const struct needle_index &needle) { return !(needle.flags & FILE_EXIT); }), index_list.indexs.end());
+    index_list.index_num = index_list.indexs.size();
+    std::vector<index_key_t> keys(index_list.indexs.size());
+    for(size_t key_i = 0; key_i < keys.size(); ++key_i) keys[key_i] = index_list.indexs[key_i].filename;
+    std::vector<uint64_t> vals(keys.size());
+    std::iota(vals.begin(), vals.end(), 0);
+    sindex_t sindex_model(keys, vals, index_list.indexs);
+    keys.clear();
+    keys.shrink_to_fit();
+    std::cout.rdbuf(cout_buf);
+
+    size_t group_n = sindex_model.group_num();
+    std::vector<group_stats_t> group_stats(group_n);
+    uint64_t histogram[error_bucket_n] = {};
+    for(size_t group_i = 0; group_i < group_n; ++group_i) {
+        sindex_model.group_stats(group_i, group_stats[group_i]);
+        for(size_t bucket_i = 0; bucket_i < error_bucket_n; ++bucket_i) {
+            histogram[bucket_i] += group_stats[group_i].error_histogram[bucket_i];
+        }
+    }
+    // 误差窗口从大到小，窗口相同时按组的顺序
+    std::vector<size_t> group_order(group_n);
+    std::iota(group_order.begin(), group_order.end(), 0);
+    if(top_n > 0 && top_n < group_n) {
+        std::stable_sort(group_order.begin(), group_order.end(), [&group_stats](size_t a, size_t b) {
+            return group_stats[a].max_pos_error - group_stats[a].max_neg_error
+                > group_stats[b].max_pos_error - group_stats[b].max_neg_error;
+        });
+        group_order.resize(top_n);
+    }
+
+    root_stats_t root = sindex_model.root_stats();
+    memory_stats_t memory = sindex_model.memory_stats();
+    const index_config_t &used = sindex_model.get_config();
+    printf("{\n");
+    printf("  \"records\": %lu,\n", index_list.indexs.size());
+    printf("  \"config\": {\"group_error_bound\": %g, \"partial_len_bound\": %lu, \"forward_step\": %lu, "
+        "\"backward_step\": %lu, \"group_min_size\": %lu, \"linear_search_bound\": %lu, "
+        "\"root_error_bound\": %g, \"root_min_size\": %lu},\n",
+        used.group_error_bound, used.partial_len_bound, used.forward_step,
+        used.backward_step, used.group_min_size, used.linear_search_bound,
+        used.root_error_bound, used.root_min_size);
+    printf("  \"memory\": {\"needles\": %lu, \"keys\": %lu, \"groups\": %lu, \"weights\": %lu, \"root\": %lu, "
+        "\"index_total\": %lu},\n",
+        memory.needles, memory.keys, memory.groups, memory.weights, memory.root,
+        sindex_model.memory_usage());
+    printf("  \"root\": {\"model_n\": %lu, \"group_n\": %lu, \"max_model_size\": %lu, "
+        "\"max_pos_error\": %ld, \"max_neg_error\": %ld, \"avg_abs_error\": %g},\n",
+        root.model_n, root.group_n, root.max_model_size,
+        root.max_pos_error, root.max_neg_error, root.avg_abs_error);
+    // 第 i 个桶是 |误差| 在 [2^(i-1), 2^i) 内，第 0 个桶是误差为 0
+    printf("  \"error_buckets\": [");
+    for(size_t bucket_i = 0; bucket_i < error_bucket_n; ++bucket_i) {
+        size_t low = bucket_i == 0 ? 0 : 1UL << (bucket_i - 1), high = (1UL << bucket_i) - 1;
+        printf("%s", bucket_i ? ", " : "");
+        if(bucket_i + 1 == error_bucket_n) printf("\"%lu+\"", low);
+        else if(low == high) printf("\"%lu\"", low);
+        else printf("\"%lu-%lu\"", low, high);
+    }
+    printf("],\n");
+    printf("  \"error_histogram\": ");
+    print_histogram(histogram);
+    printf(",\n");
+    printf("  \"groups\": [\n");
+    for(size_t order_i = 0; order_i < group_order.size(); ++order_i) {
+        print_group(sindex_model, group_order[order_i], group_stats[group_order[order_i]]);
+        printf("%s\n", order_i + 1 < group_order.size() ? "," : "");
+    }
+    printf("  ]\n");
+    printf("}\n");
+
+    release_needle(&index_list);
+    return 0;
+}
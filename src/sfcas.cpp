@@ -11,56 +11,836 @@
 #include <unistd.h>
 #include <memory.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
 
+#include "block.h"
 #include "needle.h"
 #include "helper.h"
 #include "index.h"
 
-// 初始化时加载的索引信息
-static struct needle_index_list index_list;
-static sindex_t *sindex_model = nullptr;
+// 一份归档：needle 数组、大文件和建立在其上的查找引擎
+// 追加合并和挂载中写入的文件插入引擎中所在组的 delta 数组，插入得多了再在后台合并成新的归档
+// 重载主索引或合并时整体替换，旧归档在最后一个引用释放后才销毁，已打开的文件继续读旧归档
+struct archive_snapshot {
+	struct needle_index_list index_list;
+	// 载入前索引文件的状态，重载时据此判断主索引是否变化
+	struct stat index_stat;
+	// 后台训练时先用 fallback_engine 在 indexs 上二分查找，训练完成后再替换 engine
+	IndexEngine *fallback_engine = nullptr;
+	std::atomic<IndexEngine *> engine{nullptr};
+	std::thread train_thread;
+	// 按顺序保存插入引擎的 needle，引擎中是指向这里的指针，deque 在末尾追加时已有元素的地址不变
+	// 插入和替换引擎时都要持有 update_mutex
+	std::mutex update_mutex;
+	std::deque<struct needle_index> updates;
+	// 压缩归档解压后的块，合并成的新归档和旧归档读同一个大文件，共用一个缓存
+	std::shared_ptr<BlockCache> block_cache;
+
+	IndexEngine *get_engine() const {
+		return engine.load(std::memory_order_acquire);
+	}
+
+	// 训练还没结束时要等它完成
+	~archive_snapshot() {
+		if(train_thread.joinable()) train_thread.join();
+		IndexEngine *trained_engine = engine.load();
+		if(trained_engine != fallback_engine) release_engine(trained_engine);
+		release_engine(fallback_engine);
+		release_needle(&index_list);
+	}
+
+	void insert(const std::vector<struct needle_index> &needles) {
+		std::lock_guard<std::mutex> lock(update_mutex);
+		std::vector<const struct needle_index *> needle_ptrs;
+		needle_ptrs.reserve(needles.size());
+		for(const struct needle_index &needle : needles) {
+			updates.push_back(needle);
+			needle_ptrs.push_back(&updates.back());
+		}
+		get_engine()->insert(needle_ptrs);
+	}
+
+	const struct needle_index *find(const char *filename) const {
+		return find_index(filename, get_engine());
+	}
+
+	bool is_dir(const char *dirname) const {
+		return find_dir(dirname, get_engine());
+	}
+};
+typedef std::shared_ptr<archive_snapshot> snapshot_ptr;
+
+// 只能通过 std::atomic_load / std::atomic_store 访问
+static snapshot_ptr current_snapshot;
+static engine_type_t engine_type;
+
+// 正在写入的文件，内容先缓存在内存中，flush 时整个写入大文件
+struct write_buffer {
+	std::string name;
+	std::mutex mutex;
+	std::vector<char> data;
+	// 还有没提交的修改
+	bool dirty = false;
+	// 打开期间被 unlink，之后的修改不再提交
+	bool unlinked = false;
+	// 共用这份缓存的打开次数，由 writing_mutex 保护，最后一个关闭时才从 writing_files 中去掉
+	int open_n = 0;
+};
+typedef std::shared_ptr<write_buffer> writer_ptr;
+
+// 只读打开的文件是否要检查 CRC32C，检查通过后不再检查
+enum verify_state_t { verify_skip, verify_pending, verify_bad };
+
+// 打开的文件持有所在快照的引用，保存在 fi->fh 中
+// 以写方式打开时 writer 不为空，读写都在 writer 的缓存上进行
+struct open_file {
+	snapshot_ptr snapshot;
+	const struct needle_index *needle;
+	writer_ptr writer;
+	std::atomic<int> verify{verify_skip};
+};
+
+// 收到 SIGUSR1 后在后台重新载入归档（SIGHUP 由 FUSE 用来退出）
+static std::thread reload_thread;
+static std::atomic<bool> reload_stop(false);
+// 重载、提交写入和合并都会修改当前归档或发布新归档，三者互斥，避免较旧的内容覆盖刚提交的文件
+static std::mutex publish_mutex;
+
+// 插入的文件超过 needle 数的 compact_ratio 倍（再加上 COMPACT_MIN_DELTA）时，在后台合并成新的归档
+static double compact_ratio;
+static std::thread compact_thread;
+static std::atomic<bool> compacting(false);
+static size_t block_cache_size;
+
+// --verify：off 不检查，sampled 每 VERIFY_SAMPLE_INTERVAL 次打开检查一次，always 每次打开都检查
+enum class verify_mode_t { off, sampled, always };
+#define VERIFY_SAMPLE_INTERVAL 64
+static verify_mode_t verify_mode;
+static std::atomic<uint64_t> verify_counter(0);
+
+// 新文件的数据追加到大文件末尾，needle 追加到 delta 索引
+// 提交线程把同时等待的文件合成一批，只 fsync 一次，然后发布包含这批文件的新快照
+static struct log_writer {
+	std::mutex mutex;
+	std::condition_variable commit_cond, done_cond;
+	std::thread thread;
+	bool stop = false;
+	// 加了排它锁的大文件，合并程序不能同时追加
+	int data_fd = -1;
+	uint64_t data_end = 0;
+	std::vector<struct needle_index> pending;
+	// 每个等待提交的文件有一个序号，序号不超过 committed_seq 的都已经提交
+	uint64_t pending_seq = 0, committed_seq = 0;
+	// 提交失败的批次 (begin, end]，waiting 是还没有取走结果的文件数，都取走后删除
+	struct failed_batch {
+		uint64_t begin, end, waiting;
+	};
+	std::vector<failed_batch> failed_batches;
+} log_writer;
+
+// 正在写入、还没有提交的文件和 mkdir 创建的空目录，getattr 时也能看到
+static std::mutex writing_mutex;
+static std::unordered_map<std::string, writer_ptr> writing_files;
+static std::set<std::string> created_dirs;
+
+// 命令行参数
+static struct options {
+	const char *engine;
+	// 不等引擎建好就开始服务
+	int background_train;
+	// 允许在挂载点中创建和写入文件
+	int writable;
+	const char *compact_ratio;
+	// 压缩归档的块缓存大小（MB）
+	const char *block_cache;
+	// 读取时检查 CRC32C：off | sampled | always
+	const char *verify;
+#if defined(USE_SINDEX)
+	// SIndex 参数，命令行会覆盖 ini 中的值
+	const char *sindex_config;
+	const char *group_error_bound;
+	const char *partial_len_bound;
+	const char *forward_step;
+	const char *backward_step;
+	const char *group_min_size;
+	const char *linear_search_bound;
+	const char *memory_budget;
+	int auto_tune;
+#endif
+} options;
+
+#define OPTION(t, p) { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+	OPTION("--engine=%s", engine),
+	OPTION("--background-train", background_train),
+	OPTION("--writable", writable),
+	OPTION("--compact-ratio=%s", compact_ratio),
+	OPTION("--block-cache=%s", block_cache),
+	OPTION("--verify=%s", verify),
+#if defined(USE_SINDEX)
+	OPTION("--sindex-config=%s", sindex_config),
+	OPTION("--group-error-bound=%s", group_error_bound),
+	OPTION("--partial-len-bound=%s", partial_len_bound),
+	OPTION("--forward-step=%s", forward_step),
+	OPTION("--backward-step=%s", backward_step),
+	OPTION("--group-min-size=%s", group_min_size),
+	OPTION("--linear-search-bound=%s", linear_search_bound),
+	OPTION("--memory-budget=%s", memory_budget),
+	OPTION("--auto-tune", auto_tune),
+#endif
+	FUSE_OPT_END
+};
+
+#if defined(USE_SINDEX)
+// 默认的 ini 文件不存在时使用内置参数
+// 成功返回 0，失败返回 -1
+static int load_sindex_config() {
+	sindex::index_config_t config = sindex::config;
+	const char *path = options.sindex_config ? options.sindex_config : SINDEX_CONFIG_FILE;
+	if(options.sindex_config || access(path, R_OK) == 0) {
+		if(!sindex::read_config_ini(path, config)) return -1;
+	}
+
+	const std::pair<const char *, const char *> cmd_values[] = {
+		{"group_error_bound", options.group_error_bound},
+		{"partial_len_bound", options.partial_len_bound},
+		{"forward_step", options.forward_step},
+		{"backward_step", options.backward_step},
+		{"group_min_size", options.group_min_size},
+		{"linear_search_bound", options.linear_search_bound},
+		{"memory_budget", options.memory_budget},
+		{"auto_tune", options.auto_tune ? "1" : nullptr},
+	};
+	for(const auto &cmd_value : cmd_values) {
+		if(cmd_value.second && !sindex::set_config_value(config, cmd_value.first, cmd_value.second)) return -1;
+	}
+
+	if(!sindex::set_index_config(config)) return -1;
+	sindex::print_config(sindex::config);
+	return 0;
+}
+#endif
+
+static snapshot_ptr get_snapshot() {
+	return std::atomic_load(&current_snapshot);
+}
+
+static int stat_archive_file(const char *name, struct stat *file_stat) {
+	char path[PATH_SIZE];
+	sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, name);
+	return stat(path, file_stat);
+}
+
+// 索引文件被替换或改写过，或者大文件被替换时需要重新载入主索引
+// 追加合并只会让大文件变长
+static bool base_changed(const archive_snapshot *snapshot) {
+	struct stat index_stat, data_stat, open_data_stat;
+	if(stat_archive_file(INDEXFILE, &index_stat) < 0 || stat_archive_file(BIGFILE, &data_stat) < 0
+	|| fstat(fileno(snapshot->index_list.data_file), &open_data_stat) < 0) return true;
+	return data_stat.st_ino != open_data_stat.st_ino
+		|| index_stat.st_ino != snapshot->index_stat.st_ino
+		|| index_stat.st_size != snapshot->index_stat.st_size
+		|| index_stat.st_mtim.tv_sec != snapshot->index_stat.st_mtim.tv_sec
+		|| index_stat.st_mtim.tv_nsec != snapshot->index_stat.st_mtim.tv_nsec;
+}
+
+// 载入 testDir 下的索引文件、delta 索引和大文件并建立查找引擎，失败返回 nullptr
+// delta 索引中的文件直接并入 needle 数组，只训练一次
+// 后台训练时只建立二分查找，由 start_training 建立真正的引擎
+static snapshot_ptr load_snapshot() {
+	snapshot_ptr snapshot = std::make_shared<archive_snapshot>();
+	struct needle_index_list delta_list;
+	// 先取状态再载入，载入期间被替换时下次重载还会再载入一次
+	if(stat_archive_file(INDEXFILE, &(snapshot->index_stat)) < 0 || init(&(snapshot->index_list)) < 0) {
+		print_error("Error on load index\n");
+		return nullptr;
+	}
+	if(init_delta(&delta_list) < 0) {
+		print_error("Error on load delta index\n");
+		return nullptr;
+	}
+	// sfcas-compact 在载入期间替换了归档时，读到的索引和大文件可能不对应
+	struct stat index_stat;
+	if(stat_archive_file(INDEXFILE_COMPACT, &index_stat) == 0 || stat_archive_file(INDEXFILE, &index_stat) < 0
+	|| index_stat.st_ino != snapshot->index_stat.st_ino) {
+		print_error("Archive changed while loading, reload again\n");
+		return nullptr;
+	}
+	if(delta_list.index_num) {
+		std::vector<struct needle_index> merged;
+		merge_delta_index(snapshot->index_list.indexs, delta_list.indexs, merged);
+		snapshot->index_list.indexs.swap(merged);
+		snapshot->index_list.index_num = snapshot->index_list.indexs.size();
+		printf("%lu appended files merged from delta index\n", delta_list.index_num);
+	}
+	// 删除的文件不进入 needle 数组
+	std::vector<struct needle_index> &indexs = snapshot->index_list.indexs;
+	indexs.erase(std::remove_if(indexs.begin(), indexs.end(),
+		[](const struct needle_index &needle) { return !(needle.flags & FILE_EXIT); }), indexs.end());
+	snapshot->index_list.index_num = indexs.size();
+	if(snapshot->index_list.blocks.block_size) snapshot->block_cache = std::make_shared<BlockCache>(block_cache_size);
+	if(options.background_train && engine_type != engine_type_t::binary) {
+		snapshot->fallback_engine = get_index_engine(snapshot->index_list.indexs, engine_type_t::binary);
+		snapshot->engine.store(snapshot->fallback_engine);
+	}
+	else {
+		snapshot->engine.store(get_index_engine(snapshot->index_list.indexs, engine_type));
+	}
+	if(snapshot->get_engine() == nullptr) return nullptr;
+	return snapshot;
+}
+
+// 训练线程不持有归档的引用，归档销毁时会等待训练结束
+// 训练期间插入 fallback_engine 的文件在替换前补到新引擎中
+// 必须在 fuse 转入后台之后调用
+static void start_training(archive_snapshot *snapshot) {
+	if(snapshot->fallback_engine == nullptr) return;
+	snapshot->train_thread = std::thread([snapshot]() {
+		auto start = std::chrono::steady_clock::now();
+		IndexEngine *trained_engine = get_index_engine(snapshot->index_list.indexs, engine_type);
+		if(trained_engine == nullptr) {
+			print_error("Error on train index engine, keep using binary search\n");
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(snapshot->update_mutex);
+			std::vector<const struct needle_index *> needle_ptrs;
+			needle_ptrs.reserve(snapshot->updates.size());
+			for(const struct needle_index &needle : snapshot->updates) needle_ptrs.push_back(&needle);
+			trained_engine->insert(needle_ptrs);
+			snapshot->engine.store(trained_engine, std::memory_order_release);
+		}
+		printf("Get %s engine success! %ldms in background\n", trained_engine->name(),
+			(long)std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - start).count());
+	});
+}
+
+// 把插入的文件和 needle 数组合并成新的归档并重新训练，完成后替换当前归档
+// 合并期间提交的文件照常插入旧归档，替换前再补到新归档中
+static void compact_archive(snapshot_ptr old_snapshot) {
+	auto start = std::chrono::steady_clock::now();
+	IndexEngine *old_engine = old_snapshot->get_engine();
+	size_t replay_begin;
+	{
+		std::lock_guard<std::mutex> lock(old_snapshot->update_mutex);
+		replay_begin = old_snapshot->updates.size();
+	}
+
+	// 按顺序遍历得到的就是合并后的有序数组，删除的文件不再保留
+	snapshot_ptr snapshot = std::make_shared<archive_snapshot>();
+	std::vector<struct needle_index> &indexs = snapshot->index_list.indexs;
+	indexs.reserve(old_snapshot->index_list.index_num + old_engine->delta_size());
+	NeedleCursor cursor(old_engine);
+	for(cursor.seek(index_key_t()); cursor.get(); cursor.next()) indexs.push_back(*cursor.get());
+	snapshot->index_list.index_num = indexs.size();
+	snapshot->index_stat = old_snapshot->index_stat;
+	snapshot->index_list.blocks = old_snapshot->index_list.blocks;
+	snapshot->block_cache = old_snapshot->block_cache;
+	// 两份归档读的是同一个大文件
+	int data_fd = dup(fileno(old_snapshot->index_list.data_file));
+	if(data_fd >= 0 && (snapshot->index_list.data_file = fdopen(data_fd, "rb")) == nullptr) close(data_fd);
+	IndexEngine *engine = snapshot->index_list.data_file ? get_index_engine(indexs, engine_type) : nullptr;
+	if(engine == nullptr) {
+		print_error("Error on compact archive, keep serving the old one\n");
+		compacting.store(false);
+		return;
+	}
+	snapshot->engine.store(engine);
+
+	{
+		std::lock_guard<std::mutex> publish_lock(publish_mutex);
+		// 期间重新载入了主索引时放弃
+		if(get_snapshot() == old_snapshot) {
+			std::lock_guard<std::mutex> lock(old_snapshot->update_mutex);
+			std::vector<struct needle_index> replay(old_snapshot->updates.begin() + replay_begin,
+				old_snapshot->updates.end());
+			snapshot->insert(replay);
+			std::atomic_store(&current_snapshot, snapshot);
+			printf("Compact archive success! %lu files in %ldms\n", snapshot->index_list.index_num,
+				(long)std::chrono::duration_cast<std::chrono::milliseconds>(
+					std::chrono::steady_clock::now() - start).count());
+		}
+	}
+	compacting.store(false);
+}
+
+// 插入的文件足够多且没有正在进行的训练和合并时开始合并
+static void maybe_compact() {
+	snapshot_ptr snapshot = get_snapshot();
+	IndexEngine *engine = snapshot->get_engine();
+	if(compact_ratio <= 0 || engine == snapshot->fallback_engine
+	|| engine->delta_size() <= compact_ratio * snapshot->index_list.index_num + COMPACT_MIN_DELTA) return;
+	if(compacting.exchange(true)) return;
+	// 上一次合并已经结束
+	if(compact_thread.joinable()) compact_thread.join();
+	compact_thread = std::thread(compact_archive, snapshot);
+}
+
+// 主索引没变时（只有追加合并）把 delta 索引中和当前不同的文件插入引擎，不用重新训练
+// 返回插入的文件数，失败返回 -1
+static int64_t reload_delta(archive_snapshot *snapshot) {
+	struct needle_index_list delta_list;
+	if(init_delta(&delta_list) < 0) return -1;
+	IndexEngine *engine = snapshot->get_engine();
+	std::vector<struct needle_index> changed;
+	for(const struct needle_index &needle : delta_list.indexs) {
+		const struct needle_index *cur = engine->find(needle.filename);
+		if(cur == nullptr || cur->offset != needle.offset || cur->size != needle.size || cur->flags != needle.flags)
+			changed.push_back(needle);
+	}
+	snapshot->insert(changed);
+	return changed.size();
+}
+
+// 新归档建好后才替换，正在进行的查找和读取不受影响
+static void reload_loop() {
+	sigset_t reload_set;
+	sigemptyset(&reload_set);
+	sigaddset(&reload_set, SIGUSR1);
+	struct timespec timeout = {1, 0};
+	while(!reload_stop.load()) {
+		if(sigtimedwait(&reload_set, nullptr, &timeout) != SIGUSR1) continue;
+		printf("Reload archive start!\n");
+		auto start = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> publish_lock(publish_mutex);
+		snapshot_ptr old_snapshot = get_snapshot();
+		if(!base_changed(old_snapshot.get())) {
+			int64_t changed_n = reload_delta(old_snapshot.get());
+			publish_lock.unlock();
+			if(changed_n < 0) {
+				print_error("Error on reload delta index, keep serving the old one\n");
+				continue;
+			}
+			printf("Reload delta index success! %ld changed files in %ldms\n", changed_n,
+				(long)std::chrono::duration_cast<std::chrono::milliseconds>(
+					std::chrono::steady_clock::now() - start).count());
+			maybe_compact();
+			continue;
+		}
+		// 写入的文件追加在当前的大文件中，不能换成别的大文件
+		if(options.writable) {
+			print_error("Archive replaced while mounted with --writable, remount to load it\n");
+			continue;
+		}
+		old_snapshot.reset();
+		snapshot_ptr snapshot = load_snapshot();
+		if(snapshot == nullptr) {
+			print_error("Error on reload archive, keep serving the old one\n");
+			continue;
+		}
+		std::atomic_store(&current_snapshot, snapshot);
+		start_training(snapshot.get());
+		printf("Reload archive success! %lu files in %ldms\n", snapshot->index_list.index_num,
+			(long)std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - start).count());
+	}
+}
+
+static int write_all(int fd, const char *buf, size_t size, uint64_t offset) {
+	while(size > 0) {
+		ssize_t written = pwrite(fd, buf, size, offset);
+		if(written < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		buf += written;
+		size -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+// 打开大文件并加锁，新文件从当前末尾开始写
+// 成功返回 0，失败返回 -1
+static int open_log_writer(const archive_snapshot *snapshot) {
+	char path[PATH_SIZE];
+	sprintf(path, "%s/%s/%s", PATH2PDIR, OPDIR, BIGFILE);
+	log_writer.data_fd = open(path, O_RDWR);
+	// 载入之后大文件被 sfcas-compact 替换过时也不能写
+	struct stat data_stat, open_data_stat;
+	if(log_writer.data_fd < 0 || flock(log_writer.data_fd, LOCK_EX | LOCK_NB) < 0
+	|| fstat(log_writer.data_fd, &data_stat) < 0 || fstat(fileno(snapshot->index_list.data_file), &open_data_stat) < 0
+	|| data_stat.st_ino != open_data_stat.st_ino) {
+		print_error("Error on lock data file %s, is it being combined or compacted?\n", path);
+		if(log_writer.data_fd >= 0) close(log_writer.data_fd);
+		log_writer.data_fd = -1;
+		return -1;
+	}
+	log_writer.data_end = lseek(log_writer.data_fd, 0, SEEK_END);
+	return 0;
+}
+
+static void commit_loop() {
+	std::unique_lock<std::mutex> lock(log_writer.mutex);
+	while(true) {
+		log_writer.commit_cond.wait(lock, []() { return !log_writer.pending.empty() || log_writer.stop; });
+		// 退出前提交完所有等待的文件
+		if(log_writer.pending.empty()) break;
+		std::vector<struct needle_index> batch;
+		batch.swap(log_writer.pending);
+		uint64_t batch_seq = log_writer.pending_seq;
+		lock.unlock();
+
+		// 数据落盘后再写索引，索引中不会出现没有数据的文件
+		bool ok = fdatasync(log_writer.data_fd) == 0;
+		if(ok) {
+			std::lock_guard<std::mutex> publish_lock(publish_mutex);
+			ok = append_delta_index(batch) == 0;
+			if(ok) get_snapshot()->insert(batch);
+		}
+		if(ok) maybe_compact();
+		else print_error("Error on commit %lu written files\n", batch.size());
+
+		lock.lock();
+		if(!ok) log_writer.failed_batches.push_back({log_writer.committed_seq, batch_seq, batch_seq - log_writer.committed_seq});
+		log_writer.committed_seq = batch_seq;
+		log_writer.done_cond.notify_all();
+	}
+}
+
+// 把 needle 交给提交线程，等待所在的批次提交
+// 成功返回 0，失败返回 -errno
+static int commit_needle(const struct needle_index &needle) {
+	std::unique_lock<std::mutex> lock(log_writer.mutex);
+	log_writer.pending.push_back(needle);
+	uint64_t seq = ++log_writer.pending_seq;
+	log_writer.commit_cond.notify_one();
+	log_writer.done_cond.wait(lock, [seq]() { return log_writer.committed_seq >= seq; });
+	auto &failed = log_writer.failed_batches;
+	for(auto it = failed.begin(); it != failed.end(); ++it) {
+		if(seq <= it->begin || seq > it->end) continue;
+		if(--it->waiting == 0) failed.erase(it);
+		return -EIO;
+	}
+	return 0;
+}
+
+// 把 name 的新内容写入大文件，等待所在的批次提交
+// 成功返回 0，失败返回 -errno
+static int commit_file(const char *name, const std::vector<char> &data) {
+	if(data.size() > UINT32_MAX) return -EFBIG;
+	uint64_t offset;
+	{
+		std::lock_guard<std::mutex> lock(log_writer.mutex);
+		if(log_writer.data_fd < 0) return -EROFS;
+		offset = log_writer.data_end;
+		log_writer.data_end += data.size();
+	}
+	// 各个文件的空间已经分开，可以并发写入
+	if(write_all(log_writer.data_fd, data.data(), data.size(), offset) < 0) {
+		print_error("Error on write %s to data file\n", name);
+		return -EIO;
+	}
+
+	struct needle_index needle;
+	struct stat file_info;
+	file_info.st_size = data.size();
+	set_needle_index(&needle, &file_info, name, offset);
+	// 内容已经在内存中，计算 CRC32C 的开销可以忽略
+	set_needle_crc(&needle, simd_kernels().crc32c(0, data.data(), data.size()));
+	return commit_needle(needle);
+}
+
+// 删除的文件在 delta 索引中记一个没有 FILE_EXIT 的 needle，数据留在大文件中等 sfcas-compact 回收
+static int commit_tombstone(const char *name) {
+	if(log_writer.data_fd < 0) return -EROFS;
+	struct needle_index needle;
+	struct stat file_info;
+	file_info.st_size = 0;
+	set_needle_index(&needle, &file_info, name, 0);
+	needle.flags &= ~FILE_EXIT;
+	return commit_needle(needle);
+}
+
+// 提交 writer 中还没有提交的修改
+static int flush_writer(write_buffer *writer) {
+	std::lock_guard<std::mutex> lock(writer->mutex);
+	if(!writer->dirty || writer->unlinked) return 0;
+	int res = commit_file(writer->name.c_str(), writer->data);
+	if(res == 0) writer->dirty = false;
+	return res;
+}
+
+static writer_ptr find_writing(const char *filename) {
+	std::lock_guard<std::mutex> lock(writing_mutex);
+	auto it = writing_files.find(filename);
+	return it == writing_files.end() ? nullptr : it->second;
+}
+
+static bool is_created_dir(const char *dirname) {
+	std::lock_guard<std::mutex> lock(writing_mutex);
+	return created_dirs.count(dirname) > 0;
+}
+
+// 是否有以 "dirname/" 开头、正在写入的文件，提交之前它们所在的目录也要能看到
+static bool has_writing_under(const char *dirname) {
+	size_t dir_len = strlen(dirname);
+	std::lock_guard<std::mutex> lock(writing_mutex);
+	for(const auto &writing : writing_files) {
+		const std::string &name = writing.first;
+		if(name.size() > dir_len && name[dir_len] == '/' && name.compare(0, dir_len, dirname) == 0) return true;
+	}
+	return false;
+}
+
+static bool is_archive_file(const char *filename) {
+	return strcmp(filename, BIGFILE) == 0 || strcmp(filename, INDEXFILE) == 0
+		|| strncmp(filename, DELTAFILE, strlen(DELTAFILE)) == 0
+		|| strcmp(filename, BIGFILE_COMPACT) == 0
+		|| strncmp(filename, INDEXFILE_COMPACT, strlen(INDEXFILE_COMPACT)) == 0
+		|| strncmp(filename, BLOCKFILE, strlen(BLOCKFILE)) == 0;
+}
+
+// 新文件的名字不能是已有的目录，长度也不能超过索引中的上限
+static int check_new_name(archive_snapshot *snapshot, const char *filename) {
+	if(!options.writable) return -EROFS;
+	if(strlen(filename) > MAX_FILE_LEN) return -ENAMETOOLONG;
+	if(is_archive_file(filename)) return -EACCES;
+	if(snapshot->is_dir(filename) || is_created_dir(filename)) return -EISDIR;
+	return 0;
+}
+
+// 同名的文件正在写入时共用它的缓存，否则新建一个空的缓存
+// 新建时 init_lock 不为空则在其他线程找到它之前锁住，调用方可以先载入原来的内容
+static struct open_file *open_writer(snapshot_ptr snapshot, const char *filename,
+									 std::unique_lock<std::mutex> *init_lock = nullptr) {
+	std::lock_guard<std::mutex> lock(writing_mutex);
+	writer_ptr &writer = writing_files[filename];
+	if(writer == nullptr) {
+		writer = std::make_shared<write_buffer>();
+		writer->name = filename;
+		if(init_lock) *init_lock = std::unique_lock<std::mutex>(writer->mutex);
+	}
+	++writer->open_n;
+	return new open_file{snapshot, nullptr, writer};
+}
+
+// 最后一个打开的文件关闭后，正在写入的文件才从 writing_files 中去掉
+static void release_writer(struct open_file *file) {
+	if(file->writer) {
+		std::lock_guard<std::mutex> lock(writing_mutex);
+		auto it = writing_files.find(file->writer->name);
+		if(--file->writer->open_n == 0 && it != writing_files.end() && it->second == file->writer)
+			writing_files.erase(it);
+	}
+	delete file;
+}
+
+// 从大文件中读出 needle 的 [offset, offset + size)，调用方保证不超过文件末尾
+// 成功返回读到的字节数，失败返回 -errno
+static ssize_t read_needle(const archive_snapshot *snapshot, const struct needle_index *needle,
+						   char *buf, size_t size, uint64_t offset) {
+	// 压缩归档按逻辑偏移读取，解压后的块经过缓存
+	if(snapshot->block_cache) {
+		return read_blocks(&(snapshot->index_list), snapshot->block_cache.get(), buf, size, needle->offset + offset);
+	}
+	// 多个线程共用同一个大文件，pread 不改变文件位置
+	ssize_t read_size = pread(fileno(snapshot->index_list.data_file), buf, size, needle->offset + offset);
+	if(read_size < 0) {
+		print_error("Error on read data file\n");
+		return -errno;
+	}
+	return read_size;
+}
+
+// data 是否是 needle 的完整内容，没有记录 CRC32C 的 needle 不检查
+static bool check_crc(const struct needle_index *needle, const char *data, ssize_t size) {
+	if(size != needle->size) return false;
+	if(!(needle->flags & FILE_CRC) || simd_kernels().crc32c(0, data, size) == needle->crc) return true;
+	print_error("Checksum mismatch for %s (offset %lu, size %u)\n", needle->filename.get_name(), needle->offset,
+		needle->size);
+	return false;
+}
+
+// 打开时决定这次是否检查，关闭 --verify 时不增加打开文件的开销
+static bool should_verify(const struct needle_index *needle) {
+	if(verify_mode == verify_mode_t::off || !(needle->flags & FILE_CRC)) return false;
+	if(verify_mode == verify_mode_t::always) return true;
+	return verify_counter.fetch_add(1, std::memory_order_relaxed) % VERIFY_SAMPLE_INTERVAL == 0;
+}
+
+// 读出已经提交的文件内容
+static int read_committed(archive_snapshot *snapshot, const struct needle_index *needle, std::vector<char> &data) {
+	data.resize(needle->size);
+	ssize_t read_size = read_needle(snapshot, needle, data.data(), data.size(), 0);
+	if(read_size < 0) return read_size;
+	// 提交时会按读出的内容重新计算 CRC32C，不能把已经损坏的内容当作正确的提交
+	if(read_size != (ssize_t)data.size()) return -EIO;
+	return verify_mode == verify_mode_t::off || check_crc(needle, data.data(), read_size) ? 0 : -EIO;
+}
+
+// 第一次读取时读出整个文件检查 CRC32C，一次读完整个文件时直接在 buf 上检查
+// 成功返回读到的字节数，失败返回 -errno
+static ssize_t read_verified(struct open_file *file, char *buf, size_t size, uint64_t offset) {
+	const struct needle_index *needle = file->needle;
+	if(file->verify.load() == verify_bad) return -EIO;
+	bool whole = offset == 0 && size == needle->size;
+	thread_local std::vector<char> data;
+	char *dst = buf;
+	if(!whole) {
+		data.resize(needle->size);
+		dst = data.data();
+	}
+	ssize_t read_size = read_needle(file->snapshot.get(), needle, dst, needle->size, 0);
+	if(read_size < 0) return read_size;
+	bool ok = check_crc(needle, dst, read_size);
+	file->verify.store(ok ? verify_skip : verify_bad);
+	if(!ok) return -EIO;
+	if(!whole) memcpy(buf, dst + offset, size);
+	return size;
+}
 
 static int sfcas_getattr(const char *path, struct stat *stbuf,
 			struct fuse_file_info *fi)
 {
-	const char *filename = strrchr(path, '/');
+	// 合并文件中记录的是相对路径
+	const char *filename = path + 1;
 	
 	memset(stbuf, 0, sizeof(struct stat));
-	if(strcmp(filename, "/") == 0) {
+	if(strcmp(path, "/") == 0) {
 		stbuf->st_mode = __S_IFDIR | 0755;
-		index_list.is_cached = false;
 	}
-	else if(strcmp(filename + 1, BIGFILE) == 0
-	|| strcmp(filename + 1, INDEXFILE) == 0) {
+	else if(strcmp(filename, BIGFILE) == 0
+	|| strcmp(filename, INDEXFILE) == 0) {
 		stbuf->st_mode = __S_IFREG | 0444;
-		index_list.is_cached = false;
 	}
 	else {
-		struct needle_index *cur_index = find_index(&index_list, filename + 1, sindex_model);
-		if(!cur_index) {
-			index_list.is_cached = false;
-			print_error("Error on finding target file %s.\n", filename + 1);
-			return -ENOENT;
+		mode_t file_mode = __S_IFREG | (options.writable ? 0644 : 0444);
+		// 以写方式打开的文件看到的是自己的缓存
+		const struct open_file *file = fi ? (const struct open_file *)fi->fh : nullptr;
+		writer_ptr writer = file ? file->writer : nullptr;
+		snapshot_ptr snapshot = get_snapshot();
+		const struct needle_index *cur_index = writer ? nullptr : snapshot->find(filename);
+		if(cur_index) {
+			stbuf->st_mode = file_mode;
+			stbuf->st_size = cur_index->size;
+			return 0;
 		}
-		index_list.is_cached = true;
-		index_list.cached_item = cur_index;
-		stbuf->st_mode = __S_IFREG | 0444;
-		stbuf->st_size = cur_index->size;
+		// 新创建、还没有提交的文件
+		if(writer || (options.writable && (writer = find_writing(filename)))) {
+			std::lock_guard<std::mutex> lock(writer->mutex);
+			stbuf->st_mode = file_mode;
+			stbuf->st_size = writer->data.size();
+			return 0;
+		}
+		// 目录由以其为前缀的文件隐式表示
+		if(snapshot->is_dir(filename)
+		|| (options.writable && (is_created_dir(filename) || has_writing_under(filename)))) {
+			stbuf->st_mode = __S_IFDIR | 0755;
+			return 0;
+		}
+		print_error("Error on finding target file %s.\n", filename);
+		return -ENOENT;
 	}
 	
 	return 0;
 }
 
+// 目录下的文件是 key 有序数组中以 "dir/" 为前缀的一段
+// 遇到子目录时只列出一次，然后直接跳到 "dir/sub0"（'0' 紧跟在 '/' 之后）处，跳过整个子目录
 static int sfcas_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi,
 			   enum fuse_readdir_flags flags) {
-	for(size_t i = 0; i < index_list.index_num; ++i) {
+	char prefix[PATH_SIZE], child[PATH_SIZE];
+	size_t prefix_len = 0;
+	if(strcmp(path, "/") != 0) {
+		prefix_len = sprintf(prefix, "%s/", path + 1);
+		if(prefix_len > MAX_FILE_LEN) return -ENOENT;
+	}
+	prefix[prefix_len] = '\0';
+
+	// 整个目录都从同一个归档中列出，needle 数组和插入的文件按文件名归并
+	snapshot_ptr snapshot = get_snapshot();
+	// 既不是归档中任何文件的前缀，也不是 mkdir 创建的目录
+	if(prefix_len > 0 && !snapshot->is_dir(path + 1)
+	&& !(options.writable && (is_created_dir(path + 1) || has_writing_under(path + 1))))
+		return -ENOENT;
+	NeedleCursor cursor(snapshot->get_engine());
+	index_key_t prefix_key(prefix);
+	for(cursor.seek(prefix_key); cursor.get() && cursor.get()->filename.starts_with(prefix_key); ) {
+		const struct needle_index &needle = *cursor.get();
+		const char *name = needle.filename.c_str() + prefix_len;
+		const char *slash = strchr(name, '/');
 		struct stat st;
 		memset(&st, 0, sizeof(st));
-		st.st_size = index_list.indexs[i].size;
-		st.st_mode = __S_IFREG | 0444;
-		if (filler(buf, index_list.indexs[i].filename.get_name(), &st, 0, fuse_fill_dir_flags(0)))
+		if(slash == nullptr) {
+			st.st_size = needle.size;
+			st.st_mode = __S_IFREG | 0444;
+			if (filler(buf, name, &st, 0, fuse_fill_dir_flags(0)))
+				break;
+			cursor.next();
+			continue;
+		}
+
+		size_t child_len = slash - name;
+		memcpy(child, name, child_len);
+		child[child_len] = '\0';
+		st.st_mode = __S_IFDIR | 0755;
+		if (filler(buf, child, &st, 0, fuse_fill_dir_flags(0)))
 			break;
+		// 跳过该子目录下的所有文件
+		memcpy(child, needle.filename.c_str(), prefix_len + child_len);
+		child[prefix_len + child_len] = '/' + 1;
+		child[prefix_len + child_len + 1] = '\0';
+		cursor.seek(index_key_t(child));
+	}
+	// mkdir 创建、还没有写入文件的目录
+	if(options.writable) {
+		std::lock_guard<std::mutex> lock(writing_mutex);
+		for(auto it = created_dirs.lower_bound(prefix);
+			it != created_dirs.end() && strncmp(it->c_str(), prefix, prefix_len) == 0; ++it) {
+			const char *name = it->c_str() + prefix_len;
+			if(strchr(name, '/') || snapshot->is_dir(it->c_str())) continue;
+			struct stat st;
+			memset(&st, 0, sizeof(st));
+			st.st_mode = __S_IFDIR | 0755;
+			filler(buf, name, &st, 0, fuse_fill_dir_flags(0));
+		}
+	}
+	// 创建后还没有提交的文件，以及只有这些文件的子目录，已经提交的在上面列出过
+	if(options.writable) {
+		std::vector<std::pair<std::string, writer_ptr>> writing;
+		{
+			std::lock_guard<std::mutex> lock(writing_mutex);
+			for(const auto &entry : writing_files) {
+				if(entry.first.compare(0, prefix_len, prefix) == 0) writing.push_back(entry);
+			}
+		}
+		std::sort(writing.begin(), writing.end());
+		std::set<std::string> listed_dirs;
+		for(const auto &entry : writing) {
+			const char *name = entry.first.c_str() + prefix_len;
+			const char *slash = strchr(name, '/');
+			struct stat st;
+			memset(&st, 0, sizeof(st));
+			if(slash) {
+				std::string dirname = entry.first.substr(0, prefix_len + (slash - name));
+				if(snapshot->is_dir(dirname.c_str()) || is_created_dir(dirname.c_str())
+				|| !listed_dirs.insert(dirname).second) continue;
+				st.st_mode = __S_IFDIR | 0755;
+				filler(buf, dirname.c_str() + prefix_len, &st, 0, fuse_fill_dir_flags(0));
+				continue;
+			}
+			if(snapshot->find(entry.first.c_str())) continue;
+			{
+				std::lock_guard<std::mutex> lock(entry.second->mutex);
+				st.st_size = entry.second->data.size();
+			}
+			st.st_mode = __S_IFREG | 0644;
+			filler(buf, name, &st, 0, fuse_fill_dir_flags(0));
+		}
 	}
 	filler(buf, ".", nullptr, 0, fuse_fill_dir_flags(0));
 	filler(buf, "..", nullptr, 0, fuse_fill_dir_flags(0));
@@ -68,75 +848,324 @@ static int sfcas_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	return 0;
 }
 
+// 打开时确定文件所在的快照，之后的读取都在这个快照上进行
 static int sfcas_open(const char *path, struct fuse_file_info *fi) {	
-	const char *filename = strrchr(path, '/');
+	const char *filename = path + 1;
 
-	struct needle_index *cur_index = NULL;
-	if(index_list.is_cached && strcmp(filename + 1, index_list.cached_item->filename.get_name()) == 0) 
-		cur_index = index_list.cached_item;
-	else 
-		cur_index = find_index(&index_list, filename + 1, sindex_model);
-	
-	if(!cur_index) {
-		return -ENOENT;
+	snapshot_ptr snapshot = get_snapshot();
+	const struct needle_index *cur_index = snapshot->find(filename);
+	bool write_access = (fi->flags & O_ACCMODE) != O_RDONLY;
+	if(!write_access) {
+		if(!cur_index) {
+			return -ENOENT;
+		}
+		struct open_file *file = new open_file{snapshot, cur_index, nullptr};
+		if(should_verify(cur_index)) file->verify.store(verify_pending);
+		fi->fh = (uint64_t)file;
+		return 0;
+	}
+
+	// 以写方式打开已有的文件时从原来的内容开始修改，flush 时整个重新写入
+	int res = check_new_name(snapshot.get(), filename);
+	if(res < 0) return res;
+	if(!cur_index && !find_writing(filename)) return -ENOENT;
+	std::unique_lock<std::mutex> init_lock;
+	struct open_file *file = open_writer(snapshot, filename, &init_lock);
+	write_buffer *writer = file->writer.get();
+	if(fi->flags & O_TRUNC) {
+		if(!init_lock) init_lock = std::unique_lock<std::mutex>(writer->mutex);
+		writer->data.clear();
+		writer->dirty = true;
+	}
+	// 正在写入的文件继续在已有的缓存上修改，还没有提交的内容不会丢失
+	else if(init_lock && cur_index && (res = read_committed(snapshot.get(), cur_index, writer->data)) < 0) {
+		init_lock.unlock();
+		release_writer(file);
+		return res;
+	}
+	fi->fh = (uint64_t)file;
+	return 0;
+}
+
+static int sfcas_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	const char *filename = path + 1;
+	snapshot_ptr snapshot = get_snapshot();
+	int res = check_new_name(snapshot.get(), filename);
+	if(res < 0) return res;
+	struct open_file *file = open_writer(snapshot, filename);
+	// 空文件也要提交
+	{
+		std::lock_guard<std::mutex> lock(file->writer->mutex);
+		file->writer->dirty = true;
+	}
+	fi->fh = (uint64_t)file;
+	return 0;
+}
+
+static int sfcas_write(const char *path, const char *buf, size_t size, off_t offset,
+		     struct fuse_file_info *fi) {
+	struct open_file *file = (struct open_file *)fi->fh;
+	if(file == nullptr || file->writer == nullptr) return -EBADF;
+	if(offset < 0) return -EINVAL;
+	if((uint64_t)offset + size > UINT32_MAX) return -EFBIG;
+	write_buffer *writer = file->writer.get();
+	std::lock_guard<std::mutex> lock(writer->mutex);
+	if(writer->data.size() < offset + size) writer->data.resize(offset + size);
+	memcpy(writer->data.data() + offset, buf, size);
+	writer->dirty = true;
+	return size;
+}
+
+static int sfcas_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	const char *filename = path + 1;
+	if(size < 0) return -EINVAL;
+	if((uint64_t)size > UINT32_MAX) return -EFBIG;
+	struct open_file *file = fi ? (struct open_file *)fi->fh : nullptr;
+	if(file && file->writer) {
+		std::lock_guard<std::mutex> lock(file->writer->mutex);
+		file->writer->data.resize(size);
+		file->writer->dirty = true;
+		return 0;
+	}
+
+	// 没有打开的文件，截断后直接提交新的内容
+	snapshot_ptr snapshot = get_snapshot();
+	int res = check_new_name(snapshot.get(), filename);
+	if(res < 0) return res;
+	const struct needle_index *cur_index = snapshot->find(filename);
+	if(!cur_index) return -ENOENT;
+	std::vector<char> data;
+	if(size > 0 && (res = read_committed(snapshot.get(), cur_index, data)) < 0) return res;
+	data.resize(size);
+	return commit_file(filename, data);
+}
+
+static int sfcas_flush(const char *path, struct fuse_file_info *fi) {
+	struct open_file *file = (struct open_file *)fi->fh;
+	if(file == nullptr || file->writer == nullptr) return 0;
+	return flush_writer(file->writer.get());
+}
+
+static int sfcas_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	// 提交时已经落盘
+	return sfcas_flush(path, fi);
+}
+
+static int sfcas_mkdir(const char *path, mode_t mode) {
+	const char *dirname = path + 1;
+	snapshot_ptr snapshot = get_snapshot();
+	if(!options.writable) return -EROFS;
+	if(strlen(dirname) + 1 > MAX_FILE_LEN) return -ENAMETOOLONG;
+	if(snapshot->find(dirname) || snapshot->is_dir(dirname) || find_writing(dirname)) return -EEXIST;
+	std::lock_guard<std::mutex> lock(writing_mutex);
+	return created_dirs.insert(dirname).second ? 0 : -EEXIST;
+}
+
+// 先让正在写入的同名文件不再提交，再提交删除，已经打开的读者继续读原来的内容
+static int sfcas_unlink(const char *path) {
+	const char *filename = path + 1;
+	if(!options.writable) return -EROFS;
+	if(is_archive_file(filename)) return -EACCES;
+	writer_ptr writer;
+	{
+		std::lock_guard<std::mutex> lock(writing_mutex);
+		auto it = writing_files.find(filename);
+		if(it != writing_files.end()) {
+			writer = it->second;
+			writing_files.erase(it);
+		}
 	}
+	if(writer) {
+		// 等正在进行的提交结束，之后再查找才能看到它
+		std::lock_guard<std::mutex> lock(writer->mutex);
+		writer->unlinked = true;
+	}
+	if(!get_snapshot()->find(filename)) return writer ? 0 : -ENOENT;
+	return commit_tombstone(filename);
+}
+
+// 目录由文件隐式表示，只有 mkdir 创建的空目录可以删除
+static int sfcas_rmdir(const char *path) {
+	const char *dirname = path + 1;
+	if(!options.writable) return -EROFS;
+	snapshot_ptr snapshot = get_snapshot();
+	if(snapshot->find(dirname)) return -ENOTDIR;
+	if(snapshot->is_dir(dirname)) return -ENOTEMPTY;
+	std::string prefix = std::string(dirname) + "/";
+	std::lock_guard<std::mutex> lock(writing_mutex);
+	// 下面还有正在写入的文件或者创建的子目录
+	for(const auto &writing : writing_files) {
+		if(writing.first.compare(0, prefix.size(), prefix) == 0) return -ENOTEMPTY;
+	}
+	auto it = created_dirs.lower_bound(prefix);
+	if(it != created_dirs.end() && it->compare(0, prefix.size(), prefix) == 0) return -ENOTEMPTY;
+	return created_dirs.erase(dirname) ? 0 : -ENOENT;
+}
+
+// 不保存时间，只让 touch 之类的程序能正常结束
+static int sfcas_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
 	return 0;
 }
 
 static int sfcas_read(const char *path, char *buf, size_t size, off_t offset,
 		    struct fuse_file_info *fi) {
-	const char *filename = strrchr(path, '/');
+	struct open_file *file = (struct open_file *)fi->fh;
+	if(file == nullptr) {
+		print_error("Error on finding target file %s.\n", path + 1);
+		return -ENOENT;
+	}
+	if(file->writer) {
+		std::lock_guard<std::mutex> lock(file->writer->mutex);
+		const std::vector<char> &data = file->writer->data;
+		if(offset < 0) return -EINVAL;
+		if((uint64_t)offset >= data.size()) return 0;
+		size = std::min<uint64_t>(size, data.size() - offset);
+		memcpy(buf, data.data() + offset, size);
+		return size;
+	}
+	// 不能读到大文件中下一个文件的数据
+	const struct needle_index *cur_index = file->needle;
+	if(offset < 0) return -EINVAL;
+	if((uint64_t)offset >= cur_index->size) return 0;
+	size = std::min<uint64_t>(size, cur_index->size - offset);
+	if(file->verify.load(std::memory_order_relaxed) != verify_skip) return read_verified(file, buf, size, offset);
+	return read_needle(file->snapshot.get(), cur_index, buf, size, offset);
+}
 
-	// 查找文件元数据
-	struct needle_index *cur_index = NULL;
-	if(index_list.is_cached && strcmp(filename + 1, index_list.cached_item->filename.get_name()) == 0) 
-		cur_index = index_list.cached_item;
-	else 
-		cur_index = find_index(&index_list, filename + 1, sindex_model);
-	// 读取数据
-	if(cur_index) {
-		int flag = fseek(index_list.data_file, cur_index->offset + offset, SEEK_SET);
-		if(flag) {
-			print_error("Error on fseek position\n");
-			return -errno;
-		}
-		int read_size = fread(buf, 1, size, index_list.data_file);
-		return read_size;
+static int sfcas_release(const char *path, struct fuse_file_info *fi) {
+	struct open_file *file = (struct open_file *)fi->fh;
+	if(file && file->writer) {
+		// 没有经过 flush 的修改在这里提交，错误已经无法返回
+		if(flush_writer(file->writer.get()) < 0) print_error("Error on commit %s\n", file->writer->name.c_str());
 	}
-	print_error("Error on finding target file %s.\n", filename + 1);
-	return -ENOENT;
+	release_writer(file);
+	fi->fh = 0;
+	return 0;
 }
 
 static void *sfcas_init(struct fuse_conn_info *conn,
 			struct fuse_config *cfg)
 {
-	(void) conn;
 	// cfg->kernel_cache = 1;
+	// 带 O_TRUNC 打开时不用先单独截断再提交一次
+	if(options.writable && (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC))
+		conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+	// 在 fuse 转入后台之后再创建线程
+	start_training(get_snapshot().get());
+	reload_thread = std::thread(reload_loop);
+	if(options.writable) log_writer.thread = std::thread(commit_loop);
 	return NULL;
 }
 
+static void sfcas_destroy(void *private_data) {
+	reload_stop.store(true);
+	if(reload_thread.joinable()) reload_thread.join();
+	{
+		std::lock_guard<std::mutex> lock(log_writer.mutex);
+		log_writer.stop = true;
+		log_writer.commit_cond.notify_one();
+	}
+	if(log_writer.thread.joinable()) log_writer.thread.join();
+	// 之后不会再开始新的合并
+	if(compact_thread.joinable()) compact_thread.join();
+}
+
 // 按照出现顺序无序初始化
 static const struct fuse_operations myOper = {
 	.getattr 	= sfcas_getattr,
+	.mkdir		= sfcas_mkdir,
+	.unlink		= sfcas_unlink,
+	.rmdir		= sfcas_rmdir,
+	.truncate	= sfcas_truncate,
 	.open 		= sfcas_open,
 	.read 		= sfcas_read,
+	.write		= sfcas_write,
+	.flush		= sfcas_flush,
+	.release 	= sfcas_release,
+	.fsync		= sfcas_fsync,
 	.readdir 	= sfcas_readdir,
-	.init		= sfcas_init
+	.init		= sfcas_init,
+	.destroy	= sfcas_destroy,
+	.create		= sfcas_create,
+	.utimens	= sfcas_utimens
 };
 
 int main(int argc, char *argv[])
 {
-	if(init(&index_list) < 0) {
-		print_error("Error on load index\n");
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+#if defined(USE_SINDEX)
+	options.engine = strdup("sindex");
+#else
+	options.engine = strdup("binary");
+#endif
+	options.compact_ratio = strdup("0.25");
+	options.block_cache = strdup("64");
+	options.verify = strdup("off");
+	if(fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+		return 1;
+
+	if(!parse_engine_type(options.engine, engine_type) || !engine_available(engine_type)) {
+		print_error("Unknown or unavailable index engine %s\n", options.engine);
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+	// 0 表示不合并
+	char *ratio_end = nullptr;
+	compact_ratio = strtod(options.compact_ratio, &ratio_end);
+	if(*ratio_end != '\0' || compact_ratio < 0) {
+		print_error("Bad compact ratio %s\n", options.compact_ratio);
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+	char *cache_end = nullptr;
+	block_cache_size = strtoul(options.block_cache, &cache_end, 10) << 20;
+	if(*cache_end != '\0') {
+		print_error("Bad block cache size %s\n", options.block_cache);
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+	if(strcmp(options.verify, "off") == 0) verify_mode = verify_mode_t::off;
+	else if(strcmp(options.verify, "sampled") == 0) verify_mode = verify_mode_t::sampled;
+	else if(strcmp(options.verify, "always") == 0) verify_mode = verify_mode_t::always;
+	else {
+		print_error("Unknown verify mode %s, use off, sampled or always\n", options.verify);
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+#if defined(USE_SINDEX)
+	if(engine_type == engine_type_t::sindex && load_sindex_config() < 0) {
+		print_error("Error on load sindex config\n");
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+#endif
+
+	snapshot_ptr snapshot = load_snapshot();
+	if(snapshot && options.writable && snapshot->block_cache) {
+		print_error("Compressed archive is read-only, mount it without --writable\n");
+		snapshot.reset();
+	}
+	if(snapshot == nullptr || (options.writable && open_log_writer(snapshot.get()) < 0)) {
+		fuse_opt_free_args(&args);
 		return 1;
 	}
 	printf("Init Success!\n");
-	sindex_model = get_sindex_model(index_list.indexs);
-	printf("Get Model success!\n");
+	if(snapshot->fallback_engine) printf("Serve with binary search until %s engine is trained\n", options.engine);
+	else printf("Get %s engine success!\n", snapshot->get_engine()->name());
+	printf("SIMD level: %s\n", simd_kernels().name);
+	std::atomic_store(&current_snapshot, snapshot);
+	snapshot.reset();
+
+	// 之后创建的线程都继承这个信号掩码，SIGUSR1 只由重载线程通过 sigtimedwait 接收
+	sigset_t reload_set;
+	sigemptyset(&reload_set);
+	sigaddset(&reload_set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &reload_set, nullptr);
 
-	int res = fuse_main(argc, argv, &myOper, NULL);
+	int res = fuse_main(args.argc, args.argv, &myOper, NULL);
 
-	release_needle(&index_list);
-	release_model(sindex_model);
+	fuse_opt_free_args(&args);
+	std::atomic_store(&current_snapshot, snapshot_ptr());
+	if(log_writer.data_fd >= 0) close(log_writer.data_fd);
 	return res;
 }
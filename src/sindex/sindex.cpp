@@ -8,8 +8,7 @@ SIndex<key_t, val_t>::SIndex(const std::vector<key_t> &keys, const std::vector<v
          std::vector<struct needle_index> &indexs)
     {
   // sanity checks
-  INVARIANT(config.group_error_bound > 0);
-  INVARIANT(config.group_error_tolerance > 0);
+  INVARIANT(validate_config(config));
 
   // 确保排序
   for (size_t key_i = 1; key_i < keys.size(); key_i++) {
@@ -18,6 +17,14 @@ SIndex<key_t, val_t>::SIndex(const std::vector<key_t> &keys, const std::vector<v
 
   // malloc memory for root & init root
   root = new root_t();
+  // 调出的参数只用于这个索引，全局的 config 保持用户给出的值
+  // 重载和后台重新训练时每次都从同样的参数开始调，也不会改变正在服务的索引的查找参数
+  if (config.auto_tune) {
+    index_config_t tuned = config;
+    root->tune_config(keys, indexs, tuned);
+    root->set_config(tuned);
+    print_config(tuned);
+  }
   root->init(keys, vals, indexs);
   // root->save_model();
   // COUT_THIS("Save models success!");
@@ -36,5 +43,85 @@ inline bool SIndex<key_t, val_t>::get(const key_t &key, val_t &val) {
   return root->get(key, val) == result_t::ok;
 }
 
+template <class key_t, class val_t>
+size_t SIndex<key_t, val_t>::lower_bound(const key_t &key) {
+  return root->lower_bound(key);
+}
+
+// key 有序，定位到起点之后顺序往后扫描即可
+template <class key_t, class val_t>
+size_t SIndex<key_t, val_t>::scan(const key_t &prefix, size_t limit,
+                                  std::vector<val_t> &vals) {
+  size_t pos = root->lower_bound(prefix), cnt = 0;
+  for (; cnt < limit && pos < root->size() && root->key_at(pos).starts_with(prefix);
+       ++pos, ++cnt) {
+    vals.push_back(pos);
+  }
+  return cnt;
+}
+
+template <class key_t, class val_t>
+size_t SIndex<key_t, val_t>::range(const key_t &begin, const key_t &end,
+                                   std::vector<val_t> &vals) {
+  size_t pos = root->lower_bound(begin), cnt = 0;
+  for (; pos < root->size() && root->key_at(pos) < end; ++pos, ++cnt) {
+    vals.push_back(pos);
+  }
+  return cnt;
+}
+
+template <class key_t, class val_t>
+size_t SIndex<key_t, val_t>::memory_usage() const {
+  return sizeof(*this) + root->memory_usage();
+}
+
+template <class key_t, class val_t>
+root_stats_t SIndex<key_t, val_t>::root_stats() const {
+  return root->root_stats();
+}
+
+template <class key_t, class val_t>
+memory_stats_t SIndex<key_t, val_t>::memory_stats() const {
+  return root->memory_stats();
+}
+
+template <class key_t, class val_t>
+const index_config_t &SIndex<key_t, val_t>::get_config() const {
+  return root->get_config();
+}
+
+template <class key_t, class val_t>
+size_t SIndex<key_t, val_t>::group_num() const {
+  return root->group_num();
+}
+
+template <class key_t, class val_t>
+const key_t &SIndex<key_t, val_t>::group_pivot(size_t group_i) const {
+  return root->get_group_pivot(group_i);
+}
+
+template <class key_t, class val_t>
+size_t SIndex<key_t, val_t>::locate_group(const key_t &key) const {
+  return root->locate_group_i(key);
+}
+
+template <class key_t, class val_t>
+bool SIndex<key_t, val_t>::get_in_group(size_t group_i, const key_t &key,
+                                        val_t &val) const {
+  return root->get_in_group(group_i, key, val) == result_t::ok;
+}
+
+template <class key_t, class val_t>
+void SIndex<key_t, val_t>::group_range(size_t group_i, uint64_t &begin,
+                                       uint64_t &end) const {
+  root->group_range(group_i, begin, end);
+}
+
+template <class key_t, class val_t>
+void SIndex<key_t, val_t>::group_stats(size_t group_i,
+                                       group_stats_t &stats) const {
+  root->group_stats(group_i, stats);
+}
+
 }  // namespace sindex
 
@@ -0,0 +1,118 @@
+#include <boost/property_tree/ini_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "sindex_config.h"
+#include "strkey.h"
+#include "needle.h"
+
+namespace sindex {
+
+index_config_t config;
+
+static bool parse_value(const std::string &value, double &out) {
+  char *end = nullptr;
+  out = strtod(value.c_str(), &end);
+  return !value.empty() && *end == '\0';
+}
+
+static bool parse_value(const std::string &value, size_t &out) {
+  char *end = nullptr;
+  if (value.empty() || value[0] == '-') return false;
+  out = strtoull(value.c_str(), &end, 10);
+  return *end == '\0';
+}
+
+static bool parse_value(const std::string &value, bool &out) {
+  if (value == "1" || value == "true" || value == "on") out = true;
+  else if (value == "0" || value == "false" || value == "off") out = false;
+  else return false;
+  return true;
+}
+
+bool validate_config(const index_config_t &config) {
+  bool valid = true;
+  auto check = [&valid](bool cond, const char *msg) {
+    if (!cond) {
+      print_error("Invalid sindex config: %s\n", msg);
+      valid = false;
+    }
+  };
+  check(config.group_error_bound > 0, "group_error_bound must be > 0");
+  check(config.group_error_tolerance > 0, "group_error_tolerance must be > 0");
+  // 前缀长度超过 key 的长度时所有 key 都能放进一个组
+  check(config.partial_len_bound > 0 &&
+            config.partial_len_bound <= index_key_t::model_key_size(),
+        "partial_len_bound must be in [1, model key size]");
+  // 步长为 0 时前进和回退都不会结束
+  check(config.backward_step > 0, "backward_step must be > 0");
+  check(config.forward_step > config.backward_step,
+        "forward_step must be > backward_step");
+  // 计算前缀时至少要有两个 key
+  check(config.group_min_size >= 2, "group_min_size must be >= 2");
+  check(config.group_min_size <= config.forward_step,
+        "group_min_size must be <= forward_step");
+  check(config.root_error_bound > 0, "root_error_bound must be > 0");
+  check(config.root_min_size > 0, "root_min_size must be > 0");
+  return valid;
+}
+
+bool set_config_value(index_config_t &config, const std::string &name,
+                      const std::string &value) {
+  bool parsed = false;
+  if (name == "group_error_bound") parsed = parse_value(value, config.group_error_bound);
+  else if (name == "group_error_tolerance") parsed = parse_value(value, config.group_error_tolerance);
+  else if (name == "partial_len_bound") parsed = parse_value(value, config.partial_len_bound);
+  else if (name == "forward_step") parsed = parse_value(value, config.forward_step);
+  else if (name == "backward_step") parsed = parse_value(value, config.backward_step);
+  else if (name == "group_min_size") parsed = parse_value(value, config.group_min_size);
+  else if (name == "linear_search_bound") parsed = parse_value(value, config.linear_search_bound);
+  else if (name == "root_error_bound") parsed = parse_value(value, config.root_error_bound);
+  else if (name == "root_min_size") parsed = parse_value(value, config.root_min_size);
+  else if (name == "auto_tune") parsed = parse_value(value, config.auto_tune);
+  else if (name == "memory_budget") parsed = parse_value(value, config.memory_budget);
+  else {
+    print_error("Unknown sindex config %s\n", name.c_str());
+    return false;
+  }
+  if (!parsed) {
+    print_error("Bad value %s for sindex config %s\n", value.c_str(), name.c_str());
+  }
+  return parsed;
+}
+
+bool read_config_ini(const char *path, index_config_t &config) {
+  boost::property_tree::ptree pt;
+  try {
+    boost::property_tree::ini_parser::read_ini(path, pt);
+  } catch (const boost::property_tree::ini_parser_error &e) {
+    print_error("Error on read sindex config %s: %s\n", path, e.what());
+    return false;
+  }
+  auto section = pt.get_child_optional("SIndex");
+  if (!section) return true;
+  for (const auto &item : *section) {
+    if (!set_config_value(config, item.first, item.second.data())) return false;
+  }
+  return true;
+}
+
+void print_config(const index_config_t &config) {
+  COUT_THIS("SIndex config: group_error_bound=" << config.group_error_bound
+            << " partial_len_bound=" << config.partial_len_bound
+            << " forward_step=" << config.forward_step
+            << " backward_step=" << config.backward_step
+            << " group_min_size=" << config.group_min_size
+            << " linear_search_bound=" << config.linear_search_bound
+            << " root_error_bound=" << config.root_error_bound
+            << " root_min_size=" << config.root_min_size
+            << " auto_tune=" << config.auto_tune
+            << " memory_budget=" << config.memory_budget);
+}
+
+bool set_index_config(const index_config_t &new_config) {
+  if (!validate_config(new_config)) return false;
+  config = new_config;
+  return true;
+}
+
+}  // namespace sindex
@@ -10,122 +10,124 @@ template <class key_t, class val_t>
 Group<key_t, val_t>::Group() {}
 
 template <class key_t, class val_t>
-Group<key_t, val_t>::~Group() {
-  delete[] model_weights;
-  model_weights = nullptr;
+Group<key_t, val_t>::Group(Group &&other) noexcept {
+  *this = std::move(other);
 }
 
 template <class key_t, class val_t>
-void Group<key_t, val_t>::init(
-    const typename std::vector<key_t>::const_iterator &keys_begin,
-    const typename std::vector<val_t>::const_iterator &vals_begin,
-    uint32_t array_size, struct needle_index *needle_begin,
-    uint64_t start) {
-  assert(array_size > 0);
-  this->pivot = *keys_begin;
-  this->array_size = array_size;
-
-  this->data = new record_t[this->array_size];
-
-  for (size_t rec_i = 0; rec_i < array_size; rec_i++) {
-    data[rec_i].first = *(keys_begin + rec_i);
-    data[rec_i].second = *(vals_begin + rec_i);
-  }
-
-  for (size_t rec_i = 1; rec_i < array_size; rec_i++) {
-    assert(data[rec_i].first >= data[rec_i - 1].first);
+Group<key_t, val_t> &Group<key_t, val_t>::operator=(Group &&other) noexcept {
+  if (this != &other) {
+    delete[] fingerprints;
+    model_weights = other.model_weights;
+    predict_fn = other.predict_fn;
+    fingerprints = other.fingerprints;
+    needle_begin = other.needle_begin;
+    start = other.start;
+    max_neg_error = other.max_neg_error;
+    max_pos_error = other.max_pos_error;
+    array_size = other.array_size;
+    prefix_len = other.prefix_len;
+    feature_len = other.feature_len;
+    other.fingerprints = nullptr;
   }
-
-  this->needle_begin = needle_begin;
-  this->start = start;
-  init_models();
-
-  free_data();
+  return *this;
 }
 
 template <class key_t, class val_t>
-void Group<key_t, val_t>::free_data() {
-  delete[] data;
-  data = nullptr;
+Group<key_t, val_t>::~Group() {
+  delete[] fingerprints;
+  fingerprints = nullptr;
 }
 
+// 组内的 key 就是 needle_begin 开始的 array_size 个文件名，不再另外复制
 template <class key_t, class val_t>
-void Group<key_t, val_t>::init_models() {
+void Group<key_t, val_t>::init(uint32_t array_size,
+                               struct needle_index *needle_begin,
+                               uint64_t start,
+                               std::vector<double> &weight_arena) {
+  assert(array_size > 0);
+  this->array_size = array_size;
+  this->needle_begin = needle_begin;
+  this->start = start;
+
+  for (size_t rec_i = 1; rec_i < array_size; rec_i++) {
+    assert(needle_begin[rec_i].filename >= needle_begin[rec_i - 1].filename);
+  }
+
   init_feature_length();
+  predict_fn = get_predict_fn(feature_len);
 
   // +1 for bias
-  model_weights = new double[feature_len + 1];
-
-  train_model(0, array_size);
+  size_t weight_offset = weight_arena.size();
+  weight_arena.resize(weight_offset + weight_num());
+  train_model(weight_arena.data() + weight_offset);
+  init_fingerprints();
 }
 
 // 为了获取该组内的 prefixlen 和 feature_len
 // feature_len 是实际使用字符长度
 template <class key_t, class val_t>
 void Group<key_t, val_t>::init_feature_length() {
-  const size_t key_size = sizeof(key_t);
+  const size_t key_size = key_t::model_key_size();
   if (array_size < 2) {
-    prefix_len = (uint32_t)key_size;
+    prefix_len = (uint16_t)key_size;
     return;
   }
 
-  prefix_len = common_prefix_length(0, (uint8_t *)&data[0].first, key_size,
-                                    (uint8_t *)&data[1].first, key_size);
-  size_t max_adjacent_prefix = prefix_len;
+  size_t common_len = needle_begin[0].filename.common_prefix_length(
+      needle_begin[1].filename, 0, key_size);
+  size_t max_adjacent_prefix = common_len;
 
   for (size_t k_i = 2; k_i < array_size; ++k_i) {
-    prefix_len =
-        common_prefix_length(0, (uint8_t *)&data[k_i - 1].first, prefix_len,
-                             (uint8_t *)&data[k_i].first, key_size);
+    const key_t &prev = needle_begin[k_i - 1].filename,
+                &cur = needle_begin[k_i].filename;
+    common_len = prev.common_prefix_length(cur, 0, common_len);
     size_t adjacent_prefix =
-        common_prefix_length(prefix_len, (uint8_t *)&data[k_i - 1].first,
-                             key_size, (uint8_t *)&data[k_i].first, key_size);
-    assert(adjacent_prefix <= sizeof(key_t) - prefix_len);
+        prev.common_prefix_length(cur, common_len, key_size);
+    assert(adjacent_prefix <= key_size - common_len);
     // == 意味着有两个相同的 key
-    if (adjacent_prefix < sizeof(key_t) - prefix_len) {
+    if (adjacent_prefix < key_size - common_len) {
       max_adjacent_prefix =
-          std::max(max_adjacent_prefix, prefix_len + adjacent_prefix);
+          std::max(max_adjacent_prefix, common_len + adjacent_prefix);
     }
   }
 
   // 为了区分两个 key 需要 +1
-  feature_len = max_adjacent_prefix - prefix_len + 1;
-  assert(prefix_len <= sizeof(key_t));
-  assert(feature_len <= sizeof(key_t));
+  prefix_len = common_len;
+  feature_len = max_adjacent_prefix - common_len + 1;
+  assert(prefix_len <= key_size);
+  assert(feature_len <= key_size);
 }
 
+// 组内的 key 有共同的 prefix_len 字节前缀，指纹取其后的 8 个字节
 template <class key_t, class val_t>
-inline void Group<key_t, val_t>::train_model(size_t begin, size_t end) {
-  assert(end >= begin);
-  assert(array_size >= end);
-
-  size_t model_data_size = end - begin;
-  std::vector<double> model_keys(model_data_size * feature_len);
-  std::vector<double *> model_key_ptrs(model_data_size);
-  std::vector<size_t> positions(model_data_size);
-
-  for (size_t rec_i = 0; rec_i < model_data_size; rec_i++) {
-    data[begin + rec_i].first.get_model_key(
-        prefix_len, feature_len, model_keys.data() + rec_i * feature_len);
-    model_key_ptrs[rec_i] = model_keys.data() + rec_i * feature_len;
-    positions[rec_i] = begin + rec_i;
+void Group<key_t, val_t>::init_fingerprints() {
+  delete[] fingerprints;
+  fingerprints = new int64_t[array_size];
+  for (size_t rec_i = 0; rec_i < array_size; ++rec_i) {
+    fingerprints[rec_i] = key_fingerprint(needle_begin[rec_i].filename, prefix_len);
   }
-
-  prepare_last(model_key_ptrs, positions);
 }
 
 // 训练模型参数同时得到误差范围
+// 特征在训练时按需从 key 中取出，不需要为整个组保存特征矩阵
 template <class key_t, class val_t>
-inline void Group<key_t, val_t>::prepare_last(
-    const std::vector<double *> &model_key_ptrs,
-    const std::vector<size_t> &positions) {
-  model_prepare(model_key_ptrs, positions, model_weights, feature_len);
+inline void Group<key_t, val_t>::train_model(double *weights) {
+  model_prepare(
+      array_size,
+      [&](size_t rec_i, double *model_key) {
+        needle_begin[rec_i].filename.get_model_key(prefix_len, feature_len,
+                                                   model_key);
+        return (double)rec_i;
+      },
+      weights, feature_len);
+  model_weights = weights;
 
   // calculate error info
   int64_t pos_error = 0, neg_error = 0;
-  for (size_t key_i = 0; key_i < model_key_ptrs.size(); ++key_i) {
-    long long int pos_actual = positions[key_i];
-    long long int pos_pred = predict(model_key_ptrs[key_i]);
+  for (size_t rec_i = 0; rec_i < array_size; ++rec_i) {
+    long long int pos_actual = rec_i;
+    long long int pos_pred = predict(needle_begin[rec_i].filename);
     long long int error = pos_actual - pos_pred;
     if (error > pos_error) pos_error = error;
     if (error < neg_error) neg_error = error;
@@ -135,7 +137,7 @@ inline void Group<key_t, val_t>::prepare_last(
 
 template <class key_t, class val_t>
 inline result_t Group<key_t, val_t>::get(
-  const key_t &key, val_t &val) const {
+  const key_t &key, val_t &val, size_t linear_search_bound) const {
   int64_t pos_pred = predict(key);
   int64_t search_begin = pos_pred + max_neg_error,
   search_end = pos_pred + max_pos_error;
@@ -144,8 +146,10 @@ inline result_t Group<key_t, val_t>::get(
   if(search_begin >= (int64_t)this->array_size) search_begin = this->array_size - 1;
   if(search_end < 0) search_end = 0;
   if(search_end >= (int64_t)this->array_size) search_end = this->array_size - 1;
-  // 在预测出来的 pos 和误差范围内二分查找
-  size_t pos = binary_search_key(key, pos_pred, search_begin, search_end);
+  // 窗口较小时线性扫描指纹，否则在预测出来的 pos 和误差范围内二分查找
+  size_t pos = (size_t)(search_end - search_begin) < linear_search_bound
+                   ? linear_search_key(key, search_begin, search_end)
+                   : binary_search_key(key, pos_pred, search_begin, search_end);
   DEBUG_THIS("predict pos: " << pos);
   DEBUG_THIS("predict name: " << needle_begin[pos].filename);
   DEBUG_THIS("actual name: " << key);
@@ -156,13 +160,69 @@ inline result_t Group<key_t, val_t>::get(
   return result_t::failed;
 }
 
+// 误差范围只对组内已有的 key 成立
+// 其余 key 先在误差范围两侧指数查找把结果框住，再二分
+template <class key_t, class val_t>
+inline size_t Group<key_t, val_t>::lower_bound(const key_t &key) const {
+  int64_t pos_pred = predict(key);
+  int64_t search_begin = pos_pred + max_neg_error,
+  search_end = pos_pred + max_pos_error + 1;
+  if(search_begin < 0) search_begin = 0;
+  if(search_begin > (int64_t)array_size) search_begin = array_size;
+  if(search_end < search_begin) search_end = search_begin;
+  if(search_end > (int64_t)array_size) search_end = array_size;
+
+  // 结果在 [begin, end] 内
+  size_t begin = search_begin, end = search_end, step = 1;
+  while (begin > 0 && !(needle_begin[begin - 1].filename < key)) {
+    end = begin - 1;
+    begin = begin > step ? begin - step : 0;
+    step *= 2;
+  }
+  while (end < array_size && needle_begin[end].filename < key) {
+    begin = end + 1;
+    end = std::min(end + step, (size_t)array_size);
+    step *= 2;
+  }
+
+  while (begin < end) {
+    size_t mid = (begin + end) / 2;
+    if (needle_begin[mid].filename < key) {
+      begin = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+  return begin;
+}
+
+template <class key_t, class val_t>
+size_t Group<key_t, val_t>::memory_usage() const {
+  return sizeof(*this) + array_size * sizeof(int64_t);
+}
+
+template <class key_t, class val_t>
+void Group<key_t, val_t>::collect_stats(group_stats_t &stats) const {
+  stats = group_stats_t();
+  stats.start = start;
+  stats.size = array_size;
+  stats.prefix_len = prefix_len;
+  stats.feature_len = feature_len;
+  get_model_error(stats.max_pos_error, stats.max_neg_error);
+  for (size_t rec_i = 0; rec_i < array_size; ++rec_i) {
+    int64_t error = (int64_t)rec_i - (int64_t)predict(needle_begin[rec_i].filename);
+    stats.error_histogram[error_bucket(error)]++;
+  }
+}
+
 // [search_begin, search_end]
 template <class key_t, class val_t>
 inline size_t Group<key_t, val_t>::binary_search_key(
     const key_t &key, size_t pos, size_t search_begin, size_t search_end) const {
   assert(search_begin <= search_end);
   if(search_begin == search_end) return search_begin;
-  size_t mid = (pos >= search_begin && pos <= search_end) ? pos : (search_begin + search_end) / 2;;
+  // mid 不能取到 search_end，否则 key 比 search_end 处还大时 search_begin 会越过 search_end
+  size_t mid = (pos >= search_begin && pos < search_end) ? pos : (search_begin + search_end) / 2;
   while (search_end != search_begin) {
     if (needle_begin[mid].filename.less_than(key, prefix_len, feature_len)) {
       search_begin = mid + 1;
@@ -177,6 +237,23 @@ inline size_t Group<key_t, val_t>::binary_search_key(
   return mid;
 }
 
+// [search_begin, search_end]
+// 指纹有序，小于 key 指纹的个数就是第一个指纹不小于 key 的位置
+// 指纹相同的 key 再比较完整的 key，返回的位置最多到 search_end
+template <class key_t, class val_t>
+inline size_t Group<key_t, val_t>::linear_search_key(
+    const key_t &key, size_t search_begin, size_t search_end) const {
+  int64_t fingerprint = key_fingerprint(key, prefix_len);
+  size_t pos = search_begin + simd_kernels().count_less(
+                                  fingerprints + search_begin,
+                                  search_end - search_begin + 1, fingerprint);
+  while (pos < search_end && fingerprints[pos] == fingerprint &&
+         needle_begin[pos].filename < key) {
+    ++pos;
+  }
+  return std::min(pos, search_end);
+}
+
 template <class key_t, class val_t>
 inline void Group<key_t, val_t>::get_model_error(
   int64_t &error_pos, int64_t &error_neg) const {
@@ -194,38 +271,45 @@ inline void Group<key_t, val_t>::set_model_error(
 
 template <class key_t, class val_t>
 inline size_t Group<key_t, val_t>::predict(const key_t &key) const {
-  double model_key[feature_len];
-  key.get_model_key(prefix_len, feature_len, model_key);
-  return model_predict(model_weights, model_key, feature_len);
-}
-
-template <class key_t, class val_t>
-inline size_t Group<key_t, val_t>::predict(const double *model_key) const {
-  return model_predict(model_weights, model_key, feature_len);
+  return model_predict_key(predict_fn, model_weights, key, prefix_len,
+                           feature_len);
 }
 
 template <class key_t, class val_t>
 inline void Group<key_t, val_t>::save_group_model(FILE *model_file) const {
+  // 文件中的字段宽度保持不变
+  uint32_t p_len = prefix_len, f_len = feature_len;
+  int64_t pos_error = max_pos_error, neg_error = max_neg_error;
   fwrite(&array_size, sizeof(array_size), 1, model_file);
-  fwrite(&prefix_len, sizeof(prefix_len), 1, model_file);
-  fwrite(&feature_len, sizeof(feature_len), 1, model_file);
-  fwrite(&max_pos_error, sizeof(max_pos_error), 1, model_file);
-  fwrite(&max_neg_error, sizeof(max_neg_error), 1, model_file);
-  fwrite(model_weights, sizeof(double), feature_len + 1, model_file);
+  fwrite(&p_len, sizeof(p_len), 1, model_file);
+  fwrite(&f_len, sizeof(f_len), 1, model_file);
+  fwrite(&pos_error, sizeof(pos_error), 1, model_file);
+  fwrite(&neg_error, sizeof(neg_error), 1, model_file);
+  fwrite(model_weights, sizeof(double), weight_num(), model_file);
 }
 
 template <class key_t, class val_t>
-inline void Group<key_t, val_t>::read_group_model(FILE *model_file, needle_index *needle_begin, uint64_t start) {
-  this->pivot = needle_begin->filename;
+inline void Group<key_t, val_t>::read_group_model(
+    FILE *model_file, needle_index *needle_begin, uint64_t start,
+    std::vector<double> &weight_arena) {
   this->needle_begin = needle_begin;
   this->start = start;
+  uint32_t p_len = 0, f_len = 0;
+  int64_t pos_error = 0, neg_error = 0;
   fread(&array_size, sizeof(array_size), 1, model_file);
-  fread(&prefix_len, sizeof(prefix_len), 1, model_file);
-  fread(&feature_len, sizeof(feature_len), 1, model_file);
-  fread(&max_pos_error, sizeof(max_pos_error), 1, model_file);
-  fread(&max_neg_error, sizeof(max_neg_error), 1, model_file);
-  model_weights = new double[feature_len + 1];
-  fread(model_weights, sizeof(double), feature_len + 1, model_file);
+  fread(&p_len, sizeof(p_len), 1, model_file);
+  fread(&f_len, sizeof(f_len), 1, model_file);
+  fread(&pos_error, sizeof(pos_error), 1, model_file);
+  fread(&neg_error, sizeof(neg_error), 1, model_file);
+  prefix_len = p_len;
+  feature_len = f_len;
+  size_t weight_offset = weight_arena.size();
+  weight_arena.resize(weight_offset + weight_num());
+  fread(weight_arena.data() + weight_offset, sizeof(double), weight_num(), model_file);
+  predict_fn = get_predict_fn(feature_len);
+  init_fingerprints();
+  // 模型可能是在另一种指令集下训练的，预测值的舍入可能差 1，误差范围各放宽 1
+  set_model_error(pos_error + 1, neg_error - 1);
 }
 
 }  // namespace sindex
@@ -1,29 +1,31 @@
+#include <climits>
+#include <cmath>
+
+#include "sindex_config.h"
 #include "sindex_root.h"
 
 namespace sindex {
 template class Root<index_key_t, uint64_t>;
 
-template <class key_t, class val_t>
-Root<key_t, val_t>::~Root() {}
-
 template <class key_t, class val_t>
 void Root<key_t, val_t>::init(const std::vector<key_t> &keys,
                                    const std::vector<val_t> &vals,
                                    std::vector<struct needle_index> &indexs) {
   std::vector<size_t> pivot_indexes;
   // 贪心分组得到每个组的 pivot 
-  grouping_by_partial_key(keys, config.group_error_bound,
-                          config.partial_len_bound, config.forward_step,
-                          config.backward_step, config.group_min_size,
-                          pivot_indexes);
+  group_keys(keys, pivot_indexes);
 
   group_n = pivot_indexes.size();
   COUT_THIS("The number of groups: " << group_n);
-  size_t record_n = keys.size();
-  // <group_pivot, group>
-  groups = std::make_unique<std::pair<key_t, group_t *>[]>(group_n);
+  needle_begin = indexs.data();
+  record_n = keys.size();
+  pivots.resize(group_n);
+  groups.clear();
+  groups.reserve(group_n);
+  group_weights.clear();
 
   int64_t max_pos_error = 0, max_neg_error = 0, max_error = 0;
+  auto train_start = std::chrono::steady_clock::now();
   // 填充 groups 的内容
   // 同时会初始化每个 group
   for (size_t group_i = 0; group_i < group_n; group_i++) {
@@ -31,116 +33,281 @@ void Root<key_t, val_t>::init(const std::vector<key_t> &keys,
     size_t end_i =
         group_i + 1 == group_n ? record_n : pivot_indexes[group_i + 1];
 
-    set_group_pivot(group_i, keys[begin_i]);
-    group_t *group_ptr = new group_t();
-    group_ptr->init(keys.begin() + begin_i, vals.begin() + begin_i,
-                    end_i - begin_i, indexs.data() + begin_i, begin_i);
+    pivots[group_i] = keys[begin_i];
+    groups.emplace_back();
+    groups.back().init(end_i - begin_i, indexs.data() + begin_i, begin_i,
+                       group_weights);
     int64_t pos_error = 0, neg_error = 0;
-    group_ptr->get_model_error(pos_error, neg_error);
+    groups.back().get_model_error(pos_error, neg_error);
     max_pos_error = std::max(max_pos_error, pos_error);
     max_neg_error = std::min(max_neg_error, neg_error);
     max_error = std::max(max_error, pos_error - neg_error);
-    set_group_ptr(group_i, group_ptr);
-    assert(group_ptr == get_group_ptr(group_i));
   }
+  bind_group_weights();
+  init_pivot_prefixes();
 
   COUT_THIS("Max pos error of groups: " << max_pos_error);
   COUT_THIS("Max neg error of groups: " << max_neg_error);
   COUT_THIS("Max error of groups: " << max_error);
+  COUT_THIS("Train groups time: " << std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - train_start).count() << "ms");
 
   // 训练 root 层次的 model
   train_piecewise_model();
 }
 
 // 将 pivot 分组并训练
+// 先按前缀贪心分组，误差超过 root_error_bound 的模型再对半拆分，模型数量随组数增长
 template <class key_t, class val_t>
 inline void Root<key_t, val_t>::train_piecewise_model() {
   std::vector<size_t> indexes;
-  std::vector<key_t> pivots(group_n);
-  for (size_t g_i = 0; g_i < group_n; ++g_i) {
-    pivots[g_i] = get_group_pivot(g_i);
-  }
   // 将 pivots 分组
-  grouping_by_partial_key(pivots, config.group_error_bound,
-                          config.partial_len_bound, config.forward_step,
-                          config.backward_step, config.group_min_size, indexes);
-
-  // 限制模型数量在 4 个及以下
-  if (indexes.size() > max_root_model_n) {
-    // 这里是从 indexes 中看每个 model 要多少
-    size_t index_per_model = indexes.size() / max_root_model_n;
-    std::vector<size_t> new_indexes;
-    size_t trailing = indexes.size() - index_per_model * max_root_model_n;
-    size_t start_i = 0;
-    // 将 trailing 的部分依次添加到前面的 model 中去
-    // 其实是将前面部分多个组融合在一起，直到最后剩下 max_root_model_n 个组
-    for (size_t i = 0; i < max_root_model_n; ++i) {
-      new_indexes.push_back(indexes[start_i]);
-      start_i += index_per_model;
-      if (trailing > 0) {
-        trailing--;
-        start_i++;
-      }
-    }
-    indexes.swap(new_indexes);
-  }
-
-  uint32_t model_n = indexes.size();
-  INVARIANT(model_n <= max_root_model_n);
-  this->root_model_n = model_n;
+  grouping_by_partial_key(pivots, index_config.group_error_bound,
+                          index_config.partial_len_bound,
+                          index_config.forward_step, index_config.backward_step,
+                          index_config.group_min_size, indexes);
 
-  COUT_THIS("The number of root model: " << model_n);
-
-  assert(indexes.size() <= model_n);
-  uint32_t p_len = 0, f_len = 0;
-  // 得到分组后每个 model 的前缀信息并训练
+  models.clear();
+  model_group_begins.clear();
   for (size_t m_i = 0; m_i < indexes.size(); ++m_i) {
     size_t b_i = indexes[m_i];
     size_t e_i = (m_i == indexes.size() - 1) ? group_n : indexes[m_i + 1];
-    model_pivots[m_i] = get_group_ptr(b_i)->pivot;
-    partial_key_len_of_pivots(b_i, e_i, p_len, f_len);
-    size_t m_size = e_i - b_i;
-    DEBUG_THIS("------ SIndex Root Model(" << m_i << "): size=" << m_size
-                                           << ", p_len=" << p_len
-                                           << ", f_len=" << f_len);
-    
-    std::vector<double> m_keys(m_size * f_len);
-    std::vector<double *> m_key_ptrs(m_size);
-    std::vector<size_t> ps(m_size);
-    for (size_t k_i = 0; k_i < m_size; ++k_i) {
-      // k_i 是相对于本 model 的首元素的偏移
-      // 这里的 m_size 不是 model 数量，是 model 内 pivot 的数量
-      get_group_ptr(k_i + b_i)->pivot.get_model_key(
-          p_len, f_len, m_keys.data() + f_len * k_i);
-      m_key_ptrs[k_i] = m_keys.data() + f_len * k_i;
-      ps[k_i] = k_i + b_i;
+    train_root_model(b_i, e_i);
+  }
+  root_model_n = models.size();
+
+  root_stats_t stats = root_stats();
+  COUT_THIS("The number of root model: " << stats.model_n);
+  COUT_THIS("Max size of root models: " << stats.max_model_size);
+  COUT_THIS("Max pos error of root models: " << stats.max_pos_error);
+  COUT_THIS("Max neg error of root models: " << stats.max_neg_error);
+  COUT_THIS("Avg error of root models: " << stats.avg_abs_error);
+}
+
+// 训练负责 [begin_i, end_i) 内 pivot 的模型，误差过大时拆成两个模型
+template <class key_t, class val_t>
+void Root<key_t, val_t>::train_root_model(size_t begin_i, size_t end_i) {
+  uint32_t p_len = 0, f_len = 0;
+  partial_key_len_of_pivots(begin_i, end_i, p_len, f_len);
+  size_t m_size = end_i - begin_i;
+  DEBUG_THIS("------ SIndex Root Model(" << models.size() << "): size="
+                                         << m_size << ", p_len=" << p_len
+                                         << ", f_len=" << f_len);
+
+  std::vector<double> m_keys(m_size * f_len);
+  std::vector<double *> m_key_ptrs(m_size);
+  std::vector<size_t> ps(m_size);
+  for (size_t k_i = 0; k_i < m_size; ++k_i) {
+    // k_i 是相对于本 model 的首元素的偏移
+    get_group_pivot(k_i + begin_i).get_model_key(
+        p_len, f_len, m_keys.data() + f_len * k_i);
+    m_key_ptrs[k_i] = m_keys.data() + f_len * k_i;
+    ps[k_i] = k_i + begin_i;
+  }
+
+  models.emplace_back();
+  model_group_begins.push_back(begin_i);
+  model_meta_t &model = models.back();
+  model.weights.resize(f_len + 1, 0);
+  model.p_len = p_len;
+  model.f_len = f_len;
+  model.pivot_num = m_size;
+  model.predict_fn = get_predict_fn(f_len);
+  model_prepare(m_key_ptrs, ps, model.weights.data(), f_len);
+  eval_root_model(models.size() - 1);
+
+  double max_error = std::max(model.max_pos_error, -model.max_neg_error);
+  if (max_error > index_config.root_error_bound &&
+      m_size >= 2 * index_config.root_min_size) {
+    models.pop_back();
+    model_group_begins.pop_back();
+    size_t mid_i = begin_i + m_size / 2;
+    train_root_model(begin_i, mid_i);
+    train_root_model(mid_i, end_i);
+  }
+}
+
+// 计算模型对其 pivot 的最大预测误差
+template <class key_t, class val_t>
+void Root<key_t, val_t>::eval_root_model(size_t model_i) {
+  model_meta_t &model = models[model_i];
+  size_t begin_i = model_group_begins[model_i];
+  int64_t pos_error = 0, neg_error = 0;
+  for (size_t g_i = begin_i; g_i < begin_i + model.pivot_num; ++g_i) {
+    int64_t error = (int64_t)predict(get_group_pivot(g_i), model_i) - (int64_t)g_i;
+    if (error > pos_error) pos_error = error;
+    if (error < neg_error) neg_error = error;
+  }
+  model.max_pos_error = pos_error;
+  model.max_neg_error = neg_error;
+}
+
+template <class key_t, class val_t>
+root_stats_t Root<key_t, val_t>::root_stats() const {
+  root_stats_t stats;
+  stats.model_n = root_model_n;
+  stats.group_n = group_n;
+  double error_sum = 0;
+  for (size_t m_i = 0; m_i < root_model_n; ++m_i) {
+    const model_meta_t &model = models[m_i];
+    stats.max_model_size = std::max(stats.max_model_size, (size_t)model.pivot_num);
+    stats.max_pos_error = std::max(stats.max_pos_error, model.max_pos_error);
+    stats.max_neg_error = std::min(stats.max_neg_error, model.max_neg_error);
+    size_t begin_i = model_group_begins[m_i];
+    for (size_t g_i = begin_i; g_i < begin_i + model.pivot_num; ++g_i) {
+      int64_t error = (int64_t)predict(get_group_pivot(g_i), m_i) - (int64_t)g_i;
+      error_sum += error < 0 ? -error : error;
     }
+  }
+  stats.avg_abs_error = group_n ? error_sum / group_n : 0;
+  return stats;
+}
 
-    models[m_i].weights.resize(f_len + 1, 0);
-    models[m_i].p_len = p_len;
-    models[m_i].f_len = f_len;
-    models[m_i].pivot_num = m_size;
-    model_prepare(m_key_ptrs, ps, models[m_i].weights.data(), f_len);
+template <class key_t, class val_t>
+void Root<key_t, val_t>::group_keys(const std::vector<key_t> &keys,
+                                    std::vector<size_t> &pivot_indexes) const {
+  grouping_by_partial_key(keys, index_config.group_error_bound,
+                          index_config.partial_len_bound,
+                          index_config.forward_step, index_config.backward_step,
+                          index_config.group_min_size,
+                          pivot_indexes);
+}
 
-    // 计算误差
-    int64_t pos_error = 0, neg_error = 0;
-    for(size_t i = 0; i < m_size; ++i) {
-      int64_t pos_pred = predict(m_key_ptrs[i], m_i);
-      int64_t pos_actual = ps[i];
-      int64_t error = pos_pred - pos_actual;
+// 分组只依赖相邻 key 的前缀，所以抽样若干段连续的 key
+template <class key_t, class val_t>
+void Root<key_t, val_t>::tune_config(const std::vector<key_t> &keys,
+                                     std::vector<struct needle_index> &indexs,
+                                     index_config_t &tuned) const {
+  const size_t sample_n = 32, max_sample_size = 16384;
+  std::vector<size_t> sample_begins;
+  size_t sample_size = keys.size();
+  if (keys.size() > sample_n * max_sample_size) {
+    sample_size = max_sample_size;
+    size_t stride = keys.size() / sample_n;
+    for (size_t s_i = 0; s_i < sample_n; ++s_i) {
+      sample_begins.push_back(s_i * stride);
+    }
+  } else {
+    sample_begins.push_back(0);
+  }
 
-      if(error > pos_error) pos_error = error;
-      if(error < neg_error) neg_error = error;
+  auto tune_start = std::chrono::steady_clock::now();
+  const index_config_t base = tuned;
+  double base_cost = 0, base_memory = 0;
+  estimate_config(keys, indexs, sample_begins, sample_size, base, base_cost,
+                  base_memory);
+  bool base_fit = base.memory_budget == 0 || base_memory <= base.memory_budget;
+
+  // best_*: 满足内存预算的代价最小的参数，代价相差不到 2% 时选内存更小的
+  // small_*: 都超出预算时退而选内存最小的参数
+  bool best_found = false;
+  double best_cost = 0, best_memory = 0;
+  index_config_t best_config = base;
+  double small_cost = base_cost, small_memory = base_memory;
+  index_config_t small_config = base;
+  for (size_t pt : {2, 3, 4, 6, 8}) {
+    for (double scale : {0.5, 1.0, 2.0}) {
+      index_config_t candidate = base;
+      candidate.partial_len_bound = pt;
+      candidate.forward_step = base.forward_step * scale;
+      candidate.backward_step = std::max<size_t>(1, base.backward_step * scale);
+      candidate.group_min_size = base.group_min_size * scale;
+      if (!validate_config(candidate)) continue;
+
+      double cost = 0, memory = 0;
+      estimate_config(keys, indexs, sample_begins, sample_size, candidate,
+                      cost, memory);
+      DEBUG_THIS("[Tune] pt=" << pt << " min_size=" << candidate.group_min_size
+                              << " cost=" << cost << " memory=" << memory);
+      if (base.memory_budget == 0 || memory <= base.memory_budget) {
+        bool cheaper = cost < best_cost * 0.98 ||
+                       (cost < best_cost * 1.02 && memory < best_memory);
+        if (!best_found || cheaper) {
+          best_found = true;
+          best_cost = cost;
+          best_memory = memory;
+          best_config = candidate;
+        }
+      }
+      if (memory < small_memory) {
+        small_cost = cost;
+        small_memory = memory;
+        small_config = candidate;
+      }
     }
+  }
 
-    COUT_THIS("Model " << m_i << ":");
-    COUT_THIS("Max pos error: " << pos_error);
-    COUT_THIS("Max neg error: " << neg_error);
-    COUT_THIS("Max error: " << pos_error - neg_error);
+  // 代价只是估计，除非明显更好（低 10%）否则保留当前参数
+  double tuned_cost = base_cost, tuned_memory = base_memory;
+  if (best_found && (!base_fit || best_cost < base_cost * 0.9)) {
+    tuned = best_config;
+    tuned_cost = best_cost;
+    tuned_memory = best_memory;
+  } else if (!base_fit && !best_found) {
+    print_error("No sindex config fits memory budget %lu, use the smallest one\n",
+                base.memory_budget);
+    tuned = small_config;
+    tuned_cost = small_cost;
+    tuned_memory = small_memory;
+  }
+  COUT_THIS("Tuned lookup cost: " << tuned_cost << " cache lines, memory: "
+            << tuned_memory << " bytes (default " << base_cost << ", "
+            << base_memory << ")");
+  COUT_THIS("Tune config time: " << std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - tune_start).count() << "ms");
+}
 
-    // model_errors[m_i].first = pos_error;
-    // model_errors[m_i].second = neg_error;
+// 在抽样的 key 上分组并训练组模型，估计每次查找访问的 cache line 数和索引内存
+// 组内误差窗口小于 linear_search_bound 时线性扫描指纹，否则二分查找，每一步都算一次 miss
+template <class key_t, class val_t>
+void Root<key_t, val_t>::estimate_config(
+    const std::vector<key_t> &keys, std::vector<struct needle_index> &indexs,
+    const std::vector<size_t> &sample_begins, size_t sample_size,
+    const index_config_t &candidate, double &lookup_cost,
+    double &memory) const {
+  size_t sampled_n = 0, sampled_group_n = 0, weight_n = 0;
+  double cost_sum = 0;
+  std::vector<size_t> pivot_indexes;
+  std::vector<double> weight_arena;
+  for (size_t begin_i : sample_begins) {
+    size_t end_i = std::min(keys.size(), begin_i + sample_size);
+    std::vector<key_t> sample(keys.begin() + begin_i, keys.begin() + end_i);
+    grouping_by_partial_key(sample, candidate.group_error_bound,
+                            candidate.partial_len_bound, candidate.forward_step,
+                            candidate.backward_step, candidate.group_min_size,
+                            pivot_indexes);
+    for (size_t g_i = 0; g_i < pivot_indexes.size(); ++g_i) {
+      size_t g_begin = pivot_indexes[g_i];
+      size_t g_end = g_i + 1 == pivot_indexes.size() ? sample.size()
+                                                     : pivot_indexes[g_i + 1];
+      group_t group;
+      weight_arena.clear();
+      group.init(g_end - g_begin, indexs.data() + begin_i + g_begin,
+                 begin_i + g_begin, weight_arena);
+      int64_t pos_error = 0, neg_error = 0;
+      group.get_model_error(pos_error, neg_error);
+      size_t window = pos_error - neg_error + 1;
+      // 最后还要比较一次完整的 key
+      double lines =
+          window < candidate.linear_search_bound
+              ? (window * sizeof(int64_t) + 63) / 64 + 1.0
+              : std::log2((double)window) + 1;
+      cost_sum += lines * (g_end - g_begin);
+      weight_n += group.weight_num();
+    }
+    sampled_n += sample.size();
+    sampled_group_n += pivot_indexes.size();
   }
+
+  // 组目录上的查找：目录能放进缓存的部分不算 miss，之后每多一倍多一次 miss
+  double scale = (double)keys.size() / sampled_n;
+  double group_bytes = sizeof(group_t) + sizeof(key_t) + sizeof(int64_t);
+  double directory_bytes = scale * sampled_group_n * group_bytes;
+  const double cache_bytes = 1 << 20;
+  lookup_cost = 1 + std::log2(std::max(1.0, directory_bytes / cache_bytes)) +
+                cost_sum / sampled_n;
+  memory = keys.size() * sizeof(int64_t) + directory_bytes +
+           scale * weight_n * sizeof(double);
 }
 
 // 最重要的是找到每个组的 pivot 下标
@@ -155,8 +322,10 @@ inline void Root<key_t, val_t>::grouping_by_partial_key(
   size_t common_p_len = 0, max_p_len = 0, f_len = 0;
   double group_error = 0;
   // double avg_group_size = 0, avg_f_len = 0;
-  std::unordered_map<size_t, size_t> common_p_history;
-  std::unordered_map<size_t, size_t> max_p_history;
+  // 当前组内每个 key 处的公共前缀和最长前缀，下标是相对 start_i 的偏移
+  // 每组复用，不再逐个 key 插入哈希表
+  std::vector<uint32_t> common_p_history;
+  std::vector<uint32_t> max_p_history;
 
   // prepare model keys for training
   // std::vector<double> model_keys(keys.size() * sizeof(key_t));
@@ -240,18 +409,20 @@ inline void Root<key_t, val_t>::grouping_by_partial_key(
 }
 
 // 计算每一步的公共和最长前缀和
+// history 中已经算过 [start_i + 1, start_i + history.size()) 处的结果
 template <class key_t, class val_t>
 inline void Root<key_t, val_t>::partial_key_len_by_step(
     const std::vector<key_t> &keys, const size_t start_i,
     const size_t step_start_i, const size_t step_end_i, size_t &common_p_len,
-    size_t &max_p_len, std::unordered_map<size_t, size_t> &common_p_history,
-    std::unordered_map<size_t, size_t> &max_p_history) const {
+    size_t &max_p_len, std::vector<uint32_t> &common_p_history,
+    std::vector<uint32_t> &max_p_history) const {
   assert(start_i < step_end_i);
+  const size_t key_size = key_t::model_key_size();
 
-  if (common_p_history.count(step_end_i) > 0) {
-    INVARIANT(max_p_history.count(step_end_i) > 0);
-    common_p_len = common_p_history[step_end_i];
-    max_p_len = max_p_history[step_end_i];
+  if (step_end_i - start_i < common_p_history.size()) {
+    INVARIANT(max_p_history.size() == common_p_history.size());
+    common_p_len = common_p_history[step_end_i - start_i];
+    max_p_len = max_p_history[step_end_i - start_i];
     return;
   }
 
@@ -261,30 +432,26 @@ inline void Root<key_t, val_t>::partial_key_len_by_step(
 
   // 如果第一轮的 fstep 就超界了需要清空
   if (step_start_i == start_i) {
-    common_p_history.clear();
-    max_p_history.clear();
-    common_p_len =
-        common_prefix_length(0, (uint8_t *)&keys[step_start_i], sizeof(key_t),
-                             (uint8_t *)&keys[step_start_i + 1], sizeof(key_t));
+    common_p_len = keys[step_start_i].common_prefix_length(
+        keys[step_start_i + 1], 0, key_size);
     max_p_len = common_p_len;
-    common_p_history[step_start_i + 1] = common_p_len;
-    max_p_history[step_start_i + 1] = max_p_len;
+    // 下标 0 对应 start_i 本身，不会被查到
+    common_p_history.assign(2, common_p_len);
+    max_p_history.assign(2, max_p_len);
     offset = 2;
   }
+  assert(step_start_i + offset - start_i == common_p_history.size());
 
   for (size_t k_i = step_start_i + offset; k_i < step_end_i; ++k_i) {
-    common_p_len =
-        common_prefix_length(0, (uint8_t *)&keys[k_i - 1], common_p_len,
-                             (uint8_t *)&keys[k_i], sizeof(key_t));
-    size_t adjacent_prefix = common_prefix_length(
-        common_p_len, (uint8_t *)&keys[k_i - 1], sizeof(key_t),
-        (uint8_t *)&keys[k_i], sizeof(key_t));
-    assert(adjacent_prefix <= sizeof(key_t) - common_p_len);
-    if (adjacent_prefix < sizeof(key_t) - common_p_len) {
-      max_p_len = std::max(max_p_len, common_p_len + adjacent_prefix);
+    // 相邻两个 key 的前缀只比较一次，公共前缀是它们的最小值
+    size_t adjacent_prefix =
+        keys[k_i - 1].common_prefix_length(keys[k_i], 0, key_size);
+    common_p_len = std::min(common_p_len, adjacent_prefix);
+    if (adjacent_prefix < key_size) {
+      max_p_len = std::max(max_p_len, adjacent_prefix);
     }
-    common_p_history[k_i] = common_p_len;
-    max_p_history[k_i] = max_p_len;
+    common_p_history.push_back(common_p_len);
+    max_p_history.push_back(max_p_len);
   }
 }
 
@@ -300,20 +467,18 @@ inline void Root<key_t, val_t>::partial_key_len_of_pivots(
     f_len = 1;
     return;
   }
-  p_len = common_prefix_length(
-      0, (uint8_t *)&(get_group_ptr(start_i)->pivot), sizeof(key_t),
-      (uint8_t *)&(get_group_ptr(start_i + 1)->pivot), sizeof(key_t));
+  const size_t key_size = key_t::model_key_size();
+  p_len = get_group_pivot(start_i).common_prefix_length(
+      get_group_pivot(start_i + 1), 0, key_size);
   size_t max_adjacent_prefix = p_len;
 
   for (size_t k_i = start_i + 2; k_i < end_i; ++k_i) {
-    p_len = common_prefix_length(0, (uint8_t *)&(get_group_ptr(k_i - 1)->pivot),
-                                 p_len, (uint8_t *)&(get_group_ptr(k_i)->pivot),
-                                 sizeof(key_t));
-    size_t adjacent_prefix = common_prefix_length(
-        p_len, (uint8_t *)&(get_group_ptr(k_i - 1)->pivot), sizeof(key_t),
-        (uint8_t *)&(get_group_ptr(k_i)->pivot), sizeof(key_t));
-    assert(adjacent_prefix <= sizeof(key_t) - p_len);
-    if (adjacent_prefix < sizeof(key_t) - p_len) {
+    p_len = get_group_pivot(k_i - 1).common_prefix_length(
+        get_group_pivot(k_i), 0, p_len);
+    size_t adjacent_prefix = get_group_pivot(k_i - 1).common_prefix_length(
+        get_group_pivot(k_i), p_len, key_size);
+    assert(adjacent_prefix <= key_size - p_len);
+    if (adjacent_prefix < key_size - p_len) {
       max_adjacent_prefix =
           std::max(max_adjacent_prefix, p_len + adjacent_prefix);
     }
@@ -324,45 +489,123 @@ inline void Root<key_t, val_t>::partial_key_len_of_pivots(
 
 template <class key_t, class val_t>
 inline result_t Root<key_t, val_t>::get(const key_t &key, val_t &val) {
-  group_t *group_ptr = locate_group(key);
-  auto res = group_ptr->get(key, val);
+  if (group_n == 0) return result_t::failed;
+  const group_t *group_ptr = locate_group(key);
+  auto res = group_ptr->get(key, val, index_config.linear_search_bound);
   return res;
 }
 
+template <class key_t, class val_t>
+result_t Root<key_t, val_t>::get_in_group(size_t group_i, const key_t &key,
+                                          val_t &val) const {
+  if (group_i >= group_n) return result_t::failed;
+  return get_group_ptr(group_i)->get(key, val, index_config.linear_search_bound);
+}
+
+template <class key_t, class val_t>
+void Root<key_t, val_t>::group_range(size_t group_i, uint64_t &begin,
+                                     uint64_t &end) const {
+  if (group_i >= group_n) {
+    begin = end = record_n;
+    return;
+  }
+  const group_t *group_ptr = get_group_ptr(group_i);
+  begin = group_ptr->start;
+  end = group_ptr->start + group_ptr->array_size;
+}
+
+template <class key_t, class val_t>
+inline size_t Root<key_t, val_t>::lower_bound(const key_t &key) {
+  if (group_n == 0) return 0;
+  const group_t *group_ptr = locate_group(key);
+  return group_ptr->start + group_ptr->lower_bound(key);
+}
+
+template <class key_t, class val_t>
+size_t Root<key_t, val_t>::memory_usage() const {
+  memory_stats_t stats = memory_stats();
+  return stats.keys + stats.groups + stats.weights + stats.root;
+}
+
+template <class key_t, class val_t>
+memory_stats_t Root<key_t, val_t>::memory_stats() const {
+  memory_stats_t stats;
+  stats.needles = record_n * sizeof(struct needle_index);
+  for (size_t rec_i = 0; rec_i < record_n; ++rec_i) {
+    stats.needles += needle_begin[rec_i].filename.heap_size();
+  }
+  stats.keys = pivots.capacity() * sizeof(key_t);
+  for (const key_t &pivot : pivots) {
+    stats.keys += pivot.heap_size();
+  }
+  stats.groups = (groups.capacity() - groups.size()) * sizeof(group_t);
+  for (const group_t &group : groups) {
+    stats.groups += group.memory_usage();
+  }
+  stats.weights = group_weights.capacity() * sizeof(double);
+  for (const model_meta_t &model : models) {
+    stats.weights += model.weights.capacity() * sizeof(double);
+  }
+  stats.root = sizeof(*this) + pivot_prefixes.capacity() * sizeof(int64_t) +
+               models.capacity() * sizeof(model_meta_t) +
+               model_group_begins.capacity() * sizeof(uint32_t);
+  return stats;
+}
+
+template <class key_t, class val_t>
+void Root<key_t, val_t>::group_stats(size_t group_i,
+                                     group_stats_t &stats) const {
+  get_group_ptr(group_i)->collect_stats(stats);
+}
+
+template <class key_t, class val_t>
+inline const typename Root<key_t, val_t>::group_t *
+Root<key_t, val_t>::locate_group(const key_t &key) const {
+  return get_group_ptr(locate_group_i(key));
+}
+
 // 先指数查找再二分查找，定位到含有该 key 的 group
+// 没有任何 key 时没有组和 root 模型，返回 group_n（即 0）表示找不到
 template <class key_t, class val_t>
-inline typename Root<key_t, val_t>::group_t *
-Root<key_t, val_t>::locate_group(const key_t &key) {
-  int group_i = predict(key);
-  group_i = group_i > (int)group_n - 1 ? group_n - 1 : group_i;
-  group_i = group_i < 0 ? 0 : group_i;
+inline size_t Root<key_t, val_t>::locate_group_i(const key_t &key) const {
+  if (group_n == 0 || root_model_n == 0) return group_n;
+  int64_t key_prefix = route_fingerprint(key);
+  // 目标组一定在模型负责的 [first_group_i, last_group_i] 内
+  size_t model_i = locate_model(key, key_prefix);
+  int first_group_i = model_group_begins[model_i];
+  int last_group_i = first_group_i + models[model_i].pivot_num - 1;
+  int group_i = predict(key, model_i);
+  group_i = group_i > last_group_i ? last_group_i : group_i;
+  group_i = group_i < first_group_i ? first_group_i : group_i;
 
   // exponential search
   int begin_group_i, end_group_i;
   // key 在该预测的 group pivot 的右边（可能在该 group，也可能在更右边）
-  if (get_group_pivot(group_i) <= key) {
+  if (pivot_not_greater(group_i, key, key_prefix)) {
     size_t step = 1;
     begin_group_i = group_i;
     end_group_i = begin_group_i + step;
-    while (end_group_i < (int)group_n && get_group_pivot(end_group_i) <= key) {
+    while (end_group_i <= last_group_i &&
+           pivot_not_greater(end_group_i, key, key_prefix)) {
       step = step * 2;
       begin_group_i = end_group_i;
       end_group_i = begin_group_i + step;
-    }  // after this while loop, end_group_i might be >= group_n
-    if (end_group_i > (int)group_n - 1) {
-      end_group_i = group_n - 1;
+    }  // after this while loop, end_group_i might be > last_group_i
+    if (end_group_i > last_group_i) {
+      end_group_i = last_group_i;
     }
   } else {
     size_t step = 1;
     end_group_i = group_i;
     begin_group_i = end_group_i - step;
-    while (begin_group_i >= 0 && get_group_pivot(begin_group_i) > key) {
+    while (begin_group_i >= first_group_i &&
+           !pivot_not_greater(begin_group_i, key, key_prefix)) {
       step = step * 2;
       end_group_i = begin_group_i;
       begin_group_i = end_group_i - step;
-    }  // after this while loop, begin_group_i might be < 0
-    if (begin_group_i < 0) {
-      begin_group_i = -1;
+    }  // after this while loop, begin_group_i might be < first_group_i
+    if (begin_group_i < first_group_i) {
+      begin_group_i = first_group_i - 1;
     }
   }
   
@@ -374,67 +617,97 @@ Root<key_t, val_t>::locate_group(const key_t &key) {
     // the "+2" term actually should be a "+1" after "/2", this is due to the
     // rounding in c++ when the first operant of "/" operator is negative
     int mid = (end_group_i + begin_group_i + 2) / 2;
-    if (get_group_pivot(mid) <= key) {
+    if (pivot_not_greater(mid, key, key_prefix)) {
       begin_group_i = mid;
     } else {
       end_group_i = mid - 1;
     }
   }
-  // the result falls in [-1, group_n - 1]
-  // now we ensure the pointer is not null
-  group_i = end_group_i < 0 ? 0 : end_group_i;
-  group_t *group = get_group_ptr(group_i);
-  while (group_i > 0 && group == nullptr) {
-    group_i--;
-    group = get_group_ptr(group_i);
-  }
-  // however, we treat the pivot key of the 1st group as -inf, thus we return
-  // 0 when the search result is -1
-  assert(get_group_ptr(0) != nullptr);
+  // the result falls in [first_group_i - 1, last_group_i]
+  // only happens to the 1st model, we treat the pivot key of the 1st group as
+  // -inf, thus we return first_group_i when the search result is out of range
+  group_i = end_group_i < first_group_i ? first_group_i : end_group_i;
+  return group_i;
+}
+
+// pivot <= key，指纹不同时不需要访问完整的 pivot
+template <class key_t, class val_t>
+inline bool Root<key_t, val_t>::pivot_not_greater(size_t group_i,
+                                                  const key_t &key,
+                                                  int64_t key_prefix) const {
+  int64_t pivot_prefix = pivot_prefixes[group_i];
+  return pivot_prefix < key_prefix ||
+         (pivot_prefix == key_prefix && pivots[group_i] <= key);
+}
 
-  return group;
+// 所有组都训练完以后 arena 不再扩容，按组的顺序设置模型参数的指针
+template <class key_t, class val_t>
+void Root<key_t, val_t>::bind_group_weights() {
+  size_t weight_offset = 0;
+  for (group_t &group : groups) {
+    group.bind_weights(group_weights.data() + weight_offset);
+    weight_offset += group.weight_num();
+  }
+  assert(weight_offset == group_weights.size());
 }
 
-// 逐个比较 pivot 然后找到对应的模型去 predict
+// 指纹取所有 pivot 公共前缀之后的 8 个字节
 template <class key_t, class val_t>
-inline size_t Root<key_t, val_t>::predict(const key_t &key) {
-  uint32_t m_i = 0;
-  while (m_i < root_model_n - 1 && key >= model_pivots[m_i + 1]) {
-    m_i++;
-  }
-  uint32_t p_len = models[m_i].p_len, f_len = models[m_i].f_len;
-  double model_key[f_len];
-  key.get_model_key(p_len, f_len, model_key);
-  return model_predict(models[m_i].weights.data(), model_key, f_len);
+void Root<key_t, val_t>::init_pivot_prefixes() {
+  pivot_prefix_len = 0;
+  if (group_n > 1) {
+    pivot_prefix_len = pivots[0].common_prefix_length(
+        pivots[group_n - 1], 0, key_t::model_key_size());
+  }
+  pivot_prefixes.resize(group_n);
+  for (size_t group_i = 0; group_i < group_n; ++group_i) {
+    pivot_prefixes[group_i] = key_fingerprint(pivots[group_i], pivot_prefix_len);
+  }
 }
 
+// 指纹只在 key 也有 pivot 的公共前缀时才和 pivot 的指纹可比
+// 否则 key 小于或大于所有 pivot，用最小或最大的指纹代替，和某个 pivot 的指纹相同时仍会比较完整的 key
 template <class key_t, class val_t>
-inline size_t Root<key_t, val_t>::predict(const double *model_key, uint32_t model_i) {
-  uint32_t f_len = models[model_i].f_len;
-  return model_predict(models[model_i].weights.data(), model_key, f_len);
+inline int64_t Root<key_t, val_t>::route_fingerprint(const key_t &key) const {
+  if (pivot_prefix_len == 0 ||
+      key.common_prefix_length(pivots[0], 0, pivot_prefix_len) == pivot_prefix_len) {
+    return key_fingerprint(key, pivot_prefix_len);
+  }
+  return key < pivots[0] ? INT64_MIN : INT64_MAX;
 }
 
+// 二分查找最后一个 pivot 不大于 key 的模型，第一个模型的 pivot 视为 -inf
 template <class key_t, class val_t>
-inline void Root<key_t, val_t>::set_group_ptr(size_t group_i,
-                                                   group_t *g_ptr) {
-  groups[group_i].second = g_ptr;
+inline size_t Root<key_t, val_t>::locate_model(const key_t &key,
+                                               int64_t key_prefix) const {
+  size_t begin_i = 0, end_i = root_model_n - 1;
+  while (begin_i != end_i) {
+    size_t mid = (begin_i + end_i + 1) / 2;
+    if (pivot_not_greater(model_group_begins[mid], key, key_prefix)) {
+      begin_i = mid;
+    } else {
+      end_i = mid - 1;
+    }
+  }
+  return begin_i;
 }
 
 template <class key_t, class val_t>
-inline typename Root<key_t, val_t>::group_t *
-Root<key_t, val_t>::get_group_ptr(size_t group_i) const {
-  return groups[group_i].second;
+inline size_t Root<key_t, val_t>::predict(const key_t &key, uint32_t model_i) const {
+  const model_meta_t &model = models[model_i];
+  return model_predict_key(model.predict_fn, model.weights.data(), key,
+                           model.p_len, model.f_len);
 }
 
 template <class key_t, class val_t>
-inline void Root<key_t, val_t>::set_group_pivot(size_t group_i,
-                                                     const key_t &key) {
-  groups[group_i].first = key;
+inline const typename Root<key_t, val_t>::group_t *
+Root<key_t, val_t>::get_group_ptr(size_t group_i) const {
+  return &groups[group_i];
 }
 
 template <class key_t, class val_t>
-inline key_t &Root<key_t, val_t>::get_group_pivot(size_t group_i) const {
-  return groups[group_i].first;
+inline const key_t &Root<key_t, val_t>::get_group_pivot(size_t group_i) const {
+  return pivots[group_i];
 }
 
 template <class key_t, class val_t>
@@ -460,8 +733,7 @@ inline void Root<key_t, val_t>::save_model() const {
     
     // 写入 root 模型中的所有 group 模型
     for(size_t group_i = model_group_start; group_i < model_group_start + pivot_num_i; ++group_i) {
-      group_t *group_i_ptr = get_group_ptr(group_i);
-      group_i_ptr->save_group_model(model_file);
+      get_group_ptr(group_i)->save_group_model(model_file);
     }
     model_group_start += pivot_num_i;
   }
@@ -483,7 +755,12 @@ inline void Root<key_t, val_t>::read_model(needle_index *needle_begin) {
   COUT_THIS("The number of groups: " << group_n);
   fread(&root_model_n, sizeof(root_model_n), 1, model_file);
   COUT_THIS("The number of root models: " << root_model_n);
-  groups = std::make_unique<std::pair<key_t, group_t *>[]>(group_n);
+  pivots.resize(group_n);
+  groups.clear();
+  groups.reserve(group_n);
+  group_weights.clear();
+  models.resize(root_model_n);
+  model_group_begins.resize(root_model_n);
   size_t max_group_error = 0;
 
   uint64_t index_cnt = 0;
@@ -493,20 +770,29 @@ inline void Root<key_t, val_t>::read_model(needle_index *needle_begin) {
     fread(&(models[root_model_i].pivot_num), sizeof(models[root_model_i].pivot_num), 1, model_file);
     models[root_model_i].weights.resize(models[root_model_i].f_len + 1);
     fread(models[root_model_i].weights.data(), sizeof(double), models[root_model_i].f_len + 1, model_file);
-    model_pivots[root_model_i] = needle_begin[index_cnt].filename;
+    models[root_model_i].predict_fn = get_predict_fn(models[root_model_i].f_len);
+    model_group_begins[root_model_i] = model_group_start;
     
     // 读入 root 模型中的所有 group 模型
     for(size_t group_i = model_group_start; group_i < model_group_start + models[root_model_i].pivot_num; ++group_i) {
-      group_t *group_ptr = new group_t();
-      set_group_ptr(group_i, group_ptr);
-      set_group_pivot(group_i, needle_begin[index_cnt].filename);
-      group_ptr->read_group_model(model_file, needle_begin + index_cnt, index_cnt);
-      max_group_error = std::max(max_group_error, (size_t)abs(group_ptr->max_pos_error - group_ptr->max_neg_error));
-      index_cnt += group_ptr->array_size;
+      pivots[group_i] = needle_begin[index_cnt].filename;
+      groups.emplace_back();
+      group_t &group = groups.back();
+      group.read_group_model(model_file, needle_begin + index_cnt, index_cnt, group_weights);
+      max_group_error = std::max(max_group_error, (size_t)abs(group.max_pos_error - group.max_neg_error));
+      index_cnt += group.array_size;
     }
     model_group_start += models[root_model_i].pivot_num;
   }
+  bind_group_weights();
+  init_pivot_prefixes();
+  // 误差不保存在模型文件中，读入后重新计算
+  for (size_t m_i = 0; m_i < root_model_n; ++m_i) {
+    eval_root_model(m_i);
+  }
 
+  this->needle_begin = needle_begin;
+  this->record_n = index_cnt;
   COUT_THIS("Group max error: " << max_group_error);
 
   fclose(model_file);
@@ -522,7 +808,7 @@ inline double Root<key_t, val_t>::train_and_get_err(
   std::vector<size_t> positions(key_n);
   for (size_t k_i = 0; k_i < key_n; ++k_i) {
     model_key_ptrs[k_i] =
-        model_keys.data() + (start_i + k_i) * sizeof(key_t) + p_len;
+        model_keys.data() + (start_i + k_i) * key_t::model_key_size() + p_len;
     positions[k_i] = k_i;
   }
 
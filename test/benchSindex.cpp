@@ -0,0 +1,531 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <random>
+#include <vector>
+#include <malloc.h>
+
+#include "constant.h"
+#include "helper.h"
+#include "strkey.h"
+#include "needle.h"
+#include "sindex.h"
+
+using namespace sindex;
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+// 替换全局的 operator new/delete，按 malloc_usable_size 统计堆上实际占用的字节数和峰值
+static std::atomic<size_t> heap_in_use(0), heap_peak(0);
+
+void *operator new(size_t size) {
+    void *ptr = malloc(size ? size : 1);
+    if(ptr == nullptr) throw std::bad_alloc();
+    size_t in_use = heap_in_use.fetch_add(malloc_usable_size(ptr)) + malloc_usable_size(ptr);
+    size_t peak = heap_peak.load();
+    while(in_use > peak && !heap_peak.compare_exchange_weak(peak, in_use)) {}
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    if(ptr == nullptr) return;
+    heap_in_use.fetch_sub(malloc_usable_size(ptr));
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+// 从当前占用开始重新记录峰值，返回当前占用
+static size_t reset_heap_peak() {
+    size_t in_use = heap_in_use.load();
+    heap_peak.store(in_use);
+    return in_use;
+}
+
+static double elapsed_ns(const bench_clock_t::time_point &start, const bench_clock_t::time_point &end) {
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// 随机生成长度在 [min_len, max_len] 之间的文件名
+static std::vector<index_key_t> random_keys(size_t key_num, size_t min_len, size_t max_len, unsigned int seed) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<size_t> len_dist(min_len, max_len);
+    std::uniform_int_distribution<int> char_dist('0', 'z');
+    std::vector<index_key_t> keys(key_num);
+    char buf[MAX_FILE_LEN + 1];
+    for(size_t key_i = 0; key_i < key_num; ++key_i) {
+        size_t len = len_dist(gen);
+        for(size_t i = 0; i < len; ++i) buf[i] = char_dist(gen);
+        keys[key_i].set_key(buf, len);
+    }
+    return keys;
+}
+
+// 预测内核：每个 feature_len 下对比通用版本和各指令集特化版本的单次预测耗时
+int bench_for_predict() {
+    size_t key_num = 0, loop_times = 0;
+    printf("Key num and loop times is:");
+    if(scanf("%ld %ld", &key_num, &loop_times) != 2 || key_num == 0 || loop_times == 0) {
+        print_error("Invalid input\n");
+        return -1;
+    }
+    std::vector<index_key_t> keys = random_keys(key_num, 4, 40, key_num);
+
+    std::vector<const SimdKernels *> kernels;
+    for(simd_level_t level : {simd_level_t::scalar, simd_level_t::sse42, simd_level_t::avx2, simd_level_t::avx512}) {
+        if(simd_supported(level)) kernels.push_back(&simd_kernels(level));
+    }
+    COUT_THIS("Selected SIMD level: " << simd_kernels().name);
+
+    std::mt19937 gen(loop_times);
+    std::uniform_real_distribution<double> weight_dist(-1000, 1000);
+    for(size_t feature_len = 1; feature_len <= 8; ++feature_len) {
+        std::vector<double> weights(feature_len + 1);
+        for(double &w : weights) w = weight_dist(gen);
+        // 偏置足够大使预测值基本为正，不被截断到 0
+        weights[feature_len] = 1e6;
+        size_t prefix_len = feature_len % 3;
+
+        size_t sum = 0;
+        auto start = bench_clock_t::now();
+        for(size_t loop_i = 0; loop_i < loop_times; ++loop_i) {
+            for(const index_key_t &key : keys) {
+                sum += model_predict_key_generic(weights.data(), key, prefix_len, feature_len);
+            }
+        }
+        double generic_cost = elapsed_ns(start, bench_clock_t::now()) / (key_num * loop_times);
+        printf("feature_len %ld: generic %.2fns", feature_len, generic_cost);
+
+        for(const SimdKernels *k : kernels) {
+            predict_bytes_fn_t predict_fn = k->predict_bytes[feature_len];
+            size_t k_sum = 0;
+            start = bench_clock_t::now();
+            for(size_t loop_i = 0; loop_i < loop_times; ++loop_i) {
+                for(const index_key_t &key : keys) {
+                    k_sum += model_predict_key(predict_fn, weights.data(), key, prefix_len, feature_len);
+                }
+            }
+            double cost = elapsed_ns(start, bench_clock_t::now()) / (key_num * loop_times);
+            // 不同指令集的舍入可能不同，校验和只会有很小的差别
+            printf(" | %s %.2fns (%.2fx, checksum diff %ld)", k->name, cost, generic_cost / cost, (long)(k_sum - sum));
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+// 组内最后一步查找：对比不同误差窗口下二分查找和线性扫描指纹的耗时
+int bench_for_last_mile() {
+    size_t key_num = 0, query_num = 0;
+    printf("Key num and query num is:");
+    if(scanf("%ld %ld", &key_num, &query_num) != 2 || key_num < 2 || query_num == 0) {
+        print_error("Invalid input\n");
+        return -1;
+    }
+    // 文件名有较长的共同前缀，和实际的组内 key 相近
+    std::vector<index_key_t> keys = random_keys(key_num, 4, 40, key_num);
+    char buf[MAX_FILE_LEN + 1];
+    for(index_key_t &key : keys) {
+        sprintf(buf, "dir/sub/%s", key.c_str());
+        key.set_key(buf);
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    key_num = keys.size();
+
+    size_t prefix_len = keys.front().common_prefix_length(keys.back(), 0, index_key_t::model_key_size());
+    std::vector<int64_t> fingerprints(key_num);
+    for(size_t key_i = 0; key_i < key_num; ++key_i) {
+        fingerprints[key_i] = key_fingerprint(keys[key_i], prefix_len);
+    }
+
+    std::mt19937 gen(query_num);
+    COUT_THIS("SIMD level: " << simd_kernels().name);
+    for(size_t window : {4, 8, 16, 32, 64, 128, 256, 512}) {
+        window = std::min(window, key_num);
+        // 查询的 key 在窗口内的任意位置
+        std::vector<size_t> targets(query_num), begins(query_num);
+        for(size_t query_i = 0; query_i < query_num; ++query_i) {
+            targets[query_i] = gen() % key_num;
+            size_t lowest = targets[query_i] + 1 >= window ? targets[query_i] + 1 - window : 0;
+            size_t highest = std::min(targets[query_i], key_num - window);
+            begins[query_i] = lowest + gen() % (highest - lowest + 1);
+        }
+
+        size_t wrong = 0;
+        auto start = bench_clock_t::now();
+        for(size_t query_i = 0; query_i < query_num; ++query_i) {
+            const index_key_t &key = keys[targets[query_i]];
+            size_t begin = begins[query_i], end = begin + window - 1;
+            while(begin != end) {
+                size_t mid = (begin + end) / 2;
+                if(keys[mid] < key) begin = mid + 1;
+                else end = mid;
+            }
+            wrong += begin != targets[query_i];
+        }
+        double binary_cost = elapsed_ns(start, bench_clock_t::now()) / query_num;
+
+        start = bench_clock_t::now();
+        for(size_t query_i = 0; query_i < query_num; ++query_i) {
+            const index_key_t &key = keys[targets[query_i]];
+            size_t begin = begins[query_i], end = begin + window - 1;
+            int64_t fingerprint = key_fingerprint(key, prefix_len);
+            size_t pos = begin + simd_kernels().count_less(fingerprints.data() + begin, window, fingerprint);
+            while(pos < end && fingerprints[pos] == fingerprint && keys[pos] < key) ++pos;
+            wrong += std::min(pos, end) != targets[query_i];
+        }
+        double linear_cost = elapsed_ns(start, bench_clock_t::now()) / query_num;
+        printf("window %4ld: binary %.2fns | linear %.2fns | speedup %.2fx | wrong %ld\n",
+            window, binary_cost, linear_cost, binary_cost / linear_cost, wrong);
+    }
+    return 0;
+}
+
+// 整个索引的查找：随机点查和 lower_bound 的平均耗时以及索引占用的内存
+int bench_for_lookup() {
+    size_t key_num = 0, query_num = 0, random_name = 0;
+    printf("Key num, query num and random name(0/1) is:");
+    if(scanf("%ld %ld %ld", &key_num, &query_num, &random_name) != 3 || key_num < 2 || query_num == 0) {
+        print_error("Invalid input\n");
+        return -1;
+    }
+    std::vector<struct needle_index> indexs(key_num);
+    if(random_name) {
+        // 随机长度和内容的文件名，分布不均匀
+        std::vector<index_key_t> names = random_keys(key_num, 4, 40, key_num);
+        for(size_t key_i = 0; key_i < key_num; ++key_i) indexs[key_i].filename = names[key_i];
+    }
+    else {
+        // 和 createFile 生成的文件名类似，再分散到若干目录下
+        char buf[MAX_FILE_LEN + 1];
+        for(size_t key_i = 0; key_i < key_num; ++key_i) {
+            sprintf(buf, "dir%03ld/%s%0*ld%s", key_i % 100, FILEPREFIX, FILE_ID_LEN, key_i, FILESUFFIX);
+            indexs[key_i].filename.set_key(buf);
+        }
+    }
+    for(struct needle_index &needle : indexs) needle.flags = FILE_EXIT;
+    std::sort(indexs.begin(), indexs.end(),
+        [](const struct needle_index &a, const struct needle_index &b) { return a.filename < b.filename; });
+    indexs.erase(std::unique(indexs.begin(), indexs.end(),
+        [](const struct needle_index &a, const struct needle_index &b) { return a.filename == b.filename; }), indexs.end());
+    key_num = indexs.size();
+    std::vector<index_key_t> keys(key_num);
+    for(size_t key_i = 0; key_i < key_num; ++key_i) keys[key_i] = indexs[key_i].filename;
+    std::vector<uint64_t> vals(key_num);
+    for(size_t key_i = 0; key_i < key_num; ++key_i) vals[key_i] = key_i;
+
+    auto start = bench_clock_t::now();
+    SIndex<index_key_t, uint64_t> sindex_model(keys, vals, indexs);
+    double build_cost = elapsed_ns(start, bench_clock_t::now());
+    keys.clear();
+    keys.shrink_to_fit();
+
+    std::mt19937_64 gen(query_num);
+    std::vector<size_t> targets(query_num);
+    for(size_t &target : targets) target = gen() % key_num;
+
+    size_t wrong = 0;
+    start = bench_clock_t::now();
+    for(size_t target : targets) {
+        uint64_t pos = 0;
+        wrong += !sindex_model.get(indexs[target].filename, pos) || pos != target;
+    }
+    double get_cost = elapsed_ns(start, bench_clock_t::now()) / query_num;
+
+    start = bench_clock_t::now();
+    for(size_t target : targets) {
+        wrong += sindex_model.lower_bound(indexs[target].filename) != target;
+    }
+    double lower_bound_cost = elapsed_ns(start, bench_clock_t::now()) / query_num;
+
+    COUT_THIS("Build time: " << build_cost / 1e6 << "ms");
+    COUT_THIS("Get: " << get_cost << "ns/op");
+    COUT_THIS("Lower bound: " << lower_bound_cost << "ns/op");
+    COUT_THIS("Index memory: " << sindex_model.memory_usage() << " bytes");
+    root_stats_t stats = sindex_model.root_stats();
+    COUT_THIS("Root models: " << stats.model_n << " for " << stats.group_n << " groups, max size " << stats.max_model_size);
+    COUT_THIS("Root error: max pos " << stats.max_pos_error << ", max neg " << stats.max_neg_error
+        << ", avg " << stats.avg_abs_error);
+    COUT_THIS("Wrong: " << wrong);
+    return 0;
+}
+
+// 贪心分组的耗时，顺序文件名按序直接生成，避免大数据量下的排序
+int bench_for_grouping() {
+    size_t key_num = 0, random_name = 0;
+    printf("Key num and random name(0/1) is:");
+    if(scanf("%ld %ld", &key_num, &random_name) != 2 || key_num < 2) {
+        print_error("Invalid input\n");
+        return -1;
+    }
+    std::vector<index_key_t> keys;
+    if(random_name) {
+        keys = random_keys(key_num, 4, 40, key_num);
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    }
+    else {
+        keys.resize(key_num);
+        char buf[MAX_FILE_LEN + 1];
+        size_t key_i = 0;
+        for(size_t dir_i = 0; dir_i < 100; ++dir_i) {
+            for(size_t file_i = dir_i; file_i < key_num; file_i += 100) {
+                sprintf(buf, "dir%03ld/%s%0*ld%s", dir_i, FILEPREFIX, FILE_ID_LEN, file_i, FILESUFFIX);
+                keys[key_i++].set_key(buf);
+            }
+        }
+    }
+
+    Root<index_key_t, uint64_t> root;
+    std::vector<size_t> pivot_indexes;
+    auto start = bench_clock_t::now();
+    root.group_keys(keys, pivot_indexes);
+    double grouping_cost = elapsed_ns(start, bench_clock_t::now());
+    // 用于确认分组结果没有变化
+    size_t checksum = 0;
+    for(size_t pivot_index : pivot_indexes) checksum = checksum * 31 + pivot_index;
+    COUT_THIS("Keys: " << keys.size() << ", groups: " << pivot_indexes.size() << ", checksum: " << checksum);
+    COUT_THIS("Grouping time: " << grouping_cost / 1e6 << "ms (" << grouping_cost / keys.size() << "ns/key)");
+    return 0;
+}
+
+// 组模型的训练：对比一遍累加正规方程（当前的实现）和先构造整个特征矩阵再用 dgelss 求解（原来的实现）
+// 两者在同样的分组上训练，输出总耗时、单个组训练时的最大临时内存和误差窗口
+// dgelss 来自链接的 MKL，耗时和 MKL 的版本及线程数有关
+int bench_for_training() {
+    size_t key_num = 0, random_name = 0;
+    printf("Key num and random name(0/1) is:");
+    if(scanf("%ld %ld", &key_num, &random_name) != 2 || key_num < 2) {
+        print_error("Invalid input\n");
+        return -1;
+    }
+    std::vector<struct needle_index> indexs(key_num);
+    if(random_name) {
+        std::vector<index_key_t> names = random_keys(key_num, 4, 40, key_num);
+        for(size_t key_i = 0; key_i < key_num; ++key_i) indexs[key_i].filename = names[key_i];
+    }
+    else {
+        char buf[MAX_FILE_LEN + 1];
+        for(size_t key_i = 0; key_i < key_num; ++key_i) {
+            sprintf(buf, "dir%03ld/%s%0*ld%s", key_i % 100, FILEPREFIX, FILE_ID_LEN, key_i, FILESUFFIX);
+            indexs[key_i].filename.set_key(buf);
+        }
+    }
+    std::sort(indexs.begin(), indexs.end(),
+        [](const struct needle_index &a, const struct needle_index &b) { return a.filename < b.filename; });
+    indexs.erase(std::unique(indexs.begin(), indexs.end(),
+        [](const struct needle_index &a, const struct needle_index &b) { return a.filename == b.filename; }), indexs.end());
+    std::vector<index_key_t> keys(indexs.size());
+    for(size_t key_i = 0; key_i < indexs.size(); ++key_i) keys[key_i] = indexs[key_i].filename;
+
+    // 分组和每组的 prefix_len、feature_len 都和建索引时相同，不计入耗时
+    Root<index_key_t, uint64_t> root;
+    std::vector<size_t> pivot_indexes;
+    root.group_keys(keys, pivot_indexes);
+    size_t group_n = pivot_indexes.size();
+    std::vector<group_stats_t> stats(group_n);
+    for(size_t group_i = 0; group_i < group_n; ++group_i) {
+        size_t begin_i = pivot_indexes[group_i];
+        size_t end_i = group_i + 1 == group_n ? keys.size() : pivot_indexes[group_i + 1];
+        std::vector<double> weight_arena;
+        Group<index_key_t, uint64_t> group;
+        group.init(end_i - begin_i, indexs.data() + begin_i, begin_i, weight_arena);
+        group.collect_stats(stats[group_i]);
+    }
+    // 两种方法得到的模型在组内 key 上的误差窗口
+    auto error_window = [&](size_t group_i, const std::vector<double> &weights) {
+        size_t begin_i = pivot_indexes[group_i], p_len = stats[group_i].prefix_len, f_len = stats[group_i].feature_len;
+        int64_t pos_error = 0, neg_error = 0;
+        for(size_t rec_i = 0; rec_i < stats[group_i].size; ++rec_i) {
+            int64_t error = (int64_t)rec_i - (int64_t)model_predict_key_generic(weights.data(),
+                indexs[begin_i + rec_i].filename, p_len, f_len);
+            pos_error = std::max(pos_error, error);
+            neg_error = std::min(neg_error, error);
+        }
+        return (size_t)(pos_error - neg_error + 1);
+    };
+    // 输出的权重先分配好，不计入两种方法的峰值
+    std::vector<std::vector<double>> stream_weights(group_n), dense_weights(group_n);
+    for(size_t group_i = 0; group_i < group_n; ++group_i) {
+        stream_weights[group_i].resize(stats[group_i].feature_len + 1);
+        dense_weights[group_i].resize(stats[group_i].feature_len + 1);
+    }
+
+    // 当前的实现：一遍累加，只保存 feature_len 维的方程组，数值出错的组退回 SVD，它的稠密矩阵也计入峰值
+    size_t heap_base = reset_heap_peak(), fallback_base = model_svd_fallback_n.load();
+    auto start = bench_clock_t::now();
+    for(size_t group_i = 0; group_i < group_n; ++group_i) {
+        size_t begin_i = pivot_indexes[group_i], p_len = stats[group_i].prefix_len, f_len = stats[group_i].feature_len;
+        model_prepare(stats[group_i].size,
+            [&](size_t rec_i, double *model_key) {
+                indexs[begin_i + rec_i].filename.get_model_key(p_len, f_len, model_key);
+                return (double)rec_i;
+            },
+            stream_weights[group_i].data(), f_len);
+    }
+    double stream_cost = elapsed_ns(start, bench_clock_t::now());
+    size_t stream_peak = heap_peak.load() - heap_base, stream_fallback = model_svd_fallback_n.load() - fallback_base;
+
+    // 原来的实现：构造 m×feature_len 的特征矩阵，去掉不变的特征后复制一份 m×(n+1) 的矩阵交给 dgelss
+    heap_base = reset_heap_peak();
+    start = bench_clock_t::now();
+    for(size_t group_i = 0; group_i < group_n; ++group_i) {
+        size_t begin_i = pivot_indexes[group_i], m = stats[group_i].size;
+        size_t p_len = stats[group_i].prefix_len, f_len = stats[group_i].feature_len;
+        std::vector<double> features(m * f_len);
+        for(size_t rec_i = 0; rec_i < m; ++rec_i) {
+            indexs[begin_i + rec_i].filename.get_model_key(p_len, f_len, features.data() + rec_i * f_len);
+        }
+        std::vector<size_t> useful_feat_index;
+        for(size_t f_i = 0; f_i < f_len; ++f_i) {
+            for(size_t rec_i = 1; rec_i < m; ++rec_i) {
+                if(features[rec_i * f_len + f_i] != features[f_i]) {
+                    useful_feat_index.push_back(f_i);
+                    break;
+                }
+            }
+        }
+        std::fill(dense_weights[group_i].begin(), dense_weights[group_i].end(), 0);
+        if(m > 1 && !useful_feat_index.empty()) {
+            auto get_key = [&](size_t rec_i, double *model_key) {
+                std::copy(features.begin() + rec_i * f_len, features.begin() + (rec_i + 1) * f_len, model_key);
+                return (double)rec_i;
+            };
+            model_prepare_svd(m, get_key, 1, useful_feat_index, dense_weights[group_i].data(), f_len);
+        }
+    }
+    double dense_cost = elapsed_ns(start, bench_clock_t::now());
+    size_t dense_peak = heap_peak.load() - heap_base;
+
+    size_t stream_window = 0, stream_max_window = 0, dense_window = 0, dense_max_window = 0;
+    for(size_t group_i = 0; group_i < group_n; ++group_i) {
+        size_t window = error_window(group_i, stream_weights[group_i]);
+        stream_window += window;
+        stream_max_window = std::max(stream_max_window, window);
+        window = error_window(group_i, dense_weights[group_i]);
+        dense_window += window;
+        dense_max_window = std::max(dense_max_window, window);
+    }
+
+    COUT_THIS("Keys: " << keys.size() << ", groups: " << group_n);
+    COUT_THIS("Streaming: " << stream_cost / 1e6 << "ms, peak training memory " << stream_peak
+        << " bytes, SVD fallback groups " << stream_fallback
+        << ", avg window " << (double)stream_window / group_n << ", max window " << stream_max_window);
+    COUT_THIS("Dense dgelss: " << dense_cost / 1e6 << "ms, peak training memory " << dense_peak
+        << " bytes, avg window " << (double)dense_window / group_n << ", max window " << dense_max_window);
+    COUT_THIS("Speedup: " << dense_cost / stream_cost << "x, memory ratio: " << (double)dense_peak / stream_peak << "x");
+    return 0;
+}
+
+// 正确性检查：共同前缀很长的文件名之外再混入几个前缀不同的，和 std::lower_bound 的结果逐个比较
+// 存在的 key 都要能查到，不存在的 key 的 lower_bound 要正确，而且都要落在 locate_group 给出的组内
+// 最后检查空索引上的查找
+int check_for_mixed_prefix() {
+    size_t key_num = 0;
+    printf("Key num is:");
+    if(scanf("%ld", &key_num) != 1 || key_num < 2) {
+        print_error("Invalid input\n");
+        return -1;
+    }
+    std::vector<std::string> names;
+    char buf[MAX_FILE_LEN + 1];
+    for(size_t key_i = 0; key_i < key_num; ++key_i) {
+        sprintf(buf, "dir/%s%0*ld%s", FILEPREFIX, FILE_ID_LEN, key_i, FILESUFFIX);
+        names.push_back(buf);
+    }
+    // 排在最后一个 pivot 之后、没有 pivot 公共前缀的文件名，它们和第一个文件名之前的 key 最容易被分错组
+    for(const char *name : {"eee", "readme.txt", "zzz"}) names.push_back(name);
+    std::sort(names.begin(), names.end());
+
+    std::vector<struct needle_index> indexs(names.size());
+    std::vector<index_key_t> keys(names.size());
+    std::vector<uint64_t> vals(names.size());
+    for(size_t key_i = 0; key_i < names.size(); ++key_i) {
+        indexs[key_i].filename.set_key(names[key_i].c_str());
+        indexs[key_i].flags = FILE_EXIT;
+        keys[key_i] = indexs[key_i].filename;
+        vals[key_i] = key_i;
+    }
+    SIndex<index_key_t, uint64_t> sindex_model(keys, vals, indexs);
+
+    // 不存在的 key：各个文件名的前后和公共前缀的各个截断
+    std::vector<std::string> probes = {"", "0", "a", "aaa/b", "dir", "dir/", "dir/a", "dir/zzz", "e", "eef", "readme", "~"};
+    for(const std::string &name : names) {
+        probes.push_back(name + "0");
+        probes.push_back(name.substr(0, name.size() - 1));
+    }
+    size_t wrong = 0;
+    auto check_group = [&](const index_key_t &key, size_t pos) {
+        uint64_t begin = 0, end = 0;
+        sindex_model.group_range(sindex_model.locate_group(key), begin, end);
+        // 小于第一个 pivot 的 key 落在第 0 组的开头，lower_bound 可以等于组的末尾
+        return pos >= begin && pos <= end;
+    };
+    for(size_t key_i = 0; key_i < keys.size(); ++key_i) {
+        uint64_t pos = 0;
+        if(!sindex_model.get(keys[key_i], pos) || pos != key_i || !check_group(keys[key_i], key_i)) {
+            print_error("Get %s failed\n", keys[key_i].c_str());
+            ++wrong;
+        }
+    }
+    for(const std::string &probe : probes) {
+        index_key_t key(probe);
+        size_t expected = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        size_t pos = sindex_model.lower_bound(key);
+        if(pos != expected || !check_group(key, expected)) {
+            print_error("Lower bound of \"%s\" is %ld, expected %ld\n", probe.c_str(), pos, expected);
+            ++wrong;
+        }
+    }
+
+    // 没有 key 时没有组，查找不能访问 pivot
+    std::vector<struct needle_index> empty_indexs;
+    std::vector<index_key_t> empty_keys;
+    std::vector<uint64_t> empty_vals;
+    SIndex<index_key_t, uint64_t> empty_model(empty_keys, empty_vals, empty_indexs);
+    uint64_t pos = 0, begin = 0, end = 0;
+    empty_model.group_range(empty_model.locate_group(keys[0]), begin, end);
+    if(empty_model.get(keys[0], pos) || empty_model.lower_bound(keys[0]) != 0 || begin != end) {
+        print_error("Lookup on empty index failed\n");
+        ++wrong;
+    }
+    COUT_THIS("Keys: " << keys.size() << ", probes: " << probes.size() << ", groups: " << sindex_model.group_num());
+    COUT_THIS("Wrong: " << wrong);
+    return wrong ? 1 : 0;
+}
+
+int main() {
+    // 和 sfcas 一样读取默认的 ini，便于比较不同的参数
+    index_config_t bench_config = config;
+    if(access(SINDEX_CONFIG_FILE, R_OK) == 0) {
+        if(!read_config_ini(SINDEX_CONFIG_FILE, bench_config) || !set_index_config(bench_config)) return -1;
+        print_config(config);
+    }
+    int test_type = 0;
+    printf("Bench for:\npredict kernel(0) | last-mile search(1) | lookup(2) | grouping(3) | mixed-prefix check(4) | training(5):");
+    if(scanf("%d", &test_type) != 1) return -1;
+    if(test_type == 0) {
+        return bench_for_predict();
+    }
+    else if(test_type == 1) {
+        return bench_for_last_mile();
+    }
+    else if(test_type == 2) {
+        return bench_for_lookup();
+    }
+    else if(test_type == 3) {
+        return bench_for_grouping();
+    }
+    else if(test_type == 4) {
+        return check_for_mixed_prefix();
+    }
+    else if(test_type == 5) {
+        return bench_for_training();
+    }
+    return 0;
+}